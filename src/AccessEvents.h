@@ -0,0 +1,213 @@
+#ifndef ACCESSEVENTS_H
+#define ACCESSEVENTS_H
+
+#include "types.h"
+#include "Desfire.h"
+#include "UserManager.h"
+
+// The payload format of the access event batches
+#define ACCESS_FORMAT_JSON 1 // [{"t":..,"result":"granted","uid":"04A1B2C3D4E5F6","doors":1,"card":"desfire","ms":[..]}, ...]
+#define ACCESS_FORMAT_CSV 2  // one line per event: t,result,uid,doors,card,detect,identify,authenticate,total
+
+#define ACCESS_EVENT_FORMAT ACCESS_FORMAT_JSON
+// A batch is published when the oldest event is ACCESS_EVENT_WINDOW ms old or ACCESS_EVENT_BATCH events are waiting
+#define ACCESS_EVENT_WINDOW 5000
+#define ACCESS_EVENT_BATCH 4
+// Events that can be buffered while MQTT is slow. If it is full the oldest event is discarded.
+#define ACCESS_EVENT_BUFFER 16
+
+// The outcome of a tap
+enum eAccessResult
+{
+    ACCESS_GRANTED = 0,
+    ACCESS_UNKNOWN,          // the UID is not enrolled
+    ACCESS_NOT_PERSONALIZED, // the user is enrolled, but the card is not a Desfire card or has other keys
+    ACCESS_TIMEOUT,          // the card has been removed or is too far away from the reader
+    ACCESS_READER_FAULT,     // the PN532 does not respond and is reset
+    ACCESS_RESULT_COUNT
+};
+
+// The phases of the card pipeline that are timed for each tap, in the order of the "ms" array and the CSV columns
+enum eAccessPhase
+{
+    PHASE_DETECT = 0, // ReadPassiveTargetID
+    PHASE_IDENTIFY,   // real UID of a random ID card + user lookup
+    PHASE_AUTHENTICATE,
+    PHASE_COUNT
+};
+
+const char *ACCESS_RESULT_NAMES[ACCESS_RESULT_COUNT] = {"granted", "unknown", "not_personalized", "timeout", "reader_fault"};
+
+struct kAccessEvent
+{
+    uint32_t u32_Time;                     // milliseconds since startup
+    uint64_t u64_ID;                       // the card UID, 0 if the card could not be read
+    byte u8_Result;                        // eAccessResult
+    byte u8_Doors;                         // DOOR_ONE | DOOR_TWO that have been opened
+    byte u8_CardType;                      // eCardType of the desfire_rfid library
+    uint16_t u16_PhaseMillis[PHASE_COUNT]; // the duration of each phase, 0 if the phase has not been reached
+    uint16_t u16_TotalMillis;              // from switching on the RF field until the decision
+};
+
+// Called by DoorOpener after each decision
+typedef void (*AccessEventCallback)(const kAccessEvent *pk_Event);
+
+// Collects the access events and formats them into batches, so a busy door does not cause one MQTT message per tap.
+// The formatting writes into a buffer of the caller (the MqttClient queue), no heap memory is used.
+class AccessEventBatch
+{
+public:
+    AccessEventBatch()
+    {
+        mu8_Format = ACCESS_EVENT_FORMAT;
+        mu32_Window = ACCESS_EVENT_WINDOW;
+        mu8_BatchSize = ACCESS_EVENT_BATCH;
+        mu8_Head = 0;
+        mu8_Count = 0;
+        mu32_Events = 0;
+        mu32_Overflows = 0;
+    }
+
+    // u8_Format = ACCESS_FORMAT_JSON or ACCESS_FORMAT_CSV
+    void Configure(byte u8_Format, uint32_t u32_Window, byte u8_BatchSize)
+    {
+        mu8_Format = u8_Format;
+        mu32_Window = u32_Window;
+        mu8_BatchSize = max((byte)1, min(u8_BatchSize, (byte)ACCESS_EVENT_BUFFER));
+    }
+
+    void Add(const kAccessEvent *pk_Event)
+    {
+        if (mu8_Count == ACCESS_EVENT_BUFFER)
+        {
+            mu8_Head = (mu8_Head + 1) % ACCESS_EVENT_BUFFER;
+            mu8_Count--;
+            mu32_Overflows++;
+        }
+
+        mk_Events[(mu8_Head + mu8_Count) % ACCESS_EVENT_BUFFER] = *pk_Event;
+        mu8_Count++;
+        mu32_Events++;
+    }
+
+    // true if a batch should be published now
+    bool IsDue(uint32_t u32_Now)
+    {
+        if (mu8_Count == 0)
+            return false;
+
+        return mu8_Count >= mu8_BatchSize || u32_Now - mk_Events[mu8_Head].u32_Time >= mu32_Window;
+    }
+
+    // Writes the oldest events (at most one batch) into s8_Buffer and removes them.
+    // Events that do not fit into the buffer remain for the next batch.
+    // Returns the number of events written.
+    int Format(char *s8_Buffer, int s32_Size)
+    {
+        int s32_Pos = 0;
+        int s32_Written = 0;
+        if (mu8_Format == ACCESS_FORMAT_JSON)
+            s32_Pos = Append(s8_Buffer, s32_Size, 0, "[");
+
+        while (mu8_Count > 0 && s32_Written < mu8_BatchSize)
+        {
+            // Reserve 2 characters for the closing bracket
+            int s32_End = FormatEvent(s8_Buffer, s32_Size - 2, s32_Pos, &mk_Events[mu8_Head], s32_Written > 0);
+            if (s32_End < 0)
+                break;
+
+            s32_Pos = s32_End;
+            mu8_Head = (mu8_Head + 1) % ACCESS_EVENT_BUFFER;
+            mu8_Count--;
+            s32_Written++;
+        }
+
+        if (mu8_Format == ACCESS_FORMAT_JSON)
+            Append(s8_Buffer, s32_Size, s32_Pos, "]");
+
+        // An event that is larger than the buffer would block the queue forever
+        if (s32_Written == 0 && mu8_Count > 0)
+        {
+            mu8_Head = (mu8_Head + 1) % ACCESS_EVENT_BUFFER;
+            mu8_Count--;
+            mu32_Overflows++;
+        }
+        return s32_Written;
+    }
+
+    void Clear()
+    {
+        mu8_Count = 0;
+    }
+
+    // Statistics since startup
+    uint32_t GetEventCount()
+    {
+        return mu32_Events;
+    }
+
+    uint32_t GetOverflowCount()
+    {
+        return mu32_Overflows;
+    }
+
+    byte GetPendingCount()
+    {
+        return mu8_Count;
+    }
+
+private:
+    byte mu8_Format;
+    uint32_t mu32_Window;
+    byte mu8_BatchSize;
+    kAccessEvent mk_Events[ACCESS_EVENT_BUFFER];
+    byte mu8_Head;  // Index of the oldest event
+    byte mu8_Count; // Number of buffered events
+    uint32_t mu32_Events;
+    uint32_t mu32_Overflows;
+
+    // Appends the event at s32_Pos. Returns the new end or -1 if it does not fit.
+    int FormatEvent(char *s8_Buffer, int s32_Size, int s32_Pos, kAccessEvent *pk_Event, bool b_Separator)
+    {
+        char s8_Uid[15];
+        UserManager::FormatUid(pk_Event->u64_ID, s8_Uid);
+
+        const char *s8_Card = pk_Event->u8_CardType == CARD_DesRandom ? "random" : (pk_Event->u8_CardType == CARD_Desfire ? "desfire" : "classic");
+        const uint16_t *u16_Ms = pk_Event->u16_PhaseMillis;
+        int s32_Len;
+        if (mu8_Format == ACCESS_FORMAT_JSON)
+        {
+            s32_Len = snprintf(s8_Buffer + s32_Pos, s32_Size - s32_Pos,
+                               "%s{\"t\":%u,\"result\":\"%s\",\"uid\":\"%s\",\"doors\":%u,\"card\":\"%s\",\"ms\":[%u,%u,%u,%u]}",
+                               b_Separator ? "," : "", pk_Event->u32_Time, ACCESS_RESULT_NAMES[pk_Event->u8_Result], s8_Uid,
+                               pk_Event->u8_Doors, s8_Card, u16_Ms[PHASE_DETECT], u16_Ms[PHASE_IDENTIFY],
+                               u16_Ms[PHASE_AUTHENTICATE], pk_Event->u16_TotalMillis);
+        }
+        else
+        {
+            s32_Len = snprintf(s8_Buffer + s32_Pos, s32_Size - s32_Pos, "%u,%s,%s,%u,%s,%u,%u,%u,%u\n",
+                               pk_Event->u32_Time, ACCESS_RESULT_NAMES[pk_Event->u8_Result], s8_Uid,
+                               pk_Event->u8_Doors, s8_Card, u16_Ms[PHASE_DETECT], u16_Ms[PHASE_IDENTIFY],
+                               u16_Ms[PHASE_AUTHENTICATE], pk_Event->u16_TotalMillis);
+        }
+
+        if (s32_Len < 0 || s32_Pos + s32_Len >= s32_Size)
+        {
+            s8_Buffer[s32_Pos] = 0;
+            return -1;
+        }
+        return s32_Pos + s32_Len;
+    }
+
+    int Append(char *s8_Buffer, int s32_Size, int s32_Pos, const char *s8_Text)
+    {
+        int s32_Len = strlen(s8_Text);
+        if (s32_Pos + s32_Len >= s32_Size)
+            return s32_Pos;
+
+        strcpy(s8_Buffer + s32_Pos, s8_Text);
+        return s32_Pos + s32_Len;
+    }
+};
+
+#endif // ACCESSEVENTS_H
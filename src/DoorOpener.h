@@ -13,6 +13,12 @@
 // IMPORTANT: Before changing this compiler switch, please execute the RESTORE command on all personalized cards!
 #define USE_AES false
 
+// true -> the secret check (CARD_AUTHENTICATE) skips the PICC level commands SelectApplication(0) and GetKeyVersion().
+// The card of an enrolled user has been personalized by AddCard(), so its PICC master key version is known.
+// A card that is not personalized fails in Authenticate() with the application key anyway.
+// This saves two PN532 round trips per tap with a default Desfire card.
+#define FAST_DESFIRE_CHECK true
+
 // This password will be required when entering via Terminal
 // If you define an empty string here, no password is requested.
 // If any unauthorized person may access the dooropener hardware phyically you should provide a password!
@@ -41,12 +47,22 @@
 // The software SPI SSEL pin (Chip Select)
 #define SPI_CS_PIN D8
 
+// The bus to the PN532: TRANSPORT_SOFT_SPI, TRANSPORT_HARD_SPI or TRANSPORT_I2C (see ReaderTransport.h).
+// The hardware buses must be enabled in PN532.h of the desfire_rfid library (USE_HARDWARE_SPI, USE_HARDWARE_I2C).
+// The hardware SPI uses the same pins as the software SPI.
+#define PN532_TRANSPORT TRANSPORT_SOFT_SPI
+// The hardware SPI clock in Hz (the PN532 supports up to 5 MHz, long cables need less)
+#define PN532_HARD_SPI_CLOCK 1000000
+// The I2C clock in Hz (100 kHz or 400 kHz)
+#define PN532_I2C_CLOCK 400000
+
 // The interval in milliseconds that the relay is powered which opens the door
 #define OPEN_INTERVAL 3000
 
 #define OPEN_INVERT false
 
-// This is the interval that the RF field is switched off to save battery.
+// This is the interval that the RF field is switched off to save battery during normal activity.
+// PollScheduler polls faster while someone is at the door and backs off up to POLL_INTERVAL_IDLE when nobody is.
 // The shorter this interval, the more power is consumed by the PN532.
 // The longer  this interval, the longer the user has to wait until the door opens.
 // The recommended interval is 1000 ms.
@@ -64,10 +80,17 @@
 #define DEFAULT_APP_KEY gi_PN532.DES3_DEFAULT_KEY
 #endif
 
-#include "Desfire.h"
+#include "DoorReader.h"
 #include "Secrets.h"
 #include "Buffer.h"
 #include "UserManager.h"
+#include "SecretCache.h"
+#include "Sequencer.h"
+#include "RelayController.h"
+#include "PollScheduler.h"
+#include "ReaderTransport.h"
+#include "AccessEvents.h"
+#include "LatencyStats.h"
 #include "debug.h"
 
 // The tick counter starts at zero when the CPU is reset.
@@ -75,19 +98,33 @@
 // because gu64_LastPasswd is initialized with 0 and must always be in the past.
 #define PASSWORD_OFFSET_MS (2 * PASSWORD_TIMEOUT * 60 * 1000)
 
-enum BeepType {
-    BEEP_INIT,
-    BEEP_OK,
-    BEEP_ERROR
-};
-
-enum eLED
+// The steps of the card pipeline in DoorOpener::loop().
+// Each step sends at most one command to the card (one PN532 frame, two for Authenticate).
+// A step that ends the processing of the card may also switch off the RF field (one more frame).
+enum eCardState
 {
-    LED_OFF,
-    LED_RED,
-    LED_GREEN,
+    CARD_IDLE,         // RF field off, waiting for the PollScheduler interval and executing terminal commands
+    CARD_RESET,        // reset the PN532 after a communication error
+    CARD_DETECT,       // look for a card in the RF field
+    CARD_PRESENCE,     // check that the random ID card of the last tap is still in the RF field
+    CARD_PICC_SELECT,  // select the PICC level of a Desfire card
+    CARD_PICC_VERSION, // get the version of the PICC master key
+    CARD_PICC_AUTH,    // authenticate a random ID card with the PICC master key
+    CARD_REAL_ID,      // get the real UID of a random ID card
+    CARD_IDENTIFY,     // look up the user
+    CARD_AUTHENTICATE, // check that the card has been personalized for this user, derive the secrets of a default card
+    CARD_APP_SELECT,   // select the application that stores the secret
+    CARD_APP_AUTH,     // authenticate with the application master key of the user
+    CARD_READ_SECRET,  // read the secret from the card and compare it
+    CARD_DECIDE,       // switch on the relay(s) and announce which door(s) have been opened
+    CARD_RELEASE,      // switch off the RF field, RelayController switches the relay(s) off after OPEN_INTERVAL
+    CARD_SHOW_RESULT,  // wait until the pattern passed to ShowResult() has been played
 };
 
+const char *CARD_STATE_NAMES[] = {"idle", "reset", "detect", "presence", "picc_select", "picc_version", "picc_auth",
+                                  "real_id", "identify", "authenticate", "app_select", "app_auth", "read_secret",
+                                  "decide", "release", "show_result"};
+
 struct kCard
 {
     byte u8_UidLength;  // UID = 4 or 7 bytes
@@ -96,6 +133,23 @@ struct kCard
     eCardType e_CardType;
 };
 
+// The DESFire secrets of the users who opened the door recently, see GetCachedDesfireSecrets()
+SecretCache secretCache;
+
+#if PN532_TRANSPORT == TRANSPORT_HARD_SPI
+#if !USE_HARDWARE_SPI
+#error "Set USE_HARDWARE_SPI to true in PN532.h of the desfire_rfid library"
+#endif
+HardSpiTransport readerTransport(SPI_CS_PIN, RESET_PIN, PN532_HARD_SPI_CLOCK);
+#elif PN532_TRANSPORT == TRANSPORT_I2C
+#if !USE_HARDWARE_I2C
+#error "Set USE_HARDWARE_I2C to true in PN532.h of the desfire_rfid library"
+#endif
+I2cTransport readerTransport(RESET_PIN, PN532_I2C_CLOCK);
+#else
+SoftSpiTransport readerTransport(SPI_CLK_PIN, SPI_MISO_PIN, SPI_MOSI_PIN, SPI_CS_PIN, RESET_PIN);
+#endif
+
 class DoorOpener
 {
 public:
@@ -111,112 +165,691 @@ public:
 
         Utils::SetPinMode(LED_BUILTIN, OUTPUT);
 
-        FlashLED(LED_GREEN, 1000);
+        gi_Sequencer.Begin(&OnTone, &SetLED);
+        gi_Relays.Begin(&OnRelay, DOOR_1_PIN, DOOR_2_PIN);
 
-        // Software SPI is configured to run a slow clock of 10 kHz which can be transmitted over longer cables.
-        gi_PN532.InitSoftwareSPI(SPI_CLK_PIN, SPI_MISO_PIN, SPI_MOSI_PIN, SPI_CS_PIN, RESET_PIN);
+        // By default the software SPI is configured to run a slow clock of 10 kHz which can be transmitted over longer cables.
+        readerTransport.Init(&gi_PN532);
 
         InitReader(false);
+        if (gb_InitSuccess)
+            gi_Sequencer.Play(PATTERN_INIT);
 
         gi_PiccMasterKey.SetKeyData(SECRET_PICC_MASTER_KEY, sizeof(SECRET_PICC_MASTER_KEY), CARD_KEY_VERSION);
 
+        UserManager::SetChangedCallback(&OnUserChanged);
         UserManager::InitDatabase();
     }
 
+    // The card pipeline is a state machine (see eCardState).
+    // Each call executes one step, which sends at most one command to the card, and then returns,
+    // so that MQTT and the web server are served between the steps.
+    // The longest step is an Authenticate (approx. 90 ms with the 10 kHz software SPI, 4 ms with hardware SPI).
+    // Terminal commands (StepIdle) and the reset of the PN532 (StepReset) take longer.
     void loop()
     {
-        bool b_KeyPress = ReadKeyboardInput();
+        uint64_t u64_Now = Utils::GetMillis64();
+        gi_Sequencer.loop(u64_Now);
+        gi_Relays.loop(u64_Now);
 
-        uint64_t u64_StartTick = Utils::GetMillis64();
+        switch (ge_CardState)
+        {
+        case CARD_IDLE:
+            StepIdle(u64_Now);
+            break;
+        case CARD_RESET:
+            StepReset();
+            break;
+        case CARD_DETECT:
+            StepDetect();
+            break;
+        case CARD_PRESENCE:
+            StepPresence();
+            break;
+        case CARD_PICC_SELECT:
+            StepPiccSelect();
+            break;
+        case CARD_PICC_VERSION:
+            StepPiccVersion();
+            break;
+        case CARD_PICC_AUTH:
+            StepPiccAuth();
+            break;
+        case CARD_REAL_ID:
+            StepRealID();
+            break;
+        case CARD_IDENTIFY:
+            StepIdentify();
+            break;
+        case CARD_AUTHENTICATE:
+            StepAuthenticate();
+            break;
+        case CARD_APP_SELECT:
+            StepAppSelect();
+            break;
+        case CARD_APP_AUTH:
+            StepAppAuth();
+            break;
+        case CARD_READ_SECRET:
+            StepReadSecret();
+            break;
+        case CARD_DECIDE:
+            StepDecide(u64_Now);
+            break;
+        case CARD_RELEASE:
+            StepRelease();
+            break;
+        case CARD_SHOW_RESULT:
+            StepShowResult();
+            break;
+        }
+    }
+
+    // f_Callback is called after each decision about a card (see kAccessEvent)
+    void SetAccessCallback(AccessEventCallback f_Callback)
+    {
+        gf_AccessCallback = f_Callback;
+    }
+
+    // Opens the doors in u8_Flags (DOOR_ONE, DOOR_TWO) for OPEN_INTERVAL, e.g. on request of the REST API.
+    // The relays are switched immediately, also while a card is being processed.
+    void OpenDoor(byte u8_Flags)
+    {
+        gi_Relays.Open(u8_Flags & DOOR_BOTH, Utils::GetMillis64(), OPEN_INTERVAL);
+    }
+
+    // The state for the REST API, these functions do not communicate with the PN532
+    bool IsReaderReady()
+    {
+        return gb_InitSuccess;
+    }
+
+    eCardState GetCardState()
+    {
+        return ge_CardState;
+    }
 
-        static uint64_t u64_LastRead = 0;
+    bool IsDoorOpen(byte u8_Door)
+    {
+        return gi_Relays.IsOpen(u8_Door);
+    }
+
+    PollScheduler *GetPoller()
+    {
+        return &gi_Poller;
+    }
+
+    uint32_t GetTapCount()
+    {
+        return gu32_Taps;
+    }
+
+    uint32_t GetAverageTapMillis()
+    {
+        return gu32_Taps ? (uint32_t)(gu64_TapMillis / gu32_Taps) : 0;
+    }
+
+    // The number of decisions with this result since startup
+    uint32_t GetAccessCount(eAccessResult e_Result)
+    {
+        return gu32_AccessCounts[e_Result];
+    }
+
+    // The number of resets of the PN532 after a communication error
+    uint32_t GetReaderResetCount()
+    {
+        return gu32_ReaderResets;
+    }
+
+private:
+    char gs8_CommandBuffer[500];  // Stores commands typed by the user via Terminal and the password
+    uint32_t gu32_CommandPos = 0; // Index in gs8_CommandBuffer
+    uint64_t gu64_LastPasswd = 0; // Timestamp when the user has enetered the password successfully
+    uint64_t gu64_LastID = 0;     // The last card UID that has been read by the RFID reader
+    bool gb_InitSuccess = false;  // true if the PN532 has been initialized successfully
+    DoorReader gi_PN532; // The class instance that communicates with Mifare Desfire cards
+    Sequencer gi_Sequencer; // Plays the buzzer and LED patterns
+    RelayController gi_Relays; // Holds the door relays
+    PollScheduler gi_Poller; // Decides when to poll for a card
+    byte gu8_Retries = 0;    // The current PN532 passive activation retries, 0 = library default
+    uint32_t gu32_Commands = 0;     // PN532 commands exchanged for the current card
+    bool gb_HoldField = false;      // true while the random ID card gu64_PresentRandomID is kept in the RF field
+    uint64_t gu64_PresentRandomID = 0; // The random ID of this card, its real UID is gu64_LastID
+    uint32_t gu32_Taps = 0;         // Statistics of the successful taps since startup
+    uint32_t gu32_TapCommands = 0;
+    uint64_t gu64_TapMillis = 0;
+    DESFIRE_KEY_TYPE gi_PiccMasterKey;
+    eCardState ge_CardState = CARD_IDLE; // The current step of the card pipeline
+    kCard gk_Card;                 // The card that is currently processed
+    kUser gk_User;                 // The UID of this card and the user found for it
+    uint64_t gu64_StartTick = 0;   // Timestamp when the card has been detected
+    uint64_t gu64_LastRead = 0;    // Timestamp when the RF field has been switched off
+    uint64_t gu64_PhaseTick = 0;   // Timestamp when the current eAccessPhase has started
+    kAccessEvent gk_Event;         // The phase timings of the current card
+    AccessEventCallback gf_AccessCallback = NULL;
+    uint32_t gu32_AccessCounts[ACCESS_RESULT_COUNT] = {0};
+    uint32_t gu32_ReaderResets = 0;
+    TapLatency gi_Latency;         // The duration of the tap phases, see the STATS command
+    uint32_t gu32_StartMicros = 0; // gu64_StartTick in microseconds
+    uint32_t gu32_StepMicros = 0;   // Timestamp when a latency phase that spans several steps has started
+    DESFIRE_KEY_TYPE gi_AppMasterKey; // The secrets of the user gk_User, derived by StepAuthenticate()
+    byte gu8_StoreValue[16];
+
+    void StepIdle(uint64_t u64_Now)
+    {
+        if (!gb_InitSuccess)
+        {
+            ge_CardState = CARD_RESET;
+            return;
+        }
+
+        // Terminal commands are only executed between two cards, because some of them use the reader.
+        // While the user is typing do not read the card to avoid delays and debug output.
+        if (ReadKeyboardInput())
+        {
+            ReleaseCard();
+            gu64_LastRead = u64_Now + 1000; // Give the user 1000 ms + RF_OFF_INTERVAL between each character
+            return;
+        }
+
+        // Turn on the RF field for 100 ms then turn it off for the interval of the PollScheduler to safe battery
+        if ((int64_t)(u64_Now - gu64_LastRead) < (int64_t)gi_Poller.GetOffInterval(u64_Now))
+            return;
+
+        byte u8_Retries = gi_Poller.GetRetries(u64_Now);
+        if (u8_Retries != gu8_Retries && gi_PN532.SetPassiveActivationRetries(u8_Retries))
+            gu8_Retries = u8_Retries;
+
+        gu64_StartTick = u64_Now;
+        gu32_StartMicros = micros();
+        ge_CardState = gb_HoldField ? CARD_PRESENCE : CARD_DETECT;
+    }
+
+    void StepReset()
+    {
+        // The terminal must work even if the reader does not respond
+        ReadKeyboardInput();
+
+        gb_HoldField = false;
+        InitReader(true);
+        ShowResult(PATTERN_READER_FAULT);
         if (gb_InitSuccess)
+            gi_Sequencer.Queue(PATTERN_INIT);
+    }
+
+    void StepDetect()
+    {
+        memset(&gk_Card, 0, sizeof(kCard));
+        memset(&gk_Event, 0, sizeof(kAccessEvent));
+        gk_User = kUser();
+        gu64_PhaseTick = gu64_StartTick;
+
+        gi_Poller.OnFieldOn(Utils::GetMillis64());
+
+        gu32_Commands = 1;
+        uint32_t u32_Start = micros();
+        if (!gi_PN532.ReadPassiveTargetID(gk_User.ID.u8, &gk_Card.u8_UidLength, &gk_Card.e_CardType))
+        {
+            gk_Card.b_PN532_Error = true;
+            OnReadError();
+            return;
+        }
+
+        // No card present in the RF field
+        if (gk_Card.u8_UidLength == 0)
+        {
+            // The card has been removed -> the next person may be waiting
+            if (gu64_LastID != 0)
+                gi_Poller.OnActivity(Utils::GetMillis64());
+
+            gu64_LastID = 0;
+
+            // Do not cut off the pattern of the previous card
+            if (gi_Sequencer.IsBusy())
+                FinishCard();
+            else
+                ShowResult(PATTERN_NO_CARD);
+            return;
+        }
+
+        AddLatency(TAP_READ_TARGET, u32_Start);
+        EndPhase(PHASE_DETECT);
+
+        // The real UID of a Desfire card in random ID mode can only be read after the PICC authentication
+        if (gk_Card.e_CardType == CARD_DesRandom)
+        {
+            gu64_PresentRandomID = gk_User.ID.u64;
+            gu32_StepMicros = micros();
+            ge_CardState = CARD_PICC_SELECT;
+        }
+        else
+        {
+            ge_CardState = CARD_IDENTIFY;
+        }
+    }
+
+    // A random ID card gets a new random ID each time the RF field is switched on. Therefore after a tap the field is
+    // kept on and the presence of the card is confirmed with a cheap PN532 command instead of repeating the
+    // authentication that is required to get the real UID.
+    void StepPresence()
+    {
+        gu32_Commands = 1;
+        if (gi_PN532.IsCardPresent())
+        {
+            FinishCard();
+            return;
+        }
+
+        // The card has been removed -> the next person may be waiting
+        DEBUG("Random ID card %08X has been removed.", (uint32_t)gu64_PresentRandomID);
+        gi_Poller.OnActivity(Utils::GetMillis64());
+        gu64_LastID = 0;
+        ReleaseCard();
+        FinishCard();
+    }
+
+    // Ends the presence tracking of a random ID card
+    void ReleaseCard()
+    {
+        if (!gb_HoldField)
+            return;
+
+        gb_HoldField = false;
+        SwitchOffRfField();
+    }
+
+    // The steps CARD_PICC_SELECT .. CARD_PICC_AUTH do the same as AuthenticatePICC() for a random ID card.
+    // Without FAST_DESFIRE_CHECK the secret check of a default card also starts with the first two of them.
+    void StepPiccSelect()
+    {
+        gu32_Commands++;
+        if (!gi_PN532.SelectApplication(0x000000)) // PICC level
         {
-            // While the user is typing do not read the card to avoid delays and debug output.
-            if (b_KeyPress)
+            OnPiccError();
+            return;
+        }
+        ge_CardState = CARD_PICC_VERSION;
+    }
+
+    void StepPiccVersion()
+    {
+        gu32_Commands++;
+        if (!gi_PN532.GetKeyVersion(0, &gk_Card.u8_KeyVersion)) // Get version of PICC master key
+        {
+            OnPiccError();
+            return;
+        }
+
+        if (gk_Card.e_CardType == CARD_DesRandom)
+        {
+            ge_CardState = CARD_PICC_AUTH;
+            return;
+        }
+
+        // The factory default key has version 0, while a personalized card has key version CARD_KEY_VERSION
+        if (gk_Card.u8_KeyVersion != CARD_KEY_VERSION)
+        {
+            OnSecretError();
+            return;
+        }
+        ge_CardState = CARD_APP_SELECT;
+    }
+
+    void StepPiccAuth()
+    {
+        gu32_Commands += 2; // Authenticate (2 frames)
+
+        // If the card is personalized -> authenticate with SECRET_PICC_MASTER_KEY,
+        // otherwise authenticate with the factory default DES key.
+        bool b_Success;
+        if (gk_Card.u8_KeyVersion == CARD_KEY_VERSION)
+            b_Success = gi_PN532.Authenticate(0, &gi_PiccMasterKey);
+        else
+            b_Success = gi_PN532.Authenticate(0, &gi_PN532.DES2_DEFAULT_KEY);
+
+        if (!b_Success)
+        {
+            OnReadError();
+            return;
+        }
+
+        AddLatency(TAP_PICC_AUTH, gu32_StepMicros);
+        ge_CardState = CARD_REAL_ID;
+    }
+
+    void StepRealID()
+    {
+        gu32_Commands++;
+        uint32_t u32_Start = micros();
+        if (!gi_PN532.GetRealCardID(gk_User.ID.u8)) // replace the random ID with the real UID
+        {
+            OnReadError();
+            return;
+        }
+        AddLatency(TAP_REAL_ID, u32_Start);
+
+        gk_Card.u8_UidLength = 7; // random ID is only 4 bytes
+        ge_CardState = CARD_IDENTIFY;
+    }
+
+    void StepIdentify()
+    {
+        // Still the same card present
+        uint64_t u64_ID = gk_User.ID.u64;
+        if (gu64_LastID == u64_ID)
+        {
+            gb_HoldField = gk_Card.e_CardType == CARD_DesRandom;
+            FinishCard();
+            return;
+        }
+
+        // A different card was found in the RF field
+        gi_Poller.OnCardDetected(Utils::GetMillis64());
+
+        uint32_t u32_Start = micros();
+        bool b_Found = UserManager::FindUser(u64_ID, &gk_User);
+        AddLatency(TAP_FIND_USER, u32_Start);
+        if (!b_Found)
+        {
+            Utils::Print("Unknown person tries to open the door: ");
+            Utils::PrintHexBuf((byte *)&u64_ID, 7, LF);
+            ShowError(PATTERN_ERROR, ACCESS_UNKNOWN);
+            return;
+        }
+
+        // The RF field stays on for the secret check
+        EndPhase(PHASE_IDENTIFY);
+        ge_CardState = CARD_AUTHENTICATE;
+    }
+
+    void StepAuthenticate()
+    {
+        if ((gk_Card.e_CardType & CARD_Desfire) == 0) // Classic
+        {
+            Utils::Print("The card is not a Desfire card.\r\n");
+            ShowError(PATTERN_DENIED, ACCESS_NOT_PERSONALIZED);
+            return;
+        }
+
+        if (gk_Card.e_CardType == CARD_DesRandom) // random ID Desfire card
+        {
+            // In case of a random ID card the authentication has already been done in StepPiccAuth().
+            // But it may also authenticate with the factory default DES key, so we must check here
+            // that SECRET_PICC_MASTER_KEY has been used for authentication.
+            if (gk_Card.u8_KeyVersion != CARD_KEY_VERSION)
             {
-                u64_LastRead = u64_StartTick + 1000; // Give the user 1000 ms + RF_OFF_INTERVAL between each character
+                Utils::Print("The card is not personalized.\r\n");
+                ShowError(PATTERN_DENIED, ACCESS_NOT_PERSONALIZED);
                 return;
             }
 
-            // Turn on the RF field for 100 ms then turn it off for one second (RF_OFF_INTERVAL) to safe battery
-            if ((int)(u64_StartTick - u64_LastRead) < RF_OFF_INTERVAL)
-                return;
+            EndPhase(PHASE_AUTHENTICATE);
+            ge_CardState = CARD_DECIDE;
+            return;
         }
 
-        do // pseudo loop (just used for aborting with break;)
+        // default Desfire card: check that the data stored on the card is the same as the secret generated by
+        // GenerateDesfireSecrets(). The check continues in StepAppSelect() .. StepReadSecret().
+        gu32_StepMicros = micros();
+        if (!GetCachedDesfireSecrets(&gk_User, &gi_AppMasterKey, gu8_StoreValue))
         {
-            if (!gb_InitSuccess)
-            {
-                InitReader(true); // flash red LED for 2.4 seconds
-                break;
-            }
+            OnSecretError();
+            return;
+        }
 
-            kUser k_User;
-            kCard k_Card;
-            if (!ReadCard(k_User.ID.u8, &k_Card))
-            {
-                if (IsDesfireTimeout())
-                {
-                    // Nothing to do here because IsDesfireTimeout() prints additional error message and blinks the red LED
-                }
-                else if (k_Card.b_PN532_Error) // Another error from PN532 -> reset the chip
-                {
-                    InitReader(true); // flash red LED for 2.4 seconds
-                }
-                else // e.g. Error while authenticating with master key
-                {
-                    FlashLED(LED_RED, 1000);
-                }
+#if FAST_DESFIRE_CHECK
+        ge_CardState = CARD_APP_SELECT;
+#else
+        ge_CardState = CARD_PICC_SELECT;
+#endif
+    }
 
-                Utils::Print("> ");
-                break;
-            }
+    void StepAppSelect()
+    {
+        gu32_Commands++;
+        if (!gi_PN532.SelectApplication(CARD_APPLICATION_ID))
+        {
+            OnSecretError();
+            return;
+        }
+        ge_CardState = CARD_APP_AUTH;
+    }
 
-            // No card present in the RF field
-            if (k_Card.u8_UidLength == 0)
-            {
-                gu64_LastID = 0;
+    void StepAppAuth()
+    {
+        gu32_Commands += 2; // Authenticate (2 frames)
+        if (!gi_PN532.Authenticate(0, &gi_AppMasterKey))
+        {
+            OnSecretError();
+            return;
+        }
+        ge_CardState = CARD_READ_SECRET;
+    }
 
-                FlashLED(LED_GREEN, 20);
-                break;
-            }
+    void StepReadSecret()
+    {
+        gu32_Commands++;
 
-            // Still the same card present
-            if (gu64_LastID == k_User.ID.u64)
-                break;
+        // Read the 16 byte secret from the card
+        byte u8_FileData[16];
+        bool b_Valid = gi_PN532.ReadFileData(CARD_FILE_ID, 0, 16, u8_FileData) &&
+                       memcmp(u8_FileData, gu8_StoreValue, 16) == 0;
+        AddLatency(TAP_CHECK_SECRET, gu32_StepMicros);
+        if (!b_Valid)
+        {
+            OnSecretError();
+            return;
+        }
 
-            // A different card was found in the RF field
-            // OpenDoor() needs the RF field to be ON (for CheckDesfireSecret())
-            OpenDoor(k_User.ID.u64, &k_Card, u64_StartTick);
-            Utils::Print("> ");
-        } while (false);
+        EndPhase(PHASE_AUTHENTICATE);
+        ge_CardState = CARD_DECIDE;
+    }
+
+    // The relays are switched off by gi_Relays.loop(), meanwhile the next card can be read.
+    // If the same user taps again while the door is open, the open interval is extended.
+    void StepDecide(uint64_t u64_Now)
+    {
+        // The relay is switched before the slow part (serial output, access report, MQTT)
+        uint32_t u32_Micros = micros();
+        gi_Relays.Open(gk_User.u8_Flags & DOOR_BOTH, u64_Now, OPEN_INTERVAL);
+        AddLatency(TAP_ACTUATE, u32_Micros);
+        AddLatency(TAP_TOTAL, gu32_StartMicros);
+
+        // The speed of the entire communication process with the card (ReadPassiveTargetID + Crypto stuff)
+        // with software SPI before FAST_DESFIRE_CHECK:
+        // In Classic         mode: 125 ms
+        // In Desfire Random  mode: 676 ms
+        // In Desfire Default mode: 799 ms
+        // If you want to get this faster use another transport (see PN532_TRANSPORT).
+        uint32_t u32_Millis = (uint32_t)(Utils::GetMillis64() - gu64_StartTick);
+        gu32_Taps++;
+        gu32_TapCommands += gu32_Commands;
+        gu64_TapMillis += u32_Millis;
+        DEBUG("Tap: %u commands, %u ms (average %u commands, %u ms)", gu32_Commands, u32_Millis,
+              gu32_TapCommands / gu32_Taps, (uint32_t)(gu64_TapMillis / gu32_Taps));
+
+        switch (gk_User.u8_Flags & DOOR_BOTH)
+        {
+        case DOOR_ONE:
+            Utils::Print("Opening door 1 for ");
+            break;
+        case DOOR_TWO:
+            Utils::Print("Opening door 2 for ");
+            break;
+        case DOOR_BOTH:
+            Utils::Print("Opening door 1 + 2 for ");
+            break;
+        default:
+            Utils::Print("No door specified for ");
+            break;
+        }
+        Utils::Print(gk_User.s8_Name);
+        switch (gk_Card.e_CardType)
+        {
+        case CARD_DesRandom:
+            Utils::Print(" (Desfire random card)", LF);
+            break;
+        case CARD_Desfire:
+            Utils::Print(" (Desfire default card)", LF);
+            break;
+        default:
+            Utils::Print(" (Classic card)", LF);
+            break;
+        }
+        Utils::Print("> ");
 
+        ReportAccess(ACCESS_GRANTED);
+
+        // The next card is read without waiting for the pattern
+        gi_Sequencer.Play(PATTERN_OK);
+
+        // Avoid that the door is opened twice when the card is in the RF field for a longer time.
+        gu64_LastID = gk_User.ID.u64;
+
+        // The RF field is switched off in the next step, so this step sends no command to the card
+        ge_CardState = CARD_RELEASE;
+    }
+
+    // The card is not needed anymore, except for the presence tracking of a random ID card
+    void StepRelease()
+    {
+        if (gk_Card.e_CardType == CARD_DesRandom)
+            gb_HoldField = true;
+
+        FinishCard();
+    }
+
+    void StepShowResult()
+    {
+        if (gi_Sequencer.IsBusy())
+            return;
+
+        FinishCard();
+    }
+
+    // The card could not be read
+    void OnReadError()
+    {
+        if (IsDesfireTimeout()) // Prints additional error message
+        {
+            ShowError(PATTERN_TIMEOUT, ACCESS_TIMEOUT);
+        }
+        else if (gk_Card.b_PN532_Error) // Another error from PN532 -> reset the chip
+        {
+            ReportAccess(ACCESS_READER_FAULT);
+            SwitchOffRfField();
+            ge_CardState = CARD_RESET;
+        }
+        else // e.g. Error while authenticating with master key
+        {
+            ShowError(PATTERN_DENIED, ACCESS_NOT_PERSONALIZED);
+        }
+    }
+
+    // A PICC level command failed: for a random ID card the card could not be read,
+    // for a default card the secret check failed.
+    void OnPiccError()
+    {
+        if (gk_Card.e_CardType == CARD_DesRandom)
+            OnReadError();
+        else
+            OnSecretError();
+    }
+
+    // The secret check of a default Desfire card failed
+    void OnSecretError()
+    {
+        if (IsDesfireTimeout()) // Prints additional error message
+        {
+            ShowError(PATTERN_TIMEOUT, ACCESS_TIMEOUT);
+            return;
+        }
+
+        Utils::Print("The card is not personalized.\r\n");
+        ShowError(PATTERN_DENIED, ACCESS_NOT_PERSONALIZED);
+    }
+
+    void ShowError(ePattern e_Pattern, eAccessResult e_Result)
+    {
+        // Someone is at the door and will probably try again
+        gi_Poller.OnActivity(Utils::GetMillis64());
+
+        Utils::Print("> ");
+        ReportAccess(e_Result);
+        ShowResult(e_Pattern);
+    }
+
+    // Stores the duration of the phase that has just ended
+    void EndPhase(eAccessPhase e_Phase)
+    {
+        uint64_t u64_Now = Utils::GetMillis64();
+        gk_Event.u16_PhaseMillis[e_Phase] = (uint16_t)min(u64_Now - gu64_PhaseTick, (uint64_t)0xFFFF);
+        gu64_PhaseTick = u64_Now;
+    }
+
+    // Adds the time since u32_Start to the histogram of the phase, returns the current time in microseconds
+    uint32_t AddLatency(eTapPhase e_Phase, uint32_t u32_Start)
+    {
+        uint32_t u32_Now = micros();
+        gi_Latency.Add(gk_Card.e_CardType, e_Phase, u32_Now - u32_Start);
+        return u32_Now;
+    }
+
+    // Passes the decision about the current card to the access callback
+    void ReportAccess(eAccessResult e_Result)
+    {
+        gu32_AccessCounts[e_Result]++;
+        if (!gf_AccessCallback)
+            return;
+
+        uint64_t u64_Now = Utils::GetMillis64();
+        gk_Event.u32_Time = (uint32_t)u64_Now;
+        gk_Event.u64_ID = gk_User.ID.u64;
+        gk_Event.u8_Result = e_Result;
+        gk_Event.u8_Doors = e_Result == ACCESS_GRANTED ? (gk_User.u8_Flags & DOOR_BOTH) : 0;
+        gk_Event.u8_CardType = gk_Card.e_CardType;
+        gk_Event.u16_TotalMillis = (uint16_t)min(u64_Now - gu64_StartTick, (uint64_t)0xFFFF);
+        gf_AccessCallback(&gk_Event);
+    }
+
+    // Plays the pattern. The next card is read after it has ended.
+    void ShowResult(ePattern e_Pattern)
+    {
         // Turn off the RF field to save battery
-        // When the RF field is on,  the PN532 board consumes approx 110 mA.
-        // When the RF field is off, the PN532 board consumes approx 18 mA.
-        gi_PN532.SwitchOffRfField();
+        SwitchOffRfField();
 
-        u64_LastRead = Utils::GetMillis64();
+        gi_Sequencer.Play(e_Pattern);
+        ge_CardState = CARD_SHOW_RESULT;
+    }
+
+    // Ends the processing of the current card and starts the off interval
+    void FinishCard()
+    {
+        if (!gb_HoldField)
+            SwitchOffRfField();
+
+        gu64_LastRead = Utils::GetMillis64();
+        ge_CardState = CARD_IDLE;
+    }
+
+    // Turn off the RF field to save battery
+    // When the RF field is on,  the PN532 board consumes approx 110 mA.
+    // When the RF field is off, the PN532 board consumes approx 18 mA.
+    void SwitchOffRfField()
+    {
+        gi_PN532.SwitchOffRfField();
+        gi_Poller.OnFieldOff(Utils::GetMillis64());
     }
 
-private:
-    char gs8_CommandBuffer[500];  // Stores commands typed by the user via Terminal and the password
-    uint32_t gu32_CommandPos = 0; // Index in gs8_CommandBuffer
-    uint64_t gu64_LastPasswd = 0; // Timestamp when the user has enetered the password successfully
-    uint64_t gu64_LastID = 0;     // The last card UID that has been read by the RFID reader
-    bool gb_InitSuccess = false;  // true if the PN532 has been initialized successfully
-    Desfire gi_PN532; // The class instance that communicates with Mifare Desfire cards
-    DESFIRE_KEY_TYPE gi_PiccMasterKey;
 
     // Reset the PN532 chip and initialize, set gb_InitSuccess = true on success
-    // If b_ShowError == true -> flash the red LED very slowly
+    // If b_ShowError == true -> print an error message (the caller plays PATTERN_READER_FAULT)
     void InitReader(bool b_ShowError)
     {
         if (b_ShowError)
         {
-            SetLED(LED_RED);
             Utils::Print("Communication Error -> Reset PN532\r\n");
+            gu32_ReaderResets++;
         }
 
         do // pseudo loop (just used for aborting with break;)
@@ -225,6 +858,7 @@ private:
 
             // Reset the PN532
             gi_PN532.begin(); // delay > 400 ms
+            readerTransport.OnReset(&gi_PN532);
 
             byte IC, VersionHi, VersionLo, Flags;
             if (!gi_PN532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags))
@@ -233,6 +867,8 @@ private:
             char Buf[80];
             sprintf(Buf, "Chip: PN5%02X, Firmware version: %d.%d\r\n", IC, VersionHi, VersionLo);
             Utils::Print(Buf);
+            sprintf(Buf, "Transport: %s, approx. %u bytes/s\r\n", readerTransport.GetName(), readerTransport.GetBytesPerSecond());
+            Utils::Print(Buf);
             sprintf(Buf, "Supports ISO 14443A:%s, ISO 14443B:%s, ISO 18092:%s\r\n", (Flags & 1) ? "Yes" : "No",
                     (Flags & 2) ? "Yes" : "No",
                     (Flags & 4) ? "Yes" : "No");
@@ -247,74 +883,20 @@ private:
             if (!gi_PN532.SamConfig())
                 break;
 
+            gu8_Retries = 0;
             gb_InitSuccess = true;
-            Beep(BEEP_INIT);
-
-
         } while (false);
-
-        if (b_ShowError)
-        {
-            Utils::DelayMilli(2000); // a long interval to make the LED flash very slowly
-            SetLED(LED_OFF);
-            Utils::DelayMilli(100);
-        }
     }
 
-    void Beep(BeepType type) {
-        //FIXME: Change implementation to be non-blocking using millis()
-        //FIXME: Make code a bit more pretty and readable
-        switch(type) {
-            case BEEP_INIT:
-                    DEBUG("Beeping INIT...");
-                    tone(BUZZER_PIN, 3000);
-                    delay(200);
-                    noTone(BUZZER_PIN);
-                    break;
-
-            case BEEP_OK:
-                    DEBUG("Beeping OK...");
-                    tone(BUZZER_PIN, 2000);
-                    delay(70);
-                    noTone(BUZZER_PIN);
-                    delay(30);
-                    tone(BUZZER_PIN, 3000);
-                    delay(150);
-                    noTone(BUZZER_PIN);
-                    break;
-
-            case BEEP_ERROR:
-                    DEBUG("Beeping ERROR...");
-                    tone(BUZZER_PIN, 2000);
-                    delay(70);
-                    noTone(BUZZER_PIN);
-                    delay(30);
-                    tone(BUZZER_PIN, 1000);
-                    delay(200);
-                    noTone(BUZZER_PIN);
-                    break;
-            
-            default: DEBUG("Beep() was called with an unknown type.");
-        }
-    }
-
-    // If everything works correctly, the green LED will flash shortly (20 ms).
-    // If the LED does not flash permanently this means that there is a severe error.
-    // Additionally the LED will flash long (for 1 second) when the door is opened.
-    // -----------------------------------------------------------------------------
-    // If only the red LED is flashing this shows a communication error with the PN532 (flash very slow),
-    // or someone not authorized trying to open the door (flash for 1 second)
-    // or on power failure the red LED flashes shortly (battery voltage is below limit).
-    // -----------------------------------------------------------------------------
-    // The red LED flashing alternatingly with the green LED means that the battery is old and must be replaced soon.
-    void FlashLED(eLED e_LED, int s32_Interval)
+    static void OnTone(uint16_t u16_Frequency)
     {
-        SetLED(e_LED);
-        Utils::DelayMilli(s32_Interval);
-        SetLED(LED_OFF);
+        if (u16_Frequency)
+            tone(BUZZER_PIN, u16_Frequency);
+        else
+            noTone(BUZZER_PIN);
     }
 
-    void SetLED(eLED e_LED)
+    static void SetLED(eLED e_LED)
     {
         Utils::WritePin(LED_BUILTIN, LOW);
 
@@ -436,11 +1018,18 @@ private:
             if (gb_InitSuccess)
             {
                 Utils::Print("PN532 initialized successfully\r\n"); // The chip has reponded (ACK) as expected
-                Beep(BEEP_INIT);
+                gi_Sequencer.Play(PATTERN_INIT);
                 return;
             }
         }
 
+        // This command must work even if gb_InitSuccess == false
+        if (Utils::stricmp(gs8_CommandBuffer, "STATS") == 0)
+        {
+            PrintStats();
+            return;
+        }
+
         // This command must work even if gb_InitSuccess == false
         if (PASSWORD[0] != 0 && Utils::stricmp(gs8_CommandBuffer, "EXIT") == 0)
         {
@@ -559,9 +1148,10 @@ private:
             Utils::Print("Usage:\r\n");
         }
 
-        // In case of a fatal error only these 2 commands are available:
+        // In case of a fatal error only these commands are available:
         Utils::Print(" RESET          : Reset the PN532 and run the chip initialization anew\r\n");
         Utils::Print(" DEBUG {level}  : Set debug level (0= off, 1= normal, 2= RxTx data, 3= details)\r\n");
+        Utils::Print(" STATS          : Show the tap latency and the reader statistics\r\n");
 
         if (PASSWORD[0] != 0)
             Utils::Print(" EXIT           : Log out\r\n");
@@ -624,6 +1214,29 @@ private:
 
     // ================================================================================
 
+    // Prints the statistics since startup
+    void PrintStats()
+    {
+        char s8_Buf[120];
+        uint64_t u64_Now = Utils::GetMillis64();
+        sprintf(s8_Buf, "Taps: %u, average %u PN532 commands, %u ms\r\n", gu32_Taps,
+                gu32_Taps ? gu32_TapCommands / gu32_Taps : 0, GetAverageTapMillis());
+        Utils::Print(s8_Buf);
+        uint32_t u32_Duty = gi_Poller.GetDutyCycle(u64_Now);
+        sprintf(s8_Buf, "Polling: %u polls, RF field on %u.%u%%, interval %u ms\r\n", gi_Poller.GetPollCount(),
+                u32_Duty / 10, u32_Duty % 10, gi_Poller.GetOffInterval(u64_Now));
+        Utils::Print(s8_Buf);
+        sprintf(s8_Buf, "Card detection: %u cards, latency average %u ms, max %u ms\r\n", gi_Poller.GetDetectionCount(),
+                gi_Poller.GetAverageLatency(), gi_Poller.GetMaxLatency());
+        Utils::Print(s8_Buf);
+        sprintf(s8_Buf, "Secret cache: %u hits, %u misses (%u%%)\r\n", secretCache.GetHitCount(), secretCache.GetMissCount(),
+                secretCache.GetHitRate());
+        Utils::Print(s8_Buf);
+        UserManager::PrintFilterStats();
+        Utils::Print(LF);
+        gi_Latency.Print();
+    }
+
     // Stores a new user and his card
     void AddCard(const char *s8_UserName)
     {
@@ -781,128 +1394,29 @@ private:
         // For more details about this error see comment of GetLastPN532Error()
         if (gi_PN532.GetLastPN532Error() == 0x01) // Timeout
         {
-            Utils::Print("A Timeout mostly means that the card is too far away from the reader.\r\n");
-
-            // In this special case we make a short pause only because someone tries to open the door
+            // In this special case the caller makes a short pause only because someone tries to open the door
             // -> don't let him wait unnecessarily.
-            FlashLED(LED_RED, 200);
+            Utils::Print("A Timeout mostly means that the card is too far away from the reader.\r\n");
             return true;
         }
         return false;
     }
 
-    // b_PiccAuth = true if random ID card with successful authentication with SECRET_PICC_MASTER_KEY
-    void OpenDoor(uint64_t u64_ID, kCard *pk_Card, uint64_t u64_StartTick)
-    {
-        kUser k_User;
-        if (!UserManager::FindUser(u64_ID, &k_User))
-        {
-            Utils::Print("Unknown person tries to open the door: ");
-            Utils::PrintHexBuf((byte *)&u64_ID, 7, LF);
-            FlashLED(LED_RED, 1000);
-            Beep(BEEP_ERROR);
-            return;
-        }
-
-        if ((pk_Card->e_CardType & CARD_Desfire) == 0) // Classic
-        {
-            Utils::Print("The card is not a Desfire card.\r\n");
-            FlashLED(LED_RED, 1000);
-            return;
-        }
-        else // Desfire
-        {
-            if (pk_Card->e_CardType == CARD_DesRandom) // random ID Desfire card
-            {
-                // In case of a random ID card the authentication has already been done in ReadCard().
-                // But ReadCard() may also authenticate with the factory default DES key, so we must check here
-                // that SECRET_PICC_MASTER_KEY has been used for authentication.
-                if (pk_Card->u8_KeyVersion != CARD_KEY_VERSION)
-                {
-                    Utils::Print("The card is not personalized.\r\n");
-                    FlashLED(LED_RED, 1000);
-                    return;
-                }
-            }
-            else // default Desfire card
-            {
-                if (!CheckDesfireSecret(&k_User))
-                {
-                    if (IsDesfireTimeout()) // Prints additional error message and blinks the red LED
-                        return;
-
-                    Utils::Print("The card is not personalized.\r\n");
-                    FlashLED(LED_RED, 1000);
-                    return;
-                }
-            }
-        }
-
-#if false
-                // Check the speed of the entire communication process with the card (ReadPassiveTargetID + Crypto stuff):
-                // In Classic         mode: 125 ms
-                // In Desfire Random  mode: 676 ms
-                // In Desfire Default mode: 799 ms
-                // If you want to get this faster modify PN532_SOFT_SPI_DELAY but you must check the SPI signals on an oscilloscope!
-                char s8_Buf[80];
-                sprintf(s8_Buf, "Reading the card took %d ms.\r\n", (int)(Utils::GetMillis64() - u64_StartTick));
-                Utils::Print(s8_Buf);
-#endif
-
-        switch (k_User.u8_Flags & DOOR_BOTH)
-        {
-        case DOOR_ONE:
-            Utils::Print("Opening door 1 for ");
-            break;
-        case DOOR_TWO:
-            Utils::Print("Opening door 2 for ");
-            break;
-        case DOOR_BOTH:
-            Utils::Print("Opening door 1 + 2 for ");
-            break;
-        default:
-            Utils::Print("No door specified for ");
-            break;
-        }
-        Utils::Print(k_User.s8_Name);
-        switch (pk_Card->e_CardType)
-        {
-        case CARD_DesRandom:
-            Utils::Print(" (Desfire random card)", LF);
-            break;
-        case CARD_Desfire:
-            Utils::Print(" (Desfire default card)", LF);
-            break;
-        default:
-            Utils::Print(" (Classic card)", LF);
-            break;
-        }
-
-        Beep(BEEP_OK);
-        ActivateRelais(k_User.u8_Flags);
-
-
-        // Avoid that the door is opened twice when the card is in the RF field for a longer time.
-        gu64_LastID = u64_ID;
-    }
-
-    void ActivateRelais(byte u8_Flags)
+    static void OnRelay(byte u8_Pin, bool b_On)
     {
-        int u8_Pin = D1;
-        Utils::WritePin(u8_Pin, OPEN_INVERT ? LOW : HIGH); // Relais on
-
-        Utils::DelayMilli(OPEN_INTERVAL);
-        Utils::WritePin(u8_Pin, OPEN_INVERT ? HIGH : LOW); // Relais off
-        //SetLED(LED_GREEN); // Green = an authorized person is opening the door
-
-        //Utils::DelayMilli(1000); // let the green LED flash for at least one second
-        //SetLED(LED_OFF);
+        if (b_On)
+            Utils::WritePin(u8_Pin, OPEN_INVERT ? LOW : HIGH); // Relais on
+        else
+            Utils::WritePin(u8_Pin, OPEN_INVERT ? HIGH : LOW); // Relais off
     }
  
     // If the card is personalized -> authenticate with SECRET_PICC_MASTER_KEY,
     // otherwise authenticate with the factory default DES key.
     bool AuthenticatePICC(byte *pu8_KeyVersion)
     {
+        // SelectApplication + GetKeyVersion + Authenticate (2 frames)
+        gu32_Commands += 4;
+
         if (!gi_PN532.SelectApplication(0x000000)) // PICC level
             return false;
 
@@ -927,6 +1441,41 @@ private:
     // Both are derived from the 7 byte card UID and the the user name + random data stored in EEPROM using two 24 byte 3K3DES keys.
     // This function takes only 6 milliseconds to do the cryptographic calculations.
     bool GenerateDesfireSecrets(kUser *pk_User, DESFireKey *pi_AppMasterKey, byte u8_StoreValue[16])
+    {
+        byte u8_AppMasterKey[24];
+        if (!DeriveDesfireSecrets(pk_User, u8_AppMasterKey, u8_StoreValue))
+            return false;
+
+        // If the key is an AES key only the first 16 bytes will be used
+        return pi_AppMasterKey->SetKeyData(u8_AppMasterKey, sizeof(u8_AppMasterKey), CARD_KEY_VERSION);
+    }
+
+    // Same as GenerateDesfireSecrets() but the result is taken from secretCache if the user has been seen before.
+    bool GetCachedDesfireSecrets(kUser *pk_User, DESFireKey *pi_AppMasterKey, byte u8_StoreValue[16])
+    {
+        uint32_t u32_Start = micros();
+        byte u8_AppMasterKey[24];
+        if (!secretCache.Find(pk_User->ID.u64, u8_AppMasterKey, u8_StoreValue))
+        {
+            if (!DeriveDesfireSecrets(pk_User, u8_AppMasterKey, u8_StoreValue))
+                return false;
+
+            secretCache.Store(pk_User->ID.u64, u8_AppMasterKey, u8_StoreValue);
+        }
+        AddLatency(TAP_SECRETS, u32_Start);
+
+        DEBUG("Secret cache: %u hits, %u misses (%u%%)", secretCache.GetHitCount(), secretCache.GetMissCount(), secretCache.GetHitRate());
+        return pi_AppMasterKey->SetKeyData(u8_AppMasterKey, sizeof(u8_AppMasterKey), CARD_KEY_VERSION);
+    }
+
+    // Called by UserManager when a user record has been modified or deleted
+    static void OnUserChanged(uint64_t u64_ID)
+    {
+        secretCache.Invalidate(u64_ID);
+    }
+
+    // Calculates the raw application master key and the value stored on the card from the user record.
+    bool DeriveDesfireSecrets(kUser *pk_User, byte u8_AppMasterKey[24], byte u8_StoreValue[16])
     {
         // The buffer is initialized to zero here
         byte u8_Data[24] = {0};
@@ -944,8 +1493,6 @@ private:
                 B = 0; // Fill the first 16 bytes of u8_Data, the rest remains zero.
         }
 
-        byte u8_AppMasterKey[24];
-
         DES i_3KDes;
         if (!i_3KDes.SetKeyData(SECRET_APPLICATION_KEY, sizeof(SECRET_APPLICATION_KEY), 0) || // set a 24 byte key (168 bit)
             !i_3KDes.CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_AppMasterKey, u8_Data, 24))
@@ -955,46 +1502,6 @@ private:
             !i_3KDes.CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_StoreValue, u8_Data, 16))
             return false;
 
-        // If the key is an AES key only the first 16 bytes will be used
-        if (!pi_AppMasterKey->SetKeyData(u8_AppMasterKey, sizeof(u8_AppMasterKey), CARD_KEY_VERSION))
-            return false;
-
-        return true;
-    }
-
-    // Check that the data stored on the card is the same as the secret generated by GenerateDesfireSecrets()
-    bool CheckDesfireSecret(kUser *pk_User)
-    {
-        DESFIRE_KEY_TYPE i_AppMasterKey;
-        byte u8_StoreValue[16];
-        if (!GenerateDesfireSecrets(pk_User, &i_AppMasterKey, u8_StoreValue))
-            return false;
-
-        if (!gi_PN532.SelectApplication(0x000000)) // PICC level
-            return false;
-
-        byte u8_Version;
-        if (!gi_PN532.GetKeyVersion(0, &u8_Version))
-            return false;
-
-        // The factory default key has version 0, while a personalized card has key version CARD_KEY_VERSION
-        if (u8_Version != CARD_KEY_VERSION)
-            return false;
-
-        if (!gi_PN532.SelectApplication(CARD_APPLICATION_ID))
-            return false;
-
-        if (!gi_PN532.Authenticate(0, &i_AppMasterKey))
-            return false;
-
-        // Read the 16 byte secret from the card
-        byte u8_FileData[16];
-        if (!gi_PN532.ReadFileData(CARD_FILE_ID, 0, 16, u8_FileData))
-            return false;
-
-        if (memcmp(u8_FileData, u8_StoreValue, 16) != 0)
-            return false;
-
         return true;
     }
 
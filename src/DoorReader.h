@@ -0,0 +1,49 @@
+#ifndef DOORREADER_H
+#define DOORREADER_H
+
+#include "Desfire.h"
+
+#define PN532_COMMAND_DIAGNOSE 0x00
+#define PN532_COMMAND_RFCONFIGURATION 0x32
+
+// The Desfire class of the desfire_rfid library with additional PN532 commands needed by DoorOpener.
+class DoorReader : public Desfire
+{
+public:
+    using Desfire::SetPassiveActivationRetries;
+
+    // Sets the number of retries of ReadPassiveTargetID() (MxRtyPassiveActivation).
+    // Fewer retries keep the RF field on for a shorter time when no card is present.
+    // Do not use more retries than the library default, otherwise PN532_TIMEOUT is exceeded.
+    bool SetPassiveActivationRetries(byte u8_Retries)
+    {
+        mu8_PacketBuffer[0] = PN532_COMMAND_RFCONFIGURATION;
+        mu8_PacketBuffer[1] = 5;    // Config item 5 : Max retries
+        mu8_PacketBuffer[2] = 0xFF; // MxRtyATR (default = 0xFF)
+        mu8_PacketBuffer[3] = 0x01; // MxRtyPSL (default = 0x01)
+        mu8_PacketBuffer[4] = u8_Retries;
+
+        if (!SendCommandCheckAck(mu8_PacketBuffer, 5))
+            return false;
+
+        return ReadData(mu8_PacketBuffer, 9) > 0;
+    }
+
+    // Checks if the card that has been activated by the last ReadPassiveTargetID() is still in the RF field.
+    // This is a single short frame without any crypto (Diagnose, test 6: ISO 14443-4 card presence detection).
+    // The RF field must not have been switched off since, otherwise the card has lost its state.
+    bool IsCardPresent()
+    {
+        mu8_PacketBuffer[0] = PN532_COMMAND_DIAGNOSE;
+        mu8_PacketBuffer[1] = 0x06; // NumTst: Attention Request Test or ISO/IEC14443-4 card presence detection
+
+        if (!SendCommandCheckAck(mu8_PacketBuffer, 2))
+            return false;
+
+        // Response: D5 01 Status (Status = 0x00 -> the card has answered)
+        byte u8_Len = ReadData(mu8_PacketBuffer, 20);
+        return u8_Len >= 3 && mu8_PacketBuffer[1] == PN532_COMMAND_DIAGNOSE + 1 && mu8_PacketBuffer[2] == 0x00;
+    }
+};
+
+#endif // DOORREADER_H
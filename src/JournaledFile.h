@@ -0,0 +1,582 @@
+#ifndef JOURNALEDFILE_H
+#define JOURNALEDFILE_H
+
+#include "FS.h"
+#include "debug.h"
+
+// Size of a cached page. This is the logical page size of SPIFFS, so a page is always written in one piece.
+#define JOURNAL_PAGE_SIZE 256
+
+// Number of dirty pages that are held in RAM during a transaction (JOURNAL_CACHE_PAGES * 264 bytes).
+// If a transaction touches more pages, the page that has been loaded first is moved to the journal file.
+#define JOURNAL_CACHE_PAGES 8
+
+// The maximum number of different pages that a transaction can modify (2 bytes RAM and 260 bytes journal each).
+// A transaction that needs more pages fails as a whole, see GetFreePages().
+#define JOURNAL_MAX_PAGES 256
+
+// A journal record is the page number followed by the page data
+#define JOURNAL_RECORD_SIZE (sizeof(uint32_t) + JOURNAL_PAGE_SIZE)
+#define JOURNAL_NO_RECORD 0xFFFF
+
+#define JOURNAL_MAGIC_BEGIN 0x324E524A  // "JRN2"
+#define JOURNAL_MAGIC_COMMIT 0x434D4954 // "CMIT"
+
+// A write-back layer between the user store and a SPIFFS file.
+// All writes of a transaction are collected as whole pages in RAM. When the RAM cache is full, pages are moved
+// to the journal file and read back from there. The data file is not touched before the transaction ends.
+// On commit the remaining dirty pages are written to the journal together with a checksummed commit record,
+// then all pages are copied to the data file. Each commit costs two flushes (journal + data file) no matter
+// how many records have been touched.
+// If the power fails while the data file is written, Recover() replays the journal at the next boot.
+// If the journal itself is incomplete, the data file has not been touched yet and the journal is discarded,
+// so a transaction is applied completely or not at all, however many pages it modifies.
+class JournaledFile
+{
+public:
+    JournaledFile()
+    {
+        mpi_File = NULL;
+        ms8_JournalPath = NULL;
+        mu32_Depth = 0;
+        mb_Failed = false;
+        mb_Replay = false;
+        mu32_FlushCount = 0;
+        mu32_CommitCount = 0;
+        ClearCache();
+    }
+
+    // s8_JournalPath = NULL for a file that is not in use yet (e.g. an import that replaces the database when it
+    // is complete). Then the pages are written to the data file directly when the cache is full.
+    void Open(File *pi_File, const char *s8_JournalPath)
+    {
+        if (mi_Journal)
+            mi_Journal.close();
+
+        mpi_File = pi_File;
+        ms8_JournalPath = s8_JournalPath;
+        mu32_Depth = 0;
+        mb_Failed = false;
+        mb_Replay = false;
+        ClearCache();
+    }
+
+    // Must be called after Open() and before the file content is used.
+    // Replays a complete journal or discards a torn one.
+    // returns false if a complete journal could not be replayed, then it is kept for the next attempt.
+    bool Recover()
+    {
+        if (ms8_JournalPath == NULL || !SPIFFS.exists(ms8_JournalPath))
+            return true;
+
+        bool b_Replayed = true;
+        File i_Journal = SPIFFS.open(ms8_JournalPath, "r");
+        if (i_Journal)
+        {
+            uint32_t u32_Records;
+            if (ValidateJournal(&i_Journal, &u32_Records))
+            {
+                Utils::Print("Replaying the journal of an interrupted database write...\r\n");
+
+                kPage k_Page;
+                for (uint32_t i = 0; i < u32_Records && b_Replayed; i++)
+                {
+                    b_Replayed = ReadRecord(&i_Journal, i, &k_Page) && WritePage(&k_Page);
+                }
+                Flush(mpi_File);
+            }
+            else
+            {
+                Utils::Print("Discarding an incomplete database journal (rolled back).\r\n");
+            }
+            i_Journal.close();
+        }
+
+        if (!b_Replayed)
+        {
+            Utils::Print("Could not replay the database journal.\r\n");
+            return false;
+        }
+
+        SPIFFS.remove(ms8_JournalPath);
+        return true;
+    }
+
+    // Transactions may be nested. The pages are committed when the outermost transaction ends.
+    void BeginTransaction()
+    {
+        mu32_Depth++;
+    }
+
+    // returns false if the transaction has failed and has been rolled back (see GetFreePages())
+    bool CommitTransaction()
+    {
+        if (mu32_Depth == 0)
+            return true;
+
+        if (--mu32_Depth == 0)
+            return Commit();
+
+        return !mb_Failed;
+    }
+
+    bool IsTransactionOpen()
+    {
+        return mu32_Depth > 0;
+    }
+
+    // Discards all modifications since the outermost BeginTransaction(). The data file is unchanged.
+    void RollbackTransaction()
+    {
+        Discard();
+        mu32_Depth = 0;
+        mb_Failed = false;
+    }
+
+    // The number of further pages that the current transaction can modify.
+    // If a transaction needs more than JOURNAL_MAX_PAGES pages (or the file system is full) it fails:
+    // all its modifications are discarded, further writes are ignored and CommitTransaction() returns false.
+    uint32_t GetFreePages()
+    {
+        if (ms8_JournalPath == NULL)
+            return 0xFFFFFFFF;
+
+        return mb_Failed ? 0 : JOURNAL_MAX_PAGES - mu32_Records - mu32_Pending;
+    }
+
+    void Read(uint32_t u32_Address, byte *pu8_Data, uint32_t u32_Length)
+    {
+        Replay();
+        if (mu32_Dirty == 0 && mu32_Records == 0)
+        {
+            mpi_File->seek(u32_Address, SeekSet);
+            mpi_File->read(pu8_Data, u32_Length);
+            return;
+        }
+
+        while (u32_Length > 0)
+        {
+            uint32_t u32_PageNo = u32_Address / JOURNAL_PAGE_SIZE;
+            uint32_t u32_Offset = u32_Address % JOURNAL_PAGE_SIZE;
+            uint32_t u32_Chunk = min(u32_Length, (uint32_t)(JOURNAL_PAGE_SIZE - u32_Offset));
+
+            kPage *pk_Page = FindPage(u32_PageNo);
+            uint32_t u32_Record = FindRecord(u32_PageNo);
+            if (pk_Page)
+            {
+                memcpy(pu8_Data, pk_Page->u8_Data + u32_Offset, u32_Chunk);
+            }
+            else if (u32_Record != JOURNAL_NO_RECORD)
+            {
+                // The page has been moved to the journal
+                mi_Journal.seek(RecordAddress(u32_Record) + sizeof(uint32_t) + u32_Offset, SeekSet);
+                mi_Journal.read(pu8_Data, u32_Chunk);
+            }
+            else
+            {
+                mpi_File->seek(u32_Address, SeekSet);
+                mpi_File->read(pu8_Data, u32_Chunk);
+            }
+
+            u32_Address += u32_Chunk;
+            pu8_Data += u32_Chunk;
+            u32_Length -= u32_Chunk;
+        }
+    }
+
+    // A write outside of a transaction is committed immediately.
+    // returns false if the transaction has failed (see CommitTransaction()).
+    bool Write(uint32_t u32_Address, const byte *pu8_Data, uint32_t u32_Length)
+    {
+        BeginTransaction();
+        while (u32_Length > 0)
+        {
+            uint32_t u32_Offset = u32_Address % JOURNAL_PAGE_SIZE;
+            uint32_t u32_Chunk = min(u32_Length, (uint32_t)(JOURNAL_PAGE_SIZE - u32_Offset));
+
+            kPage *pk_Page = LoadPage(u32_Address / JOURNAL_PAGE_SIZE);
+            if (!pk_Page)
+                break; // The transaction has failed
+
+            memcpy(pk_Page->u8_Data + u32_Offset, pu8_Data, u32_Chunk);
+
+            u32_Address += u32_Chunk;
+            pu8_Data += u32_Chunk;
+            u32_Length -= u32_Chunk;
+        }
+        return CommitTransaction();
+    }
+
+    // Statistics: the number of flushes / commits since startup
+    uint32_t GetFlushCount()
+    {
+        return mu32_FlushCount;
+    }
+
+    uint32_t GetCommitCount()
+    {
+        return mu32_CommitCount;
+    }
+
+private:
+    struct kPage
+    {
+        uint32_t u32_PageNo;
+        uint16_t u16_Record; // The record in the journal, JOURNAL_NO_RECORD if the page has not been written there yet
+        byte u8_Data[JOURNAL_PAGE_SIZE];
+    };
+
+    File *mpi_File;                         // The data file
+    const char *ms8_JournalPath;            // The journal file
+    File mi_Journal;                        // Open while the journal contains records of the current transaction
+    uint32_t mu32_Depth;                    // Nesting level of BeginTransaction()
+    bool mb_Failed;                         // The current transaction has been rolled back
+    bool mb_Replay;                         // A committed journal has not been copied to the data file yet
+    uint32_t mu32_Dirty;                    // Number of used entries in mk_Cache
+    uint32_t mu32_Victim;                   // The entry of mk_Cache that is moved to the journal next
+    uint32_t mu32_Pending;                  // Entries of mk_Cache without a record in the journal
+    uint32_t mu32_Records;                  // Number of records in the journal
+    uint32_t mu32_FlushCount;
+    uint32_t mu32_CommitCount;
+    kPage mk_Cache[JOURNAL_CACHE_PAGES];    // The dirty pages of the current transaction
+    uint16_t mu16_Records[JOURNAL_MAX_PAGES]; // The page number of each record in the journal
+
+    void ClearCache()
+    {
+        mu32_Dirty = 0;
+        mu32_Victim = 0;
+        mu32_Pending = 0;
+        mu32_Records = 0;
+    }
+
+    void Flush(File *pi_File)
+    {
+        pi_File->flush();
+        mu32_FlushCount++;
+    }
+
+    kPage *FindPage(uint32_t u32_PageNo)
+    {
+        for (uint32_t i = 0; i < mu32_Dirty; i++)
+        {
+            if (mk_Cache[i].u32_PageNo == u32_PageNo)
+                return &mk_Cache[i];
+        }
+        return NULL;
+    }
+
+    uint32_t FindRecord(uint32_t u32_PageNo)
+    {
+        for (uint32_t i = 0; i < mu32_Records; i++)
+        {
+            if (mu16_Records[i] == u32_PageNo)
+                return i;
+        }
+        return JOURNAL_NO_RECORD;
+    }
+
+    // Returns the cached page or loads it into a cache entry (from the journal or from the data file).
+    // Returns NULL if the transaction has failed.
+    kPage *LoadPage(uint32_t u32_PageNo)
+    {
+        if (mb_Failed)
+            return NULL;
+
+        if (!Replay())
+        {
+            Fail("Could not replay the database journal");
+            return NULL;
+        }
+
+        kPage *pk_Page = FindPage(u32_PageNo);
+        if (pk_Page)
+            return pk_Page;
+
+        uint32_t u32_Record = FindRecord(u32_PageNo);
+        if (u32_Record == JOURNAL_NO_RECORD && GetFreePages() == 0)
+        {
+            Fail("The database transaction is too large");
+            return NULL;
+        }
+
+        if (mu32_Dirty < JOURNAL_CACHE_PAGES)
+        {
+            pk_Page = &mk_Cache[mu32_Dirty++];
+        }
+        else
+        {
+            DEBUG("Journal cache full, moving page %d to the journal.", mk_Cache[mu32_Victim].u32_PageNo);
+            pk_Page = &mk_Cache[mu32_Victim];
+            mu32_Victim = (mu32_Victim + 1) % JOURNAL_CACHE_PAGES;
+            if (!EvictPage(pk_Page))
+            {
+                Fail(ms8_JournalPath ? "Could not write the database journal" : "Could not write the database");
+                return NULL;
+            }
+        }
+
+        pk_Page->u32_PageNo = u32_PageNo;
+        pk_Page->u16_Record = u32_Record;
+        if (u32_Record != JOURNAL_NO_RECORD)
+        {
+            if (!ReadRecord(&mi_Journal, u32_Record, pk_Page))
+            {
+                Fail("Could not read the database journal");
+                return NULL;
+            }
+            return pk_Page;
+        }
+
+        mu32_Pending++;
+
+        // The last page of the file may be incomplete
+        memset(pk_Page->u8_Data, 0, JOURNAL_PAGE_SIZE);
+        mpi_File->seek(u32_PageNo * JOURNAL_PAGE_SIZE, SeekSet);
+        mpi_File->read(pk_Page->u8_Data, JOURNAL_PAGE_SIZE);
+        return pk_Page;
+    }
+
+    // Copies a committed journal to the data file if the copy in Commit() has failed.
+    // returns false if the journal still could not be replayed.
+    bool Replay()
+    {
+        if (!mb_Replay)
+            return true;
+
+        mb_Replay = !Recover();
+        return !mb_Replay;
+    }
+
+    // Frees the cache entry: Writes the page to the journal (or to the data file if there is no journal)
+    bool EvictPage(kPage *pk_Page)
+    {
+        if (ms8_JournalPath == NULL)
+            return WritePage(pk_Page);
+
+        return WriteRecord(pk_Page);
+    }
+
+    bool WritePage(kPage *pk_Page)
+    {
+        mpi_File->seek(pk_Page->u32_PageNo * JOURNAL_PAGE_SIZE, SeekSet);
+        return mpi_File->write(pk_Page->u8_Data, JOURNAL_PAGE_SIZE) == JOURNAL_PAGE_SIZE;
+    }
+
+    uint32_t RecordAddress(uint32_t u32_Record)
+    {
+        return sizeof(uint32_t) + u32_Record * JOURNAL_RECORD_SIZE;
+    }
+
+    // Creates the journal at the first record of a transaction
+    bool OpenJournal()
+    {
+        if (mi_Journal)
+            return true;
+
+        mi_Journal = SPIFFS.open(ms8_JournalPath, "w+");
+        if (!mi_Journal)
+            return false;
+
+        uint32_t u32_Magic = JOURNAL_MAGIC_BEGIN;
+        return mi_Journal.write((byte *)&u32_Magic, sizeof(u32_Magic)) == sizeof(u32_Magic);
+    }
+
+    // Writes the page to its record in the journal, a page without record is appended
+    bool WriteRecord(kPage *pk_Page)
+    {
+        if (pk_Page->u16_Record == JOURNAL_NO_RECORD)
+        {
+            pk_Page->u16_Record = mu32_Records;
+            mu16_Records[mu32_Records++] = pk_Page->u32_PageNo;
+            mu32_Pending--;
+        }
+
+        if (!OpenJournal())
+            return false;
+
+        mi_Journal.seek(RecordAddress(pk_Page->u16_Record), SeekSet);
+        return mi_Journal.write((byte *)&pk_Page->u32_PageNo, sizeof(uint32_t)) == sizeof(uint32_t) &&
+               mi_Journal.write(pk_Page->u8_Data, JOURNAL_PAGE_SIZE) == JOURNAL_PAGE_SIZE;
+    }
+
+    bool ReadRecord(File *pi_Journal, uint32_t u32_Record, kPage *pk_Page)
+    {
+        pk_Page->u16_Record = u32_Record;
+        pi_Journal->seek(RecordAddress(u32_Record), SeekSet);
+        return pi_Journal->read((byte *)&pk_Page->u32_PageNo, sizeof(uint32_t)) == sizeof(uint32_t) &&
+               pi_Journal->read(pk_Page->u8_Data, JOURNAL_PAGE_SIZE) == JOURNAL_PAGE_SIZE;
+    }
+
+    // Returns the page of the record from the cache or reads it from the journal into pk_Buffer.
+    // Returns NULL if the journal cannot be read.
+    kPage *GetRecordPage(uint32_t u32_Record, kPage *pk_Buffer)
+    {
+        kPage *pk_Page = FindPage(mu16_Records[u32_Record]);
+        if (pk_Page)
+            return pk_Page;
+
+        if (!ReadRecord(&mi_Journal, u32_Record, pk_Buffer))
+            return NULL;
+        return pk_Buffer;
+    }
+
+    // Rolls back the current transaction
+    void Fail(const char *s8_Reason)
+    {
+        Utils::Print(s8_Reason);
+        Utils::Print(", all its changes are discarded.\r\n");
+        Discard();
+        mb_Failed = true;
+    }
+
+    void Discard()
+    {
+        if (mi_Journal)
+        {
+            mi_Journal.close();
+            SPIFFS.remove(ms8_JournalPath);
+        }
+        ClearCache();
+    }
+
+    // Journal layout: MAGIC_BEGIN, { page number, page data } * record count, MAGIC_COMMIT, record count, checksum
+    // Each page of a transaction has exactly one record, a page that is modified again is overwritten in place.
+    bool Commit()
+    {
+        if (mb_Failed)
+        {
+            mb_Failed = false;
+            return false;
+        }
+
+        if (ms8_JournalPath == NULL)
+        {
+            bool b_Written = true;
+            for (uint32_t i = 0; i < mu32_Dirty; i++)
+            {
+                b_Written = WritePage(&mk_Cache[i]) && b_Written;
+            }
+            if (mu32_Dirty > 0)
+                Flush(mpi_File);
+
+            ClearCache();
+            if (!b_Written)
+                return false;
+
+            mu32_CommitCount++;
+            return true;
+        }
+
+        if (mu32_Dirty == 0 && mu32_Records == 0)
+            return true;
+
+        // All pages of the transaction get a record, then the commit record makes the journal valid
+        bool b_Journaled = true;
+        for (uint32_t i = 0; i < mu32_Dirty; i++)
+        {
+            b_Journaled = WriteRecord(&mk_Cache[i]) && b_Journaled;
+        }
+
+        kPage k_Buffer;
+        uint32_t u32_Checksum = 2166136261u;
+        for (uint32_t i = 0; i < mu32_Records && b_Journaled; i++)
+        {
+            kPage *pk_Page = GetRecordPage(i, &k_Buffer);
+            if (pk_Page)
+                u32_Checksum = Checksum(u32_Checksum, pk_Page);
+            else
+                b_Journaled = false;
+        }
+
+        uint32_t u32_Footer[3] = {JOURNAL_MAGIC_COMMIT, mu32_Records, u32_Checksum};
+        if (b_Journaled)
+        {
+            mi_Journal.seek(RecordAddress(mu32_Records), SeekSet);
+            b_Journaled = mi_Journal.write((byte *)u32_Footer, sizeof(u32_Footer)) == sizeof(u32_Footer);
+            Flush(&mi_Journal);
+        }
+
+        if (!b_Journaled)
+        {
+            // The data file has not been touched, so the transaction is rolled back as a whole
+            Utils::Print("Could not write the database journal, all its changes are discarded.\r\n");
+            Discard();
+            return false;
+        }
+
+        // From here on the transaction is committed: if the data file cannot be written completely, the journal is
+        // kept and replayed before the next access (or by Recover() at the next boot).
+        bool b_Copied = true;
+        for (uint32_t i = 0; i < mu32_Records && b_Copied; i++)
+        {
+            kPage *pk_Page = GetRecordPage(i, &k_Buffer);
+            b_Copied = pk_Page && WritePage(pk_Page);
+        }
+        Flush(mpi_File);
+
+        if (b_Copied)
+        {
+            Discard();
+        }
+        else
+        {
+            Utils::Print("Could not write the database, the journal is replayed later.\r\n");
+            mi_Journal.close();
+            ClearCache();
+            mb_Replay = true;
+        }
+        mu32_CommitCount++;
+        return true;
+    }
+
+    // returns true if the journal has been written completely (commit record with valid checksum)
+    bool ValidateJournal(File *pi_Journal, uint32_t *pu32_Records)
+    {
+        uint32_t u32_Magic;
+        if (pi_Journal->read((byte *)&u32_Magic, sizeof(u32_Magic)) != sizeof(u32_Magic) || u32_Magic != JOURNAL_MAGIC_BEGIN)
+            return false;
+
+        kPage k_Page;
+        uint32_t u32_Records = 0;
+        uint32_t u32_Checksum = 2166136261u;
+        while (true)
+        {
+            if (pi_Journal->read((byte *)&k_Page.u32_PageNo, sizeof(uint32_t)) != sizeof(uint32_t))
+                return false;
+
+            // A page number is always below 65536, so it cannot be mistaken for the commit record
+            if (k_Page.u32_PageNo == JOURNAL_MAGIC_COMMIT)
+            {
+                uint32_t u32_Footer[2];
+                if (pi_Journal->read((byte *)u32_Footer, sizeof(u32_Footer)) != sizeof(u32_Footer))
+                    return false;
+
+                *pu32_Records = u32_Records;
+                return u32_Footer[0] == u32_Records && u32_Footer[1] == u32_Checksum;
+            }
+
+            if (u32_Records == JOURNAL_MAX_PAGES || pi_Journal->read(k_Page.u8_Data, JOURNAL_PAGE_SIZE) != JOURNAL_PAGE_SIZE)
+                return false;
+
+            u32_Checksum = Checksum(u32_Checksum, &k_Page);
+            u32_Records++;
+        }
+    }
+
+    // FNV-1a over page number and page data
+    uint32_t Checksum(uint32_t u32_Hash, kPage *pk_Page)
+    {
+        const byte *pu8_Data = (const byte *)&pk_Page->u32_PageNo;
+        for (uint32_t i = 0; i < sizeof(uint32_t); i++)
+        {
+            u32_Hash = (u32_Hash ^ pu8_Data[i]) * 16777619u;
+        }
+        for (uint32_t i = 0; i < JOURNAL_PAGE_SIZE; i++)
+        {
+            u32_Hash = (u32_Hash ^ pk_Page->u8_Data[i]) * 16777619u;
+        }
+        return u32_Hash;
+    }
+};
+
+#endif // JOURNALEDFILE_H
@@ -0,0 +1,172 @@
+#ifndef LATENCYSTATS_H
+#define LATENCYSTATS_H
+
+#include "types.h"
+#include "Desfire.h"
+
+#define LATENCY_BUCKETS 16
+
+// The upper bounds of the histogram buckets in microseconds
+const uint32_t LATENCY_BUCKET_LIMITS[LATENCY_BUCKETS] = {250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000,
+                                                         150000, 200000, 300000, 500000, 750000, 1000000, 0xFFFFFFFF};
+
+// The timed steps of a tap
+enum eTapPhase
+{
+    TAP_READ_TARGET = 0, // ReadPassiveTargetID()
+    TAP_PICC_AUTH,       // the PICC authentication of a random ID card (CARD_PICC_SELECT .. CARD_PICC_AUTH)
+    TAP_REAL_ID,         // GetRealCardID()
+    TAP_FIND_USER,       // UserManager::FindUser()
+    TAP_SECRETS,         // GetCachedDesfireSecrets() (GenerateDesfireSecrets() on a cache miss)
+    TAP_CHECK_SECRET,    // the secret check of a default card (CARD_AUTHENTICATE .. CARD_READ_SECRET) including TAP_SECRETS
+    TAP_ACTUATE,         // switching on the relay (at the start of CARD_DECIDE)
+    TAP_TOTAL,           // from switching on the RF field until the relay is switched on
+    TAP_PHASE_COUNT
+};
+
+const char *TAP_PHASE_NAMES[TAP_PHASE_COUNT] = {"ReadPassiveTargetID", "PICC auth", "GetRealCardID", "FindUser",
+                                                "Secrets", "Check secret", "Relay", "Total"};
+
+enum eTapCard
+{
+    TAP_CARD_CLASSIC = 0,
+    TAP_CARD_DESFIRE,
+    TAP_CARD_RANDOM,
+    TAP_CARD_COUNT
+};
+
+const char *TAP_CARD_NAMES[TAP_CARD_COUNT] = {"Classic", "Desfire", "Random ID"};
+
+// A histogram with fixed buckets. Adding a sample costs a few comparisons, the percentiles are approximated
+// by the upper bound of the bucket that contains them.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        memset(mu16_Counts, 0, sizeof(mu16_Counts));
+        mu32_Count = 0;
+        mu32_Max = 0;
+    }
+
+    void Add(uint32_t u32_Micros)
+    {
+        int i = 0;
+        while (u32_Micros > LATENCY_BUCKET_LIMITS[i])
+        {
+            i++;
+        }
+
+        // The counts saturate instead of wrapping around
+        if (mu16_Counts[i] < 0xFFFF)
+            mu16_Counts[i]++;
+
+        mu32_Count++;
+        mu32_Max = max(mu32_Max, u32_Micros);
+    }
+
+    // u32_Percent = 50 -> median
+    uint32_t GetPercentile(uint32_t u32_Percent)
+    {
+        uint32_t u32_Total = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            u32_Total += mu16_Counts[i];
+        }
+
+        uint32_t u32_Rank = (u32_Total * u32_Percent + 99) / 100;
+        uint32_t u32_Sum = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            u32_Sum += mu16_Counts[i];
+            if (u32_Sum >= u32_Rank && u32_Sum > 0)
+                return min(LATENCY_BUCKET_LIMITS[i], mu32_Max);
+        }
+        return mu32_Max;
+    }
+
+    uint32_t GetCount()
+    {
+        return mu32_Count;
+    }
+
+    uint32_t GetMax()
+    {
+        return mu32_Max;
+    }
+
+private:
+    uint16_t mu16_Counts[LATENCY_BUCKETS];
+    uint32_t mu32_Count;
+    uint32_t mu32_Max;
+};
+
+// The latency of each tap phase per card type (TAP_PHASE_COUNT * TAP_CARD_COUNT histograms, approx. 1 kB RAM)
+class TapLatency
+{
+public:
+    void Add(eCardType e_CardType, eTapPhase e_Phase, uint32_t u32_Micros)
+    {
+        mk_Histograms[GetCard(e_CardType)][e_Phase].Add(u32_Micros);
+    }
+
+    LatencyHistogram *GetHistogram(eTapCard e_Card, eTapPhase e_Phase)
+    {
+        return &mk_Histograms[e_Card][e_Phase];
+    }
+
+    void Clear()
+    {
+        for (int c = 0; c < TAP_CARD_COUNT; c++)
+        {
+            for (int p = 0; p < TAP_PHASE_COUNT; p++)
+            {
+                mk_Histograms[c][p].Clear();
+            }
+        }
+    }
+
+    // Prints a table with the phases that have been measured:
+    // "Desfire    Check secret             12    200.0    250.0    262.3"
+    void Print()
+    {
+        char s8_Buf[100];
+        Utils::Print("Card       Phase                 Count   p50 ms   p95 ms   max ms\r\n");
+        for (int c = 0; c < TAP_CARD_COUNT; c++)
+        {
+            for (int p = 0; p < TAP_PHASE_COUNT; p++)
+            {
+                LatencyHistogram *pk_Hist = &mk_Histograms[c][p];
+                if (pk_Hist->GetCount() == 0)
+                    continue;
+
+                uint32_t u32_P50 = pk_Hist->GetPercentile(50);
+                uint32_t u32_P95 = pk_Hist->GetPercentile(95);
+                uint32_t u32_Max = pk_Hist->GetMax();
+                sprintf(s8_Buf, "%-10s %-20s %6u %6u.%u %6u.%u %6u.%u\r\n", TAP_CARD_NAMES[c], TAP_PHASE_NAMES[p],
+                        pk_Hist->GetCount(), u32_P50 / 1000, (u32_P50 % 1000) / 100, u32_P95 / 1000,
+                        (u32_P95 % 1000) / 100, u32_Max / 1000, (u32_Max % 1000) / 100);
+                Utils::Print(s8_Buf);
+            }
+        }
+    }
+
+    static eTapCard GetCard(eCardType e_CardType)
+    {
+        if (e_CardType == CARD_DesRandom)
+            return TAP_CARD_RANDOM;
+        if (e_CardType & CARD_Desfire)
+            return TAP_CARD_DESFIRE;
+        return TAP_CARD_CLASSIC;
+    }
+
+private:
+    LatencyHistogram mk_Histograms[TAP_CARD_COUNT][TAP_PHASE_COUNT];
+};
+
+#endif // LATENCYSTATS_H
@@ -0,0 +1,121 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <IotWebConf.h>
+#include "DoorOpener.h"
+#include "MqttClient.h"
+
+// GET /metrics in the Prometheus text exposition format, e.g.
+//
+//   # TYPE doorguard_taps_total counter
+//   doorguard_taps_total{outcome="granted"} 42
+//
+// The lines are formatted into a fixed buffer that is sent as one chunk whenever it is full,
+// so a scrape needs neither a String nor any other heap memory. Like /api/status it requires no authentication.
+class Metrics
+{
+public:
+    void setup(WebServer *server, DoorOpener *doorOpener, MqttClient *mqttClient)
+    {
+        this->server = server;
+        this->doorOpener = doorOpener;
+        this->mqttClient = mqttClient;
+
+        server->on("/metrics", HTTP_GET, [this]() { handleMetrics(); });
+    }
+
+private:
+    WebServer *server;
+    DoorOpener *doorOpener;
+    MqttClient *mqttClient;
+    char buffer[512];
+    int length;
+
+    void handleMetrics()
+    {
+        uint64_t now = Utils::GetMillis64();
+        PollScheduler *poller = doorOpener->GetPoller();
+
+        server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server->send(200, "text/plain; version=0.0.4", "");
+        length = 0;
+
+        header("doorguard_taps_total", "counter", "Card taps by outcome");
+        for (int i = 0; i < ACCESS_RESULT_COUNT; i++)
+        {
+            append("doorguard_taps_total{outcome=\"%s\"} %u\n", ACCESS_RESULT_NAMES[i],
+                   doorOpener->GetAccessCount((eAccessResult)i));
+        }
+        metric("doorguard_reader_resets_total", "counter", "PN532 resets after communication errors",
+               doorOpener->GetReaderResetCount());
+        metric("doorguard_reader_ready", "gauge", "1 if the PN532 is initialized", doorOpener->IsReaderReady());
+
+        metric("doorguard_mqtt_connects_total", "counter", "Successful connections to the MQTT broker",
+               mqttClient->getReconnectCount());
+        metric("doorguard_mqtt_connect_failures_total", "counter", "Failed connection attempts to the MQTT broker",
+               mqttClient->getConnectFailedCount());
+        metric("doorguard_mqtt_connected", "gauge", "1 if the MQTT client is connected", mqttClient->isConnected());
+        metric("doorguard_mqtt_published_total", "counter", "MQTT messages published", mqttClient->getPublishedCount());
+        metric("doorguard_mqtt_overflows_total", "counter", "MQTT messages discarded because the queue was full",
+               mqttClient->getOverflowCount());
+
+        metric("doorguard_heap_free_bytes", "gauge", "Free heap memory", ESP.getFreeHeap());
+        metric("doorguard_heap_max_block_bytes", "gauge", "Largest free heap block", ESP.getMaxFreeBlockSize());
+        metric("doorguard_heap_fragmentation_percent", "gauge", "Heap fragmentation", ESP.getHeapFragmentation());
+
+        metric("doorguard_users", "gauge", "Users in the database", UserManager::GetUserCount());
+
+        // The duty cycle is a ratio (0..1), the poller measures it in per mille
+        uint32_t duty = poller->GetDutyCycle(now);
+        header("doorguard_rf_duty_cycle", "gauge", "Fraction of the time the RF field has been on");
+        append("doorguard_rf_duty_cycle %u.%03u\n", duty / 1000, duty % 1000);
+        metric("doorguard_poll_interval_milliseconds", "gauge", "Current off interval between two polls",
+               poller->GetOffInterval(now));
+        metric("doorguard_uptime_seconds", "gauge", "Seconds since startup", (uint32_t)(now / 1000));
+
+        flush();
+        server->sendContent("");
+    }
+
+    void metric(const char *name, const char *type, const char *help, uint32_t value)
+    {
+        header(name, type, help);
+        append("%s %u\n", name, value);
+    }
+
+    void header(const char *name, const char *type, const char *help)
+    {
+        append("# HELP %s %s.\n# TYPE %s %s\n", name, help, name, type);
+    }
+
+    // Appends a line to the buffer, sends the buffer first if the line does not fit
+    void append(const char *format, ...)
+    {
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            va_list args;
+            va_start(args, format);
+            int written = vsnprintf(buffer + length, sizeof(buffer) - length, format, args);
+            va_end(args);
+
+            if (written >= 0 && length + written < (int)sizeof(buffer))
+            {
+                length += written;
+                return;
+            }
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (length > 0)
+        {
+            // sendContent_P() also works with a buffer in RAM
+            server->sendContent_P((PGM_P)buffer, length);
+            length = 0;
+        }
+    }
+};
+
+#endif // METRICS_H
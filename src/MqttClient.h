@@ -5,6 +5,45 @@
 #include "debug.h"
 #include "MQTT.h"
 #include <ESP8266WiFi.h>
+#include <stdarg.h>
+
+// Number of outgoing messages that are buffered while the broker is not reachable
+#define MQTT_QUEUE_SIZE 6
+#define MQTT_TOPIC_SIZE 160
+#define MQTT_PAYLOAD_SIZE 512
+
+// The topics below the configured base topic. Their full names are built once in setup().
+enum eMqttTopic
+{
+    MQTT_TOPIC_DEBUG = 0,
+    MQTT_TOPIC_INFO,
+    MQTT_TOPIC_EVENTS,       // batches of access events, see AccessEvents.h
+    MQTT_TOPIC_USERS,        // subscribed: batches of user commands, see UserCommands.h
+    MQTT_TOPIC_USERS_RESULT, // the result of each user command batch
+    MQTT_TOPIC_COUNT
+};
+
+const char *MQTT_TOPIC_NAMES[MQTT_TOPIC_COUNT] = {"debug", "info", "events", "users/set", "users/result"};
+
+// The read and write buffers of the MQTT library (allocated once). An incoming message must fit into it,
+// this limits the size of a user command batch (see UserCommands.h).
+#define MQTT_BUFFER_SIZE 2048
+
+// Maximum number of queued messages that are sent per call of loop()
+#define MQTT_SEND_PER_LOOP 4
+
+// The delay between two connection attempts starts at MQTT_RECONNECT_MIN and is doubled after each failure
+#define MQTT_RECONNECT_MIN 1000
+#define MQTT_RECONNECT_MAX 60000
+
+// A connection attempt blocks the main loop (and the door). Each of its steps has a short timeout in ms:
+// the DNS lookup and the TCP connect (the defaults are 10 s and 5 s) and the CONNACK and SUBACK of the broker.
+// Worst case: 4 * 500 ms = 2 s per attempt, while the broker is down at most once per MQTT_RECONNECT_MAX.
+// The TCP timeout also limits a publish while the connection is stalled.
+#define MQTT_CONNECT_TIMEOUT 500
+#define MQTT_COMMAND_TIMEOUT 500
+// The keep alive interval in seconds
+#define MQTT_KEEP_ALIVE 10
 
 struct MqttConfig
 {
@@ -15,91 +54,281 @@ struct MqttConfig
     char topic[128] = "iot/doorguard/";
 };
 
+// Called for each message received on a subscribed topic.
+// The payload is terminated by a zero byte and may be modified.
+typedef void (*MqttMessageCallback)(eMqttTopic topic, char *payload, int length);
+MqttMessageCallback mqttMessageCallback = NULL;
+
+struct MqttMessage
+{
+    eMqttTopic topic;
+    char payload[MQTT_PAYLOAD_SIZE];
+};
+
+// publish() only copies the message into a ring buffer and returns immediately, no matter if the broker is reachable.
+// loop() sends the queued messages and reconnects with exponential backoff, so a broker that is down
+// blocks the door only for the short connection attempts (see MQTT_CONNECT_TIMEOUT).
+// If the queue is full the oldest message is discarded.
+// Topics and payloads live in fixed buffers, so after setup() no heap memory is allocated
+// (Arduino Strings would fragment the heap over weeks of uptime).
 class MqttClient
 {
 public:
+    MqttClient() : client(MQTT_BUFFER_SIZE)
+    {
+    }
+
     void setup(MqttConfig _config)
     {
         DEBUG("Setting up MQTT client.");
         config = _config;
-        uint8_t lastCharOfTopic = strlen(config.topic) - 1;
-        baseTopic = String(config.topic) + (lastCharOfTopic >= 0 && config.topic[lastCharOfTopic] == '/' ? "" : "/");
+        int lastCharOfTopic = strlen(config.topic) - 1;
+        const char *separator = (lastCharOfTopic >= 0 && config.topic[lastCharOfTopic] == '/') ? "" : "/";
+        for (int i = 0; i < MQTT_TOPIC_COUNT; i++)
+        {
+            snprintf(topics[i], MQTT_TOPIC_SIZE, "%s%s%s", config.topic, separator, MQTT_TOPIC_NAMES[i]);
+        }
 
+        net.setTimeout(MQTT_CONNECT_TIMEOUT);
         client.begin(config.server, atoi(config.port), net);
+        client.setOptions(MQTT_KEEP_ALIVE, true, MQTT_COMMAND_TIMEOUT);
+        client.onMessageAdvanced(&onMessage);
         initialized = true;
     }
 
+    // Requests a connection attempt with the next call of loop() (e.g. after WiFi has connected)
     void connect()
     {
-        DEBUG("Establishing MQTT client connection.");
-        client.connect("DoorGuard", config.username, config.password);
-        if (client.connected())
-        {
-            char message[64];
-            snprintf(message, 64, "Hello from %08X, running DoorGuard version %s.", ESP.getChipId(), VERSION);
-            info(message);
-        }
+        reconnectDelay = MQTT_RECONNECT_MIN;
+        nextConnect = millis();
     }
 
     void loop()
     {
+        if (!initialized)
+        {
+            return;
+        }
+
         client.loop();
+
+        if (!client.connected())
+        {
+            if ((long)(millis() - nextConnect) < 0)
+            {
+                return;
+            }
+
+            if (!tryConnect())
+            {
+                nextConnect = millis() + reconnectDelay;
+                reconnectDelay = min(reconnectDelay * 2, (uint32_t)MQTT_RECONNECT_MAX);
+                return;
+            }
+            reconnectDelay = MQTT_RECONNECT_MIN;
+        }
+
+        for (int i = 0; i < MQTT_SEND_PER_LOOP && queueCount > 0; i++)
+        {
+            MqttMessage *message = &queue[queueHead];
+            const char *topic = topics[message->topic];
+            DEBUG("Publishing message to '%s':", topic);
+            DEBUG(message->payload);
+            if (!client.publish(topic, message->payload))
+            {
+                // The message stays in the queue and is sent after the reconnect
+                DEBUG("Unable to publish a message to '%s'.", topic);
+                return;
+            }
+
+            queueHead = (queueHead + 1) % MQTT_QUEUE_SIZE;
+            queueCount--;
+            publishedCount++;
+        }
     }
 
     void debug(const char *message)
     {
-        publish(baseTopic + "debug", message);
+        publish(MQTT_TOPIC_DEBUG, message);
     }
 
     void info(const char *message)
     {
-        publish(baseTopic + "info", message);
+        publish(MQTT_TOPIC_INFO, message);
     }
 
-    void publish(const String &topic, const String &payload)
-    {
-        publish(topic.c_str(), payload.c_str());
-    }
-    void publish(String &topic, const char *payload)
-    {
-        publish(topic.c_str(), payload);
-    }
-    void publish(const char *topic, const String &payload)
+    // Queues the message. Takes constant time and never blocks.
+    void publish(eMqttTopic topic, const char *payload)
     {
-        publish(topic, payload.c_str());
+        if (!checkLength(topic, strlen(payload)))
+        {
+            return;
+        }
+
+        char *buffer = reserve(topic);
+        if (buffer == NULL)
+        {
+            return;
+        }
+
+        strcpy(buffer, payload);
+        commit();
     }
-    void publish(const char *topic, const char *payload)
+
+    // Formats the payload directly into the queue (printf syntax)
+    void publishf(eMqttTopic topic, const char *format, ...)
     {
-        if (!initialized)
+        // The length is determined first, a message that is too long must not displace a queued one
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(NULL, 0, format, args);
+        va_end(args);
+
+        if (!checkLength(topic, length))
         {
             return;
         }
 
-        if (!client.connected())
+        char *buffer = reserve(topic);
+        if (buffer == NULL)
         {
-            connect();
+            return;
         }
 
-        if (!client.connected())
+        va_start(args, format);
+        vsnprintf(buffer, MQTT_PAYLOAD_SIZE, format, args);
+        va_end(args);
+        commit();
+    }
+
+    // Returns the payload buffer (MQTT_PAYLOAD_SIZE bytes) of the next queue entry for a caller that builds
+    // the payload in place. The message is only queued when commit() is called afterwards.
+    // Returns NULL if the client is not configured.
+    char *reserve(eMqttTopic topic)
+    {
+        if (!initialized)
         {
-            // Something failed
-            DEBUG("Connection to MQTT broker failed.");
-            DEBUG("Unable to publish a message to '%s'.", topic);
-            return;
+            return NULL;
+        }
+
+        if (queueCount == MQTT_QUEUE_SIZE)
+        {
+            // Discard the oldest message
+            queueHead = (queueHead + 1) % MQTT_QUEUE_SIZE;
+            queueCount--;
+            overflowCount++;
         }
 
-        DEBUG("Publishing message to '%s':", topic);
-        DEBUG(payload);
-        client.publish(topic, payload);
+        MqttMessage *message = &queue[(queueHead + queueCount) % MQTT_QUEUE_SIZE];
+        message->topic = topic;
+        message->payload[0] = 0;
+        return message->payload;
     }
 
+    void commit()
+    {
+        queueCount++;
+        queuedCount++;
+    }
+
+    const char *getTopic(eMqttTopic topic)
+    {
+        return topics[topic];
+    }
+
+    // The callback for the subscribed topics (there is only one MqttClient)
+    void setMessageCallback(MqttMessageCallback callback)
+    {
+        mqttMessageCallback = callback;
+    }
+
+    // Statistics since startup
+    uint32_t getQueuedCount() { return queuedCount; }
+    uint32_t getPublishedCount() { return publishedCount; }
+    uint32_t getOverflowCount() { return overflowCount; }
+    uint32_t getDroppedCount() { return droppedCount; }
+    uint32_t getReconnectCount() { return reconnectCount; }
+    uint32_t getConnectFailedCount() { return connectFailedCount; }
+    uint8_t getQueueLength() { return queueCount; }
+    bool isConnected() { return initialized && client.connected(); }
+
 private:
     MqttConfig config;
     WiFiClient net;
     MQTTClient client;
-    bool connected = false;
     bool initialized = false;
-    String baseTopic;
+    char topics[MQTT_TOPIC_COUNT][MQTT_TOPIC_SIZE];
+
+    MqttMessage queue[MQTT_QUEUE_SIZE];
+    uint8_t queueHead = 0;  // Index of the oldest message
+    uint8_t queueCount = 0; // Number of queued messages
+    uint32_t nextConnect = 0;
+    uint32_t reconnectDelay = MQTT_RECONNECT_MIN;
+
+    uint32_t queuedCount = 0;
+    uint32_t publishedCount = 0;
+    uint32_t overflowCount = 0; // Messages discarded because the queue was full
+    uint32_t droppedCount = 0;  // Messages discarded because they were too long
+    uint32_t reconnectCount = 0;
+    uint32_t connectFailedCount = 0;
+
+    // Returns false (and counts the message as dropped) if a payload of this length does not fit into the queue
+    bool checkLength(eMqttTopic topic, int length)
+    {
+        if (length >= 0 && length < MQTT_PAYLOAD_SIZE)
+        {
+            return true;
+        }
+
+        DEBUG("Message to '%s' is too long, dropped.", topics[topic]);
+        droppedCount++;
+        return false;
+    }
+
+    static void onMessage(MQTTClient *client, char topic[], char payload[], int length)
+    {
+        // The topic names are compared by their suffix, so this works without access to the instance
+        int topicLength = strlen(topic);
+        for (int i = 0; i < MQTT_TOPIC_COUNT; i++)
+        {
+            int nameLength = strlen(MQTT_TOPIC_NAMES[i]);
+            if (topicLength > nameLength && strcmp(topic + topicLength - nameLength, MQTT_TOPIC_NAMES[i]) == 0 &&
+                topic[topicLength - nameLength - 1] == '/')
+            {
+                if (mqttMessageCallback)
+                    mqttMessageCallback((eMqttTopic)i, payload, length);
+                return;
+            }
+        }
+    }
+
+    bool tryConnect()
+    {
+        DEBUG("Establishing MQTT client connection.");
+
+        // The library would resolve the name of the broker with the default DNS timeout
+        IPAddress address;
+        if (!WiFi.hostByName(config.server, address, MQTT_CONNECT_TIMEOUT))
+        {
+            DEBUG("Unable to resolve the MQTT broker '%s', next attempt in %u ms.", config.server, reconnectDelay);
+            connectFailedCount++;
+            return false;
+        }
+        client.setHost(address, atoi(config.port));
+
+        client.connect("DoorGuard", config.username, config.password);
+        if (!client.connected())
+        {
+            DEBUG("Connection to MQTT broker failed, next attempt in %u ms.", reconnectDelay);
+            connectFailedCount++;
+            return false;
+        }
+
+        reconnectCount++;
+        client.subscribe(topics[MQTT_TOPIC_USERS]);
+        publishf(MQTT_TOPIC_INFO, "Hello from %08X, running DoorGuard version %s.", ESP.getChipId(), VERSION);
+        return true;
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
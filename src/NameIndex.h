@@ -0,0 +1,173 @@
+#ifndef NAMEINDEX_H
+#define NAMEINDEX_H
+
+#include "types.h"
+
+// A sorted array of user name hashes and the cold keys of the users (see UserStore).
+// It allows the terminal commands that work by name (DEL, DOOR1, DOOR2, DOOR12) to read only the
+// matching record from flash instead of all of them.
+// The hash is case insensitive like the stricmp() comparison used by the terminal.
+// Different names may have the same hash, so the caller must compare the name of the record found.
+class NameIndex
+{
+public:
+    NameIndex()
+    {
+        mk_Entries = NULL;
+        mu32_Capacity = 0;
+        mu32_Count = 0;
+    }
+
+    ~NameIndex()
+    {
+        Free();
+    }
+
+    // returns false if the index would be larger than u32_MaxBytes or there is not enough heap.
+    // In this case the index stays disabled.
+    bool Init(uint32_t u32_MaxEntries, uint32_t u32_MaxBytes)
+    {
+        Free();
+
+        if (u32_MaxEntries * sizeof(kEntry) > u32_MaxBytes)
+            return false;
+
+        mk_Entries = (kEntry *)malloc(u32_MaxEntries * sizeof(kEntry));
+        if (mk_Entries == NULL)
+            return false;
+
+        mu32_Capacity = u32_MaxEntries;
+        return true;
+    }
+
+    // Doubles the capacity. realloc() may hold the old and the new array at the same time,
+    // so u32_MaxBytes limits the new array.
+    // returns false if the new array would be larger or there is not enough heap. In this case the old array is kept.
+    bool Grow(uint32_t u32_MaxBytes)
+    {
+        if (!IsValid() || 2 * mu32_Capacity * sizeof(kEntry) > u32_MaxBytes)
+            return false;
+
+        kEntry *pk_Entries = (kEntry *)realloc(mk_Entries, 2 * mu32_Capacity * sizeof(kEntry));
+        if (pk_Entries == NULL)
+            return false;
+
+        mk_Entries = pk_Entries;
+        mu32_Capacity *= 2;
+        return true;
+    }
+
+    void Free()
+    {
+        free(mk_Entries);
+        mk_Entries = NULL;
+        mu32_Capacity = 0;
+        mu32_Count = 0;
+    }
+
+    bool IsValid()
+    {
+        return mk_Entries != NULL;
+    }
+
+    void Clear()
+    {
+        mu32_Count = 0;
+    }
+
+    // FNV-1a over the lower case characters up to the terminating zero.
+    // The random data behind the name (see AddCard()) is not included.
+    static uint32_t Hash(const char *s8_Name)
+    {
+        uint32_t u32_Hash = 2166136261u;
+        for (; *s8_Name; s8_Name++)
+        {
+            u32_Hash ^= (byte)tolower(*s8_Name);
+            u32_Hash *= 16777619u;
+        }
+        return u32_Hash;
+    }
+
+    // returns false if the capacity is exhausted (call Grow()).
+    bool Insert(const char *s8_Name, uint32_t u32_ColdKey)
+    {
+        if (!IsValid() || mu32_Count >= mu32_Capacity)
+            return false;
+
+        uint32_t u32_Hash = Hash(s8_Name);
+        uint32_t u32_Pos = LowerBound(u32_Hash);
+        memmove(&mk_Entries[u32_Pos + 1], &mk_Entries[u32_Pos], (mu32_Count - u32_Pos) * sizeof(kEntry));
+        mk_Entries[u32_Pos].u32_Hash = u32_Hash;
+        mk_Entries[u32_Pos].u16_ColdKey = u32_ColdKey;
+        mu32_Count++;
+        return true;
+    }
+
+    bool Remove(const char *s8_Name, uint32_t u32_ColdKey)
+    {
+        if (!IsValid())
+            return false;
+
+        uint32_t u32_Hash = Hash(s8_Name);
+        for (uint32_t i = LowerBound(u32_Hash); i < mu32_Count && mk_Entries[i].u32_Hash == u32_Hash; i++)
+        {
+            if (mk_Entries[i].u16_ColdKey == u32_ColdKey)
+            {
+                memmove(&mk_Entries[i], &mk_Entries[i + 1], (mu32_Count - i - 1) * sizeof(kEntry));
+                mu32_Count--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // returns the position of the first entry with a hash >= u32_Hash (GetCount() if there is none)
+    uint32_t LowerBound(uint32_t u32_Hash)
+    {
+        uint32_t u32_Low = 0;
+        uint32_t u32_High = mu32_Count;
+        while (u32_Low < u32_High)
+        {
+            uint32_t u32_Mid = u32_Low + (u32_High - u32_Low) / 2;
+            if (mk_Entries[u32_Mid].u32_Hash < u32_Hash)
+                u32_Low = u32_Mid + 1;
+            else
+                u32_High = u32_Mid;
+        }
+        return u32_Low;
+    }
+
+    uint32_t GetHash(uint32_t u32_Pos)
+    {
+        return mk_Entries[u32_Pos].u32_Hash;
+    }
+
+    uint32_t GetColdKey(uint32_t u32_Pos)
+    {
+        return mk_Entries[u32_Pos].u16_ColdKey;
+    }
+
+    uint32_t GetCount()
+    {
+        return mu32_Count;
+    }
+
+    // The RAM occupied by the index in bytes
+    uint32_t GetMemoryUsage()
+    {
+        return mu32_Capacity * sizeof(kEntry);
+    }
+
+private:
+    struct kEntry
+    {
+        uint32_t u32_Hash;
+        uint16_t u16_ColdKey;
+    };
+
+    kEntry *mk_Entries;     // sorted by u32_Hash
+    uint32_t mu32_Capacity; // allocated entries
+    uint32_t mu32_Count;    // used entries
+};
+
+#endif // NAMEINDEX_H
@@ -0,0 +1,155 @@
+#ifndef POLLSCHEDULER_H
+#define POLLSCHEDULER_H
+
+#include "types.h"
+
+// The RF field off interval right after a card has been removed or rejected (someone is standing at the door)
+#define POLL_INTERVAL_FAST 50
+// The RF field off interval during normal activity
+#ifdef RF_OFF_INTERVAL
+#define POLL_INTERVAL_NORMAL RF_OFF_INTERVAL
+#else
+#define POLL_INTERVAL_NORMAL 200
+#endif
+// The RF field off interval when no card has been seen for POLL_IDLE_AFTER
+#define POLL_INTERVAL_IDLE 1000
+
+// Duration of the fast polling after an activity
+#define POLL_FAST_PERIOD 5000
+// After this time without activity the interval backs off from POLL_INTERVAL_NORMAL to POLL_INTERVAL_IDLE
+#define POLL_IDLE_AFTER 60000
+
+// MxRtyPassiveActivation for ReadPassiveTargetID(): while active the field stays on longer to catch an approaching card
+#define POLL_RETRIES_ACTIVE 2
+#define POLL_RETRIES_IDLE 1
+
+// Decides how long the RF field stays off between two polls and how many activation retries are used.
+// When the door is busy the reader polls fast, at night it backs off to save power
+// (the PN532 board consumes approx 110 mA with the RF field on and 18 mA with the field off).
+// It also measures the RF duty cycle and the time until a new card is detected.
+class PollScheduler
+{
+public:
+    PollScheduler()
+    {
+        mu64_LastActivity = 0;
+        mu64_StatsStart = 0;
+        mu64_FieldOnSince = 0;
+        mu64_FieldOnTotal = 0;
+        mu64_LastPollEnd = 0;
+        mb_FieldOn = false;
+        mu32_Polls = 0;
+        mu32_Detections = 0;
+        mu64_LatencySum = 0;
+        mu32_LatencyMax = 0;
+    }
+
+    uint32_t GetOffInterval(uint64_t u64_Now)
+    {
+        uint64_t u64_Quiet = u64_Now - mu64_LastActivity;
+        if (u64_Quiet < POLL_FAST_PERIOD)
+            return POLL_INTERVAL_FAST;
+        if (u64_Quiet < POLL_IDLE_AFTER)
+            return POLL_INTERVAL_NORMAL;
+
+        // Back off smoothly: double the interval with each further POLL_IDLE_AFTER period
+        uint32_t u32_Interval = POLL_INTERVAL_NORMAL;
+        for (uint64_t u64_Period = POLL_IDLE_AFTER; u64_Period <= u64_Quiet && u32_Interval < POLL_INTERVAL_IDLE; u64_Period *= 2)
+        {
+            u32_Interval *= 2;
+        }
+        return min(u32_Interval, (uint32_t)POLL_INTERVAL_IDLE);
+    }
+
+    byte GetRetries(uint64_t u64_Now)
+    {
+        return (u64_Now - mu64_LastActivity < POLL_IDLE_AFTER) ? POLL_RETRIES_ACTIVE : POLL_RETRIES_IDLE;
+    }
+
+    // A card has been removed, presented or rejected
+    void OnActivity(uint64_t u64_Now)
+    {
+        mu64_LastActivity = u64_Now;
+    }
+
+    void OnFieldOn(uint64_t u64_Now)
+    {
+        if (mb_FieldOn)
+            return;
+
+        if (mu64_StatsStart == 0)
+            mu64_StatsStart = u64_Now;
+
+        mb_FieldOn = true;
+        mu64_FieldOnSince = u64_Now;
+        mu32_Polls++;
+    }
+
+    void OnFieldOff(uint64_t u64_Now)
+    {
+        if (!mb_FieldOn)
+            return;
+
+        mb_FieldOn = false;
+        mu64_FieldOnTotal += u64_Now - mu64_FieldOnSince;
+        mu64_LastPollEnd = u64_Now;
+    }
+
+    // A new card has been found in the RF field.
+    // The card has arrived at the earliest when the previous poll ended,
+    // so the time since then is the upper bound of the detection latency.
+    void OnCardDetected(uint64_t u64_Now)
+    {
+        OnActivity(u64_Now);
+        if (mu64_LastPollEnd == 0)
+            return;
+
+        uint32_t u32_Latency = (uint32_t)(u64_Now - mu64_LastPollEnd);
+        mu32_Detections++;
+        mu64_LatencySum += u32_Latency;
+        mu32_LatencyMax = max(mu32_LatencyMax, u32_Latency);
+    }
+
+    // Statistics since the first poll
+    uint32_t GetPollCount()
+    {
+        return mu32_Polls;
+    }
+
+    // The time the RF field has been on in per mille of the elapsed time
+    uint32_t GetDutyCycle(uint64_t u64_Now)
+    {
+        uint64_t u64_Total = u64_Now - mu64_StatsStart;
+        uint64_t u64_On = mu64_FieldOnTotal + (mb_FieldOn ? u64_Now - mu64_FieldOnSince : 0);
+        return u64_Total ? (uint32_t)(u64_On * 1000 / u64_Total) : 0;
+    }
+
+    uint32_t GetDetectionCount()
+    {
+        return mu32_Detections;
+    }
+
+    uint32_t GetAverageLatency()
+    {
+        return mu32_Detections ? (uint32_t)(mu64_LatencySum / mu32_Detections) : 0;
+    }
+
+    uint32_t GetMaxLatency()
+    {
+        return mu32_LatencyMax;
+    }
+
+private:
+    uint64_t mu64_LastActivity;
+    uint64_t mu64_StatsStart;   // The time of the first poll
+    uint64_t mu64_FieldOnSince; // The time when the RF field has been switched on
+    uint64_t mu64_FieldOnTotal; // The accumulated time the RF field was on (without the current poll)
+    uint64_t mu64_LastPollEnd;  // The time when the RF field has been switched off the last time
+    bool mb_FieldOn;
+    uint32_t mu32_Polls;
+    uint32_t mu32_Detections;
+    uint64_t mu64_LatencySum;
+    uint32_t mu32_LatencyMax;
+};
+
+#endif // POLLSCHEDULER_H
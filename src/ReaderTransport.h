@@ -0,0 +1,185 @@
+#ifndef READERTRANSPORT_H
+#define READERTRANSPORT_H
+
+#include "DoorReader.h"
+
+// The bus between the ESP8266 and the PN532, see PN532_TRANSPORT in DoorOpener.h
+#define TRANSPORT_SOFT_SPI 1
+#define TRANSPORT_HARD_SPI 2
+#define TRANSPORT_I2C 3
+
+// The time the PN532 needs per command frame besides the transfer (ACK, status polling, RF exchange with the card)
+#define TRANSPORT_FRAME_OVERHEAD_US 1500
+
+// The bus used to communicate with the PN532.
+// The desfire_rfid library implements the bus drivers, which of them are compiled is selected by the switches
+// USE_SOFTWARE_SPI, USE_HARDWARE_SPI and USE_HARDWARE_I2C in its PN532.h.
+// A transport initializes the bus and describes its speed, so the duration of a card exchange can be
+// estimated per transport and clock rate (see SimulatedTransport).
+class ReaderTransport
+{
+public:
+    // Called once in setup() before the first PN532.begin()
+    virtual void Init(DoorReader *pi_Reader) = 0;
+
+    // Called after each PN532.begin() (which resets the bus settings)
+    virtual void OnReset(DoorReader *pi_Reader)
+    {
+    }
+
+    virtual const char *GetName() = 0;
+
+    // The net transfer rate of the bus
+    virtual uint32_t GetBytesPerSecond() = 0;
+
+    // The estimated duration of a command frame with u32_Bytes bytes sent and received
+    uint32_t GetFrameMicros(uint32_t u32_Bytes)
+    {
+        return TRANSPORT_FRAME_OVERHEAD_US + (uint32_t)((uint64_t)u32_Bytes * 1000000 / GetBytesPerSecond());
+    }
+};
+
+// Software SPI with a slow clock of approx. 10 kHz which can be transmitted over longer cables.
+// If you want to get this faster modify PN532_SOFT_SPI_DELAY in the library but you must check the
+// SPI signals on an oscilloscope!
+class SoftSpiTransport : public ReaderTransport
+{
+public:
+    SoftSpiTransport(byte u8_Clk, byte u8_Miso, byte u8_Mosi, byte u8_Sel, byte u8_Reset)
+    {
+        mu8_Clk = u8_Clk;
+        mu8_Miso = u8_Miso;
+        mu8_Mosi = u8_Mosi;
+        mu8_Sel = u8_Sel;
+        mu8_Reset = u8_Reset;
+    }
+
+    void Init(DoorReader *pi_Reader)
+    {
+        pi_Reader->InitSoftwareSPI(mu8_Clk, mu8_Miso, mu8_Mosi, mu8_Sel, mu8_Reset);
+    }
+
+    const char *GetName()
+    {
+        return "Software SPI";
+    }
+
+    uint32_t GetBytesPerSecond()
+    {
+        return 10000 / 8;
+    }
+
+private:
+    byte mu8_Clk, mu8_Miso, mu8_Mosi, mu8_Sel, mu8_Reset;
+};
+
+#if USE_HARDWARE_SPI
+#include <SPI.h>
+
+// The hardware SPI of the ESP8266 (D5 = SCK, D6 = MISO, D7 = MOSI). The PN532 supports up to 5 MHz.
+// Long cables need a lower clock.
+class HardSpiTransport : public ReaderTransport
+{
+public:
+    HardSpiTransport(byte u8_Sel, byte u8_Reset, uint32_t u32_Clock)
+    {
+        mu8_Sel = u8_Sel;
+        mu8_Reset = u8_Reset;
+        mu32_Clock = u32_Clock;
+    }
+
+    void Init(DoorReader *pi_Reader)
+    {
+        pi_Reader->InitHardwareSPI(mu8_Sel, mu8_Reset);
+    }
+
+    // The library sets its default clock in begin()
+    void OnReset(DoorReader *pi_Reader)
+    {
+        SPI.setFrequency(mu32_Clock);
+    }
+
+    const char *GetName()
+    {
+        return "Hardware SPI";
+    }
+
+    uint32_t GetBytesPerSecond()
+    {
+        return mu32_Clock / 8;
+    }
+
+private:
+    byte mu8_Sel, mu8_Reset;
+    uint32_t mu32_Clock;
+};
+#endif
+
+#if USE_HARDWARE_I2C
+#include <Wire.h>
+
+// I2C with 100 kHz (standard mode) or 400 kHz (fast mode), 9 clocks per byte including the ACK bit
+class I2cTransport : public ReaderTransport
+{
+public:
+    I2cTransport(byte u8_Reset, uint32_t u32_Clock)
+    {
+        mu8_Reset = u8_Reset;
+        mu32_Clock = u32_Clock;
+    }
+
+    void Init(DoorReader *pi_Reader)
+    {
+        pi_Reader->InitI2C(mu8_Reset);
+    }
+
+    void OnReset(DoorReader *pi_Reader)
+    {
+        Wire.setClock(mu32_Clock);
+    }
+
+    const char *GetName()
+    {
+        return "I2C";
+    }
+
+    uint32_t GetBytesPerSecond()
+    {
+        return mu32_Clock / 9;
+    }
+
+private:
+    byte mu8_Reset;
+    uint32_t mu32_Clock;
+};
+#endif
+
+// A transport without hardware that only models the transfer rate.
+// It is used on the host to estimate the tap latency for a given bus and clock rate.
+class SimulatedTransport : public ReaderTransport
+{
+public:
+    SimulatedTransport(uint32_t u32_BytesPerSecond)
+    {
+        mu32_BytesPerSecond = u32_BytesPerSecond;
+    }
+
+    void Init(DoorReader *pi_Reader)
+    {
+    }
+
+    const char *GetName()
+    {
+        return "Simulated";
+    }
+
+    uint32_t GetBytesPerSecond()
+    {
+        return mu32_BytesPerSecond;
+    }
+
+private:
+    uint32_t mu32_BytesPerSecond;
+};
+
+#endif // READERTRANSPORT_H
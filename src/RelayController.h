@@ -0,0 +1,106 @@
+#ifndef RELAYCONTROLLER_H
+#define RELAYCONTROLLER_H
+
+#include "types.h"
+
+// Number of doors (relays) that can be controlled, see eUserFlags
+#define RELAY_DOOR_COUNT 2
+
+// Switches a relay on (b_On = true) or off
+typedef void (*RelayCallback)(byte u8_Pin, bool b_On);
+
+// Holds the relays of both doors for a given interval without blocking.
+// Each door has its own timer, so the doors can be opened independently and overlapping.
+// If a door is opened again while it is still open, the interval is extended.
+// loop() must be called from the main loop with the current time. The hold time is exact up to the
+// interval between two calls of loop().
+class RelayController
+{
+public:
+    RelayController()
+    {
+        mf_Relay = NULL;
+        for (int i = 0; i < RELAY_DOOR_COUNT; i++)
+        {
+            mk_Doors[i].u8_Pin = 0;
+            mk_Doors[i].b_Open = false;
+            mk_Doors[i].u64_CloseAt = 0;
+        }
+    }
+
+    void Begin(RelayCallback f_Relay, byte u8_Door1Pin, byte u8_Door2Pin)
+    {
+        mf_Relay = f_Relay;
+        mk_Doors[0].u8_Pin = u8_Door1Pin;
+        mk_Doors[1].u8_Pin = u8_Door2Pin;
+    }
+
+    // Opens the doors in u8_Flags (DOOR_ONE = bit 0, DOOR_TWO = bit 1) for u32_Interval milliseconds from u64_Now
+    void Open(byte u8_Flags, uint64_t u64_Now, uint32_t u32_Interval)
+    {
+        for (int i = 0; i < RELAY_DOOR_COUNT; i++)
+        {
+            if ((u8_Flags & (1 << i)) == 0)
+                continue;
+
+            kDoor *pk_Door = &mk_Doors[i];
+            pk_Door->u64_CloseAt = u64_Now + u32_Interval;
+            if (!pk_Door->b_Open)
+            {
+                pk_Door->b_Open = true;
+                SetRelay(pk_Door, true);
+            }
+        }
+    }
+
+    // Closes all doors immediately
+    void CloseAll()
+    {
+        for (int i = 0; i < RELAY_DOOR_COUNT; i++)
+        {
+            if (mk_Doors[i].b_Open)
+            {
+                mk_Doors[i].b_Open = false;
+                SetRelay(&mk_Doors[i], false);
+            }
+        }
+    }
+
+    void loop(uint64_t u64_Now)
+    {
+        for (int i = 0; i < RELAY_DOOR_COUNT; i++)
+        {
+            kDoor *pk_Door = &mk_Doors[i];
+            if (pk_Door->b_Open && u64_Now >= pk_Door->u64_CloseAt)
+            {
+                pk_Door->b_Open = false;
+                SetRelay(pk_Door, false);
+            }
+        }
+    }
+
+    // u8_Door = 0 for door 1, 1 for door 2
+    bool IsOpen(byte u8_Door)
+    {
+        return u8_Door < RELAY_DOOR_COUNT && mk_Doors[u8_Door].b_Open;
+    }
+
+private:
+    struct kDoor
+    {
+        byte u8_Pin;
+        bool b_Open;
+        uint64_t u64_CloseAt; // The time when the relay is switched off
+    };
+
+    RelayCallback mf_Relay;
+    kDoor mk_Doors[RELAY_DOOR_COUNT];
+
+    void SetRelay(kDoor *pk_Door, bool b_On)
+    {
+        if (mf_Relay)
+            mf_Relay(pk_Door->u8_Pin, b_On);
+    }
+};
+
+#endif // RELAYCONTROLLER_H
@@ -0,0 +1,208 @@
+#ifndef RESTAPI_H
+#define RESTAPI_H
+
+#include <IotWebConf.h>
+#include "DoorOpener.h"
+
+// Maximum number of users per page of /api/users
+#define REST_PAGE_SIZE_MAX 50
+#define REST_PAGE_SIZE_DEFAULT 20
+
+// JSON endpoints on the web server of IotWebConf:
+//
+//   POST /api/door?door=1|2|12          opens the door(s) for OPEN_INTERVAL
+//   GET  /api/user?uid=04A1B2C3D4E5F6   {"uid":"04A1B2C3D4E5F6","name":"Claudia","doors":1}
+//   GET  /api/users?after=<uid>&limit=20  {"users":[...],"next":"<uid of the last user>"|null}
+//   GET  /api/status                    reader, doors and polling statistics
+//
+// The handlers use only the state in RAM and the user store (a few page reads per lookup), they never wait for the PN532.
+// A door request switches the relay directly, the card pipeline of DoorOpener is not involved.
+// A request is served between two steps of the card pipeline, so it waits for at most one card command
+// (an Authenticate takes approx. 90 ms with the software SPI). The reset of the PN532 after a communication error
+// blocks for approx. 500 ms and a terminal command until it has finished.
+// All endpoints except /api/status require HTTP basic authentication with the terminal password.
+class RestApi
+{
+public:
+    void setup(WebServer *server, DoorOpener *doorOpener)
+    {
+        this->server = server;
+        this->doorOpener = doorOpener;
+
+        server->on("/api/door", HTTP_POST, [this]() { handleDoor(); });
+        server->on("/api/user", HTTP_GET, [this]() { handleUser(); });
+        server->on("/api/users", HTTP_GET, [this]() { handleUsers(); });
+        server->on("/api/status", HTTP_GET, [this]() { handleStatus(); });
+    }
+
+    // Requests the terminal password (if there is one). Returns false if the request has been answered.
+    bool authenticate()
+    {
+        if (PASSWORD[0] == 0 || server->authenticate(IOTWEBCONF_ADMIN_USER_NAME, PASSWORD))
+        {
+            return true;
+        }
+        server->requestAuthentication();
+        return false;
+    }
+
+private:
+    WebServer *server;
+    DoorOpener *doorOpener;
+    char buffer[400];
+
+    // The user list is streamed user by user, UserManager::VisitUsers() calls a plain function
+    static RestApi *visiting;
+    bool firstUser;
+    uint64_t lastID;
+
+    void handleDoor()
+    {
+        if (!authenticate())
+        {
+            return;
+        }
+
+        String door = server->arg("door");
+        byte flags = door == "1" ? DOOR_ONE : door == "2" ? DOOR_TWO : door == "12" ? DOOR_BOTH : NO_DOOR;
+        if (flags == NO_DOOR)
+        {
+            sendError(400, "door must be 1, 2 or 12");
+            return;
+        }
+
+        doorOpener->OpenDoor(flags);
+        Utils::Print("Door opened by the REST API\r\n");
+
+        snprintf(buffer, sizeof(buffer), "{\"doors\":%u,\"interval\":%u}", flags, OPEN_INTERVAL);
+        server->send(200, "application/json", buffer);
+    }
+
+    void handleUser()
+    {
+        if (!authenticate())
+        {
+            return;
+        }
+
+        uint64_t id;
+        const char *rest;
+        if (!UserManager::ParseUid(server->arg("uid").c_str(), &id, &rest) || *rest != 0)
+        {
+            sendError(400, "invalid uid");
+            return;
+        }
+
+        kUser user;
+        if (!UserManager::FindUser(id, &user))
+        {
+            sendError(404, "not found");
+            return;
+        }
+
+        formatUser(&user, buffer, sizeof(buffer));
+        server->send(200, "application/json", buffer);
+    }
+
+    void handleUsers()
+    {
+        if (!authenticate())
+        {
+            return;
+        }
+
+        uint64_t after = 0;
+        if (server->hasArg("after") && !UserManager::ParseUid(server->arg("after").c_str(), &after, NULL))
+        {
+            sendError(400, "invalid uid");
+            return;
+        }
+
+        int limit = server->hasArg("limit") ? server->arg("limit").toInt() : REST_PAGE_SIZE_DEFAULT;
+        limit = max(1, min(limit, REST_PAGE_SIZE_MAX));
+
+        server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server->send(200, "application/json", "{\"users\":[");
+
+        firstUser = true;
+        lastID = 0;
+        visiting = this;
+        uint32_t count = UserManager::VisitUsers(after, limit, &sendUser);
+        visiting = NULL;
+
+        if (count == (uint32_t)limit)
+        {
+            char uid[15];
+            UserManager::FormatUid(lastID, uid);
+            snprintf(buffer, sizeof(buffer), "],\"next\":\"%s\"}", uid);
+        }
+        else
+        {
+            strcpy(buffer, "],\"next\":null}");
+        }
+        server->sendContent(buffer);
+        server->sendContent("");
+    }
+
+    static void sendUser(kUser *user)
+    {
+        RestApi *api = visiting;
+        char *buffer = api->buffer;
+        if (!api->firstUser)
+        {
+            *buffer++ = ',';
+        }
+        formatUser(user, buffer, sizeof(api->buffer) - 1);
+        api->server->sendContent(api->buffer);
+        api->firstUser = false;
+        api->lastID = user->ID.u64;
+    }
+
+    void handleStatus()
+    {
+        uint64_t now = Utils::GetMillis64();
+        PollScheduler *poller = doorOpener->GetPoller();
+        snprintf(buffer, sizeof(buffer),
+                 "{\"reader\":\"%s\",\"transport\":\"%s\",\"state\":\"%s\",\"doors\":[%s,%s],\"users\":%u,"
+                 "\"taps\":%u,\"tap_ms\":%u,\"poll_interval\":%u,\"duty_cycle\":%u,\"uptime\":%u,\"free_heap\":%u}",
+                 doorOpener->IsReaderReady() ? "ready" : "fault", readerTransport.GetName(),
+                 CARD_STATE_NAMES[doorOpener->GetCardState()],
+                 doorOpener->IsDoorOpen(0) ? "true" : "false", doorOpener->IsDoorOpen(1) ? "true" : "false",
+                 UserManager::GetUserCount(), doorOpener->GetTapCount(), doorOpener->GetAverageTapMillis(),
+                 poller->GetOffInterval(now), poller->GetDutyCycle(now), (uint32_t)(now / 1000), ESP.getFreeHeap());
+        server->send(200, "application/json", buffer);
+    }
+
+    void sendError(int code, const char *message)
+    {
+        snprintf(buffer, sizeof(buffer), "{\"error\":\"%s\"}", message);
+        server->send(code, "application/json", buffer);
+    }
+
+    // {"uid":"04A1B2C3D4E5F6","name":"Claudia","doors":1}
+    static void formatUser(kUser *user, char *json, int size)
+    {
+        char uid[15];
+        UserManager::FormatUid(user->ID.u64, uid);
+
+        // Escape the name, the random data behind the terminating zero is never sent
+        char name[2 * NAME_BUF_SIZE];
+        int pos = 0;
+        for (int i = 0; i < NAME_BUF_SIZE && user->s8_Name[i] != 0; i++)
+        {
+            char c = user->s8_Name[i];
+            if (c == '"' || c == '\\')
+            {
+                name[pos++] = '\\';
+            }
+            name[pos++] = (c >= 0 && c < ' ') ? ' ' : c;
+        }
+        name[pos] = 0;
+
+        snprintf(json, size, "{\"uid\":\"%s\",\"name\":\"%s\",\"doors\":%u}", uid, name, user->u8_Flags & DOOR_BOTH);
+    }
+};
+
+RestApi *RestApi::visiting = NULL;
+
+#endif // RESTAPI_H
@@ -0,0 +1,130 @@
+#ifndef SECRETCACHE_H
+#define SECRETCACHE_H
+
+#include "types.h"
+
+// Number of users whose DESFire secrets are kept in RAM (SECRET_CACHE_SIZE * 52 bytes)
+#define SECRET_CACHE_SIZE 16
+
+// Caches the secrets derived by DoorOpener::GenerateDesfireSecrets() for the users who were seen most recently.
+// The derivation needs two 3K3DES key setups and two CBC encryptions, but the result depends only on the
+// user record. So a regular user only pays for it after a reboot or after the record has been modified.
+// The owner must call Invalidate() whenever a user record changes or is deleted.
+// If the cache is full the least recently used entry is replaced.
+class SecretCache
+{
+public:
+    SecretCache()
+    {
+        mu32_Clock = 0;
+        mu32_Hits = 0;
+        mu32_Misses = 0;
+        Clear();
+    }
+
+    // returns true and copies the secrets if the user is in the cache
+    bool Find(uint64_t u64_ID, byte u8_AppMasterKey[24], byte u8_StoreValue[16])
+    {
+        kEntry *pk_Entry = FindEntry(u64_ID);
+        if (pk_Entry == NULL)
+        {
+            mu32_Misses++;
+            return false;
+        }
+
+        memcpy(u8_AppMasterKey, pk_Entry->u8_AppMasterKey, 24);
+        memcpy(u8_StoreValue, pk_Entry->u8_StoreValue, 16);
+        pk_Entry->u32_LastUse = ++mu32_Clock;
+        mu32_Hits++;
+        return true;
+    }
+
+    void Store(uint64_t u64_ID, const byte u8_AppMasterKey[24], const byte u8_StoreValue[16])
+    {
+        if (u64_ID == 0)
+            return;
+
+        kEntry *pk_Entry = FindEntry(u64_ID);
+        if (pk_Entry == NULL)
+        {
+            // Take a free entry or the least recently used one
+            pk_Entry = &mk_Entries[0];
+            for (int i = 1; i < SECRET_CACHE_SIZE && pk_Entry->u64_ID != 0; i++)
+            {
+                if (mk_Entries[i].u64_ID == 0 || mk_Entries[i].u32_LastUse < pk_Entry->u32_LastUse)
+                    pk_Entry = &mk_Entries[i];
+            }
+        }
+
+        pk_Entry->u64_ID = u64_ID;
+        memcpy(pk_Entry->u8_AppMasterKey, u8_AppMasterKey, 24);
+        memcpy(pk_Entry->u8_StoreValue, u8_StoreValue, 16);
+        pk_Entry->u32_LastUse = ++mu32_Clock;
+    }
+
+    // u64_ID = 0 invalidates all entries
+    void Invalidate(uint64_t u64_ID)
+    {
+        if (u64_ID == 0)
+        {
+            Clear();
+            return;
+        }
+
+        kEntry *pk_Entry = FindEntry(u64_ID);
+        if (pk_Entry)
+            memset(pk_Entry, 0, sizeof(kEntry)); // do not leave key material in RAM
+    }
+
+    void Clear()
+    {
+        memset(mk_Entries, 0, sizeof(mk_Entries));
+    }
+
+    // Statistics since startup
+    uint32_t GetHitCount()
+    {
+        return mu32_Hits;
+    }
+
+    uint32_t GetMissCount()
+    {
+        return mu32_Misses;
+    }
+
+    // The hit rate in percent
+    uint32_t GetHitRate()
+    {
+        uint32_t u32_Total = mu32_Hits + mu32_Misses;
+        return u32_Total ? (uint32_t)((uint64_t)mu32_Hits * 100 / u32_Total) : 0;
+    }
+
+private:
+    struct kEntry
+    {
+        uint64_t u64_ID; // 0 = free entry
+        byte u8_AppMasterKey[24];
+        byte u8_StoreValue[16];
+        uint32_t u32_LastUse;
+    };
+
+    kEntry mk_Entries[SECRET_CACHE_SIZE];
+    uint32_t mu32_Clock; // incremented with each access, used for the LRU replacement
+    uint32_t mu32_Hits;
+    uint32_t mu32_Misses;
+
+    kEntry *FindEntry(uint64_t u64_ID)
+    {
+        if (u64_ID == 0)
+            return NULL;
+
+        for (int i = 0; i < SECRET_CACHE_SIZE; i++)
+        {
+            if (mk_Entries[i].u64_ID == u64_ID)
+                return &mk_Entries[i];
+        }
+        return NULL;
+    }
+};
+
+#endif // SECRETCACHE_H
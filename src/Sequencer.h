@@ -0,0 +1,179 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include "types.h"
+
+enum eLED
+{
+    LED_OFF,
+    LED_RED,
+    LED_GREEN,
+};
+
+// The feedback patterns that are played by the Sequencer
+enum ePattern
+{
+    PATTERN_NONE,
+    PATTERN_INIT,         // the reader has been initialized
+    PATTERN_OK,           // the door is opened
+    PATTERN_ERROR,        // an unknown card has been presented
+    PATTERN_DENIED,       // the card is known, but it is not valid (not personalized, not a Desfire card, ...)
+    PATTERN_TIMEOUT,      // the card is too far away from the reader
+    PATTERN_READER_FAULT, // the PN532 does not respond and is reset
+    PATTERN_NO_CARD,      // no card in the RF field (short flash while polling)
+};
+
+// One step of a pattern: play a tone (0 = silence) and show the LED for u16_Duration milliseconds.
+// A step with u16_Duration = 0 ends the pattern.
+struct kSequenceStep
+{
+    uint16_t u16_Tone;
+    eLED e_LED;
+    uint16_t u16_Duration;
+};
+
+const kSequenceStep PATTERN_STEPS_INIT[] = {{3000, LED_GREEN, 200}, {0, LED_GREEN, 800}, {0, LED_OFF, 0}};
+const kSequenceStep PATTERN_STEPS_OK[] = {{2000, LED_OFF, 70}, {0, LED_OFF, 30}, {3000, LED_OFF, 150}, {0, LED_OFF, 0}};
+const kSequenceStep PATTERN_STEPS_ERROR[] = {{2000, LED_RED, 70}, {0, LED_RED, 30}, {1000, LED_RED, 200}, {0, LED_RED, 700}, {0, LED_OFF, 0}};
+const kSequenceStep PATTERN_STEPS_DENIED[] = {{0, LED_RED, 1000}, {0, LED_OFF, 0}};
+const kSequenceStep PATTERN_STEPS_TIMEOUT[] = {{0, LED_RED, 200}, {0, LED_OFF, 0}};
+const kSequenceStep PATTERN_STEPS_READER_FAULT[] = {{0, LED_RED, 2000}, {0, LED_OFF, 0}}; // a long interval to make the LED flash very slowly
+const kSequenceStep PATTERN_STEPS_NO_CARD[] = {{0, LED_GREEN, 20}, {0, LED_OFF, 0}};
+
+// Switches the buzzer (u16_Frequency = 0 -> off) and the LED
+typedef void (*ToneCallback)(uint16_t u16_Frequency);
+typedef void (*LedCallback)(eLED e_LED);
+
+// Plays the buzzer and LED patterns without blocking.
+// loop() must be called from the main loop with the current time. It only switches the outputs
+// when a step begins or ends, so the time in loop() is negligible.
+// The outputs are passed as callbacks, so the timeline can be recorded with a fake clock on the host.
+class Sequencer
+{
+public:
+    Sequencer()
+    {
+        mf_Tone = NULL;
+        mf_LED = NULL;
+        mpk_Step = NULL;
+        me_Queued = PATTERN_NONE;
+        mb_Started = false;
+        mu64_StepEnd = 0;
+        mu16_Tone = 0;
+        me_LED = LED_OFF;
+    }
+
+    void Begin(ToneCallback f_Tone, LedCallback f_LED)
+    {
+        mf_Tone = f_Tone;
+        mf_LED = f_LED;
+    }
+
+    // Starts a pattern. A pattern that is currently playing is aborted.
+    // The first step begins with the next call of loop().
+    void Play(ePattern e_Pattern)
+    {
+        me_Queued = PATTERN_NONE;
+        mpk_Step = GetSteps(e_Pattern);
+        mb_Started = false;
+    }
+
+    // Plays the pattern after the current one has ended
+    void Queue(ePattern e_Pattern)
+    {
+        if (IsBusy())
+            me_Queued = e_Pattern;
+        else
+            Play(e_Pattern);
+    }
+
+    // Aborts the current pattern and switches the buzzer and the LED off
+    void Stop()
+    {
+        me_Queued = PATTERN_NONE;
+        mpk_Step = NULL;
+        SetOutputs(0, LED_OFF);
+    }
+
+    bool IsBusy()
+    {
+        return mpk_Step != NULL;
+    }
+
+    void loop(uint64_t u64_Now)
+    {
+        while (mpk_Step != NULL)
+        {
+            if (mb_Started)
+            {
+                if (u64_Now < mu64_StepEnd)
+                    return;
+
+                // The next step starts when the previous one has ended, not when loop() is called,
+                // so a late call does not stretch the pattern.
+                u64_Now = max(u64_Now, mu64_StepEnd);
+                mpk_Step++;
+            }
+
+            if (mpk_Step->u16_Duration == 0)
+            {
+                SetOutputs(0, LED_OFF);
+                mpk_Step = GetSteps(me_Queued);
+                me_Queued = PATTERN_NONE;
+                mb_Started = false;
+                continue;
+            }
+
+            SetOutputs(mpk_Step->u16_Tone, mpk_Step->e_LED);
+            mu64_StepEnd = (mb_Started ? mu64_StepEnd : u64_Now) + mpk_Step->u16_Duration;
+            mb_Started = true;
+        }
+    }
+
+private:
+    ToneCallback mf_Tone;
+    LedCallback mf_LED;
+    const kSequenceStep *mpk_Step; // The current step, NULL = idle
+    ePattern me_Queued;            // The pattern to play after the current one
+    bool mb_Started;               // false if the current step has not been output yet
+    uint64_t mu64_StepEnd;         // The time when the current step ends
+    uint16_t mu16_Tone;            // The current outputs
+    eLED me_LED;
+
+    static const kSequenceStep *GetSteps(ePattern e_Pattern)
+    {
+        switch (e_Pattern)
+        {
+        case PATTERN_INIT:
+            return PATTERN_STEPS_INIT;
+        case PATTERN_OK:
+            return PATTERN_STEPS_OK;
+        case PATTERN_ERROR:
+            return PATTERN_STEPS_ERROR;
+        case PATTERN_DENIED:
+            return PATTERN_STEPS_DENIED;
+        case PATTERN_TIMEOUT:
+            return PATTERN_STEPS_TIMEOUT;
+        case PATTERN_READER_FAULT:
+            return PATTERN_STEPS_READER_FAULT;
+        case PATTERN_NO_CARD:
+            return PATTERN_STEPS_NO_CARD;
+        default:
+            return NULL;
+        }
+    }
+
+    // Only changes are passed to the callbacks
+    void SetOutputs(uint16_t u16_Tone, eLED e_LED)
+    {
+        if (u16_Tone != mu16_Tone && mf_Tone)
+            mf_Tone(u16_Tone);
+        if (e_LED != me_LED && mf_LED)
+            mf_LED(e_LED);
+
+        mu16_Tone = u16_Tone;
+        me_LED = e_LED;
+    }
+};
+
+#endif // SEQUENCER_H
@@ -0,0 +1,353 @@
+#ifndef UIDFILTER_H
+#define UIDFILTER_H
+
+#include "types.h"
+
+// Number of fingerprints per bucket
+#define FILTER_BUCKET_SIZE 4
+
+// Number of relocations before an insert gives up (the filter must then be rebuilt with more buckets)
+#define FILTER_MAX_KICKS 200
+
+// The width of a fingerprint. If 16 bit fingerprints do not fit into the memory limit, shorter ones are used.
+// Below FILTER_MIN_PRINT_BITS the filter would pass too many unknown cards to be worth its RAM.
+#define FILTER_MAX_PRINT_BITS 16
+#define FILTER_MIN_PRINT_BITS 4
+
+// A cuckoo filter over the card UIDs of all enrolled users.
+// It answers "definitely not enrolled" without any flash access and costs at most 2 bytes RAM per slot,
+// so it stays available even if there is not enough heap for the UID index.
+// Each UID is stored as a fingerprint of 4 to 16 bit in one of two buckets. Unlike a Bloom filter a cuckoo filter
+// supports removing entries, so it can be kept up to date when users are deleted.
+// "Maybe enrolled" is wrong with a probability of approx. 2 * FILTER_BUCKET_SIZE * load / (2^bits - 1)
+// (see GetFalsePositivePpm()).
+class UidFilter
+{
+public:
+    UidFilter()
+    {
+        mu8_Slots = NULL;
+        mu32_Bytes = 0;
+        mu32_Buckets = 0;
+        mu8_PrintBits = 0;
+        mu32_Count = 0;
+        mu16_Victim = 0;
+        mu32_VictimBucket = 0;
+        mu32_Random = 0x2545F491;
+        mu32_Lookups = 0;
+        mu32_Rejected = 0;
+        mu32_FalsePositives = 0;
+    }
+
+    ~UidFilter()
+    {
+        Free();
+    }
+
+    // Allocates enough buckets for u32_MaxEntries entries (load factor <= 0.9), but not more than u32_MaxBytes.
+    // If 16 bit fingerprints do not fit, the fingerprints are made as wide as the limit allows and the buckets use
+    // up the whole limit: the filter passes more unknown cards, but it is not disabled because of the limit.
+    // returns false if not even FILTER_MIN_PRINT_BITS fit or there is not enough heap. Then the filter stays disabled.
+    bool Init(uint32_t u32_MaxEntries, uint32_t u32_MaxBytes)
+    {
+        Free();
+
+        // A fingerprint is read from 3 bytes, the padding keeps the last one inside the allocation
+        if (u32_MaxBytes <= 2)
+            return false;
+        u32_MaxBytes -= 2;
+
+        uint32_t u32_Buckets = max(2u, (u32_MaxEntries * 10 / 9 + FILTER_BUCKET_SIZE - 1) / FILTER_BUCKET_SIZE);
+        uint32_t u32_Bits = min((uint32_t)FILTER_MAX_PRINT_BITS, u32_MaxBytes * 8 / (u32_Buckets * FILTER_BUCKET_SIZE));
+        if (u32_Bits < FILTER_MIN_PRINT_BITS)
+            return false;
+
+        if (u32_Bits < FILTER_MAX_PRINT_BITS)
+            u32_Buckets = u32_MaxBytes * 8 / u32_Bits / FILTER_BUCKET_SIZE;
+
+        mu32_Bytes = (u32_Buckets * FILTER_BUCKET_SIZE * u32_Bits + 7) / 8 + 2;
+        mu8_Slots = (byte *)malloc(mu32_Bytes);
+        if (mu8_Slots == NULL)
+            return false;
+
+        mu32_Buckets = u32_Buckets;
+        mu8_PrintBits = u32_Bits;
+        Clear();
+        return true;
+    }
+
+    void Free()
+    {
+        free(mu8_Slots);
+        mu8_Slots = NULL;
+        mu32_Buckets = 0;
+        mu8_PrintBits = 0;
+        mu32_Count = 0;
+        mu16_Victim = 0;
+    }
+
+    // true if Init() succeeded and the filter can be used for lookups
+    bool IsValid()
+    {
+        return mu8_Slots != NULL;
+    }
+
+    void Clear()
+    {
+        if (!IsValid())
+            return;
+
+        memset(mu8_Slots, 0, mu32_Bytes);
+        mu32_Count = 0;
+        mu16_Victim = 0;
+    }
+
+    // returns false if the filter is too full. The entry may then have replaced another one,
+    // so the filter must be rebuilt from the database with more buckets.
+    bool Insert(uint64_t u64_ID)
+    {
+        if (!IsValid() || mu16_Victim != 0)
+            return false;
+
+        uint16_t u16_Print;
+        uint32_t u32_Bucket1, u32_Bucket2;
+        Hash(u64_ID, &u16_Print, &u32_Bucket1, &u32_Bucket2);
+
+        if (PutIntoBucket(u32_Bucket1, u16_Print) || PutIntoBucket(u32_Bucket2, u16_Print))
+        {
+            mu32_Count++;
+            return true;
+        }
+
+        // Both buckets are full -> relocate random fingerprints to their alternate bucket
+        uint32_t u32_Bucket = (NextRandom() & 1) ? u32_Bucket1 : u32_Bucket2;
+        for (int k = 0; k < FILTER_MAX_KICKS; k++)
+        {
+            uint32_t u32_Slot = u32_Bucket * FILTER_BUCKET_SIZE + NextRandom() % FILTER_BUCKET_SIZE;
+            uint16_t u16_Kicked = GetSlot(u32_Slot);
+            SetSlot(u32_Slot, u16_Print);
+            u16_Print = u16_Kicked;
+
+            u32_Bucket = AltBucket(u32_Bucket, u16_Print);
+            if (PutIntoBucket(u32_Bucket, u16_Print))
+            {
+                mu32_Count++;
+                return true;
+            }
+        }
+
+        // The homeless fingerprint is kept aside, so no enrolled card is ever rejected
+        mu16_Victim = u16_Print;
+        mu32_VictimBucket = u32_Bucket;
+        mu32_Count++;
+        return false;
+    }
+
+    bool Remove(uint64_t u64_ID)
+    {
+        if (!IsValid())
+            return false;
+
+        uint16_t u16_Print;
+        uint32_t u32_Bucket1, u32_Bucket2;
+        Hash(u64_ID, &u16_Print, &u32_Bucket1, &u32_Bucket2);
+
+        if (mu16_Victim == u16_Print && (mu32_VictimBucket == u32_Bucket1 || mu32_VictimBucket == u32_Bucket2))
+        {
+            mu16_Victim = 0;
+            mu32_Count--;
+            return true;
+        }
+
+        if (!RemoveFromBucket(u32_Bucket1, u16_Print) && !RemoveFromBucket(u32_Bucket2, u16_Print))
+            return false;
+
+        mu32_Count--;
+        return true;
+    }
+
+    // returns false if the UID is definitely not enrolled.
+    // returns true if it may be enrolled (always true if the filter is disabled).
+    bool MayContain(uint64_t u64_ID)
+    {
+        if (!IsValid())
+            return true;
+
+        uint16_t u16_Print;
+        uint32_t u32_Bucket1, u32_Bucket2;
+        Hash(u64_ID, &u16_Print, &u32_Bucket1, &u32_Bucket2);
+
+        mu32_Lookups++;
+        if (BucketContains(u32_Bucket1, u16_Print) || BucketContains(u32_Bucket2, u16_Print) ||
+            (mu16_Victim == u16_Print && (mu32_VictimBucket == u32_Bucket1 || mu32_VictimBucket == u32_Bucket2)))
+            return true;
+
+        mu32_Rejected++;
+        return false;
+    }
+
+    // Must be called by the owner if MayContain() returned true but the UID was not found in the database
+    void CountFalsePositive()
+    {
+        mu32_FalsePositives++;
+    }
+
+    uint32_t GetCount()
+    {
+        return mu32_Count;
+    }
+
+    uint32_t GetSlotCount()
+    {
+        return mu32_Buckets * FILTER_BUCKET_SIZE;
+    }
+
+    // The width of the fingerprints in bits, 0 if the filter is disabled
+    uint32_t GetPrintBits()
+    {
+        return mu8_PrintBits;
+    }
+
+    // The RAM occupied by the filter in bytes
+    uint32_t GetMemoryUsage()
+    {
+        return IsValid() ? mu32_Bytes : 0;
+    }
+
+    // The expected false positive rate at the current load in parts per million.
+    // A lookup compares 2 buckets, each used slot matches a random fingerprint with a probability of 1/(2^bits - 1).
+    uint32_t GetFalsePositivePpm()
+    {
+        if (!IsValid())
+            return 0;
+
+        return (uint32_t)((uint64_t)mu32_Count * 2 * FILTER_BUCKET_SIZE * 1000000 / ((uint64_t)GetSlotCount() * GetPrintMask()));
+    }
+
+    // Statistics since startup
+    uint32_t GetLookupCount()
+    {
+        return mu32_Lookups;
+    }
+
+    uint32_t GetRejectedCount()
+    {
+        return mu32_Rejected;
+    }
+
+    uint32_t GetFalsePositiveCount()
+    {
+        return mu32_FalsePositives;
+    }
+
+private:
+    byte *mu8_Slots;             // The packed fingerprints, FILTER_BUCKET_SIZE per bucket, 0 = empty slot
+    uint32_t mu32_Bytes;         // The size of mu8_Slots
+    uint32_t mu32_Buckets;
+    byte mu8_PrintBits;          // The width of a fingerprint
+    uint32_t mu32_Count;         // Number of stored fingerprints (including the victim)
+    uint16_t mu16_Victim;        // A fingerprint that did not find a free slot, 0 = none
+    uint32_t mu32_VictimBucket;  // One of the two buckets of the victim
+    uint32_t mu32_Random;        // xorshift state for choosing the slot to relocate
+    uint32_t mu32_Lookups;
+    uint32_t mu32_Rejected;
+    uint32_t mu32_FalsePositives;
+
+    // The UID bits must be mixed (4 byte UIDs have the upper bytes zero), so the splitmix64 finalizer is used.
+    // The fingerprint and the primary bucket are taken from different bits of the result.
+    void Hash(uint64_t u64_ID, uint16_t *pu16_Print, uint32_t *pu32_Bucket1, uint32_t *pu32_Bucket2)
+    {
+        uint64_t u64_Hash = u64_ID;
+        u64_Hash = (u64_Hash ^ (u64_Hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+        u64_Hash = (u64_Hash ^ (u64_Hash >> 27)) * 0x94D049BB133111EBull;
+        u64_Hash ^= u64_Hash >> 31;
+
+        *pu16_Print = (uint16_t)(u64_Hash >> 48) & GetPrintMask();
+        if (*pu16_Print == 0)
+            *pu16_Print = 1;
+
+        *pu32_Bucket1 = (uint32_t)u64_Hash % mu32_Buckets;
+        *pu32_Bucket2 = AltBucket(*pu32_Bucket1, *pu16_Print);
+    }
+
+    // The alternate bucket depends only on the bucket and the fingerprint, so a fingerprint can be relocated
+    // without knowing the UID. Applying it twice returns the original bucket: (h - (h - b)) mod n = b.
+    // Unlike an XOR this works for any bucket count, so the filter can use up its memory limit.
+    uint32_t AltBucket(uint32_t u32_Bucket, uint16_t u16_Print)
+    {
+        uint32_t u32_Hash = (u16_Print * 0x5BD1E995u) % mu32_Buckets;
+        return (u32_Hash + mu32_Buckets - u32_Bucket) % mu32_Buckets;
+    }
+
+    uint16_t GetPrintMask()
+    {
+        return (1 << mu8_PrintBits) - 1;
+    }
+
+    // The fingerprints are packed without gaps, one spans at most 3 bytes
+    uint16_t GetSlot(uint32_t u32_Slot)
+    {
+        uint32_t u32_Bit = u32_Slot * mu8_PrintBits;
+        byte *pu8_Data = &mu8_Slots[u32_Bit / 8];
+        uint32_t u32_Data = pu8_Data[0] | (pu8_Data[1] << 8) | (pu8_Data[2] << 16);
+        return (u32_Data >> (u32_Bit % 8)) & GetPrintMask();
+    }
+
+    void SetSlot(uint32_t u32_Slot, uint16_t u16_Print)
+    {
+        uint32_t u32_Bit = u32_Slot * mu8_PrintBits;
+        byte *pu8_Data = &mu8_Slots[u32_Bit / 8];
+        uint32_t u32_Data = pu8_Data[0] | (pu8_Data[1] << 8) | (pu8_Data[2] << 16);
+        u32_Data &= ~((uint32_t)GetPrintMask() << (u32_Bit % 8));
+        u32_Data |= (uint32_t)u16_Print << (u32_Bit % 8);
+        pu8_Data[0] = u32_Data;
+        pu8_Data[1] = u32_Data >> 8;
+        pu8_Data[2] = u32_Data >> 16;
+    }
+
+    bool PutIntoBucket(uint32_t u32_Bucket, uint16_t u16_Print)
+    {
+        for (uint32_t i = u32_Bucket * FILTER_BUCKET_SIZE; i < (u32_Bucket + 1) * FILTER_BUCKET_SIZE; i++)
+        {
+            if (GetSlot(i) == 0)
+            {
+                SetSlot(i, u16_Print);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool RemoveFromBucket(uint32_t u32_Bucket, uint16_t u16_Print)
+    {
+        for (uint32_t i = u32_Bucket * FILTER_BUCKET_SIZE; i < (u32_Bucket + 1) * FILTER_BUCKET_SIZE; i++)
+        {
+            if (GetSlot(i) == u16_Print)
+            {
+                SetSlot(i, 0);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool BucketContains(uint32_t u32_Bucket, uint16_t u16_Print)
+    {
+        for (uint32_t i = u32_Bucket * FILTER_BUCKET_SIZE; i < (u32_Bucket + 1) * FILTER_BUCKET_SIZE; i++)
+        {
+            if (GetSlot(i) == u16_Print)
+                return true;
+        }
+        return false;
+    }
+
+    uint32_t NextRandom()
+    {
+        mu32_Random ^= mu32_Random << 13;
+        mu32_Random ^= mu32_Random >> 17;
+        mu32_Random ^= mu32_Random << 5;
+        return mu32_Random;
+    }
+};
+
+#endif // UIDFILTER_H
@@ -0,0 +1,231 @@
+#ifndef UIDINDEX_H
+#define UIDINDEX_H
+
+#include "types.h"
+
+// The RAM per slot: the UID and the page
+#define UIDINDEX_SLOT_SIZE (sizeof(uint64_t) + sizeof(uint16_t))
+
+// A compact open addressing hash table (linear probing) that maps a card UID to the page
+// of the user store that contains the user. It is built once at startup so that a card lookup does not have to
+// scan the storage file: an unknown card costs no flash access at all, a known card exactly one read.
+// UID 0 marks an empty slot. This is no restriction because UserManager never accepts UID 0.
+class UidIndex
+{
+public:
+    UidIndex()
+    {
+        mu64_Keys = NULL;
+        mu16_Pages = NULL;
+        mu32_Mask = 0;
+        mu32_Count = 0;
+    }
+
+    ~UidIndex()
+    {
+        Free();
+    }
+
+    // Allocates enough slots for u32_MaxEntries entries (load factor <= 0.75), but not more than u32_MaxBytes.
+    // returns false if the index would be larger or there is not enough heap. In this case the index stays disabled.
+    bool Init(uint32_t u32_MaxEntries, uint32_t u32_MaxBytes)
+    {
+        Free();
+
+        uint32_t u32_Slots = 8;
+        while (u32_Slots < u32_MaxEntries + u32_MaxEntries / 3 + 1)
+        {
+            u32_Slots <<= 1;
+        }
+
+        if (u32_Slots * UIDINDEX_SLOT_SIZE > u32_MaxBytes)
+            return false;
+
+        mu64_Keys = (uint64_t *)malloc(u32_Slots * sizeof(uint64_t));
+        mu16_Pages = (uint16_t *)malloc(u32_Slots * sizeof(uint16_t));
+        if (mu64_Keys == NULL || mu16_Pages == NULL)
+        {
+            Free();
+            return false;
+        }
+
+        mu32_Mask = u32_Slots - 1;
+        Clear();
+        return true;
+    }
+
+    void Free()
+    {
+        free(mu64_Keys);
+        free(mu16_Pages);
+        mu64_Keys = NULL;
+        mu16_Pages = NULL;
+        mu32_Mask = 0;
+        mu32_Count = 0;
+    }
+
+    // true if Init() succeeded and the index can be used for lookups
+    bool IsValid()
+    {
+        return mu64_Keys != NULL;
+    }
+
+    void Clear()
+    {
+        if (!IsValid())
+            return;
+
+        memset(mu64_Keys, 0, GetSlotCount() * sizeof(uint64_t));
+        mu32_Count = 0;
+    }
+
+    // Doubles the number of slots. The user store grows, the index must grow with it.
+    // The old table is freed only after the new one has been filled, so u32_MaxBytes limits the new table.
+    // returns false if the new table would be larger or there is not enough heap. In this case the old table is kept.
+    bool Grow(uint32_t u32_MaxBytes)
+    {
+        if (!IsValid() || 2 * GetMemoryUsage() > u32_MaxBytes)
+            return false;
+
+        uint64_t *pu64_OldKeys = mu64_Keys;
+        uint16_t *pu16_OldPages = mu16_Pages;
+        uint32_t u32_OldSlots = GetSlotCount();
+
+        mu64_Keys = (uint64_t *)malloc(2 * u32_OldSlots * sizeof(uint64_t));
+        mu16_Pages = (uint16_t *)malloc(2 * u32_OldSlots * sizeof(uint16_t));
+        if (mu64_Keys == NULL || mu16_Pages == NULL)
+        {
+            free(mu64_Keys);
+            free(mu16_Pages);
+            mu64_Keys = pu64_OldKeys;
+            mu16_Pages = pu16_OldPages;
+            return false;
+        }
+
+        mu32_Mask = 2 * u32_OldSlots - 1;
+        Clear();
+        for (uint32_t i = 0; i < u32_OldSlots; i++)
+        {
+            if (pu64_OldKeys[i] != 0)
+                Insert(pu64_OldKeys[i], pu16_OldPages[i]);
+        }
+
+        free(pu64_OldKeys);
+        free(pu16_OldPages);
+        return true;
+    }
+
+    // Adds a new entry or updates the page of an existing one.
+    // returns false if the load factor would exceed 0.75 (call Grow()).
+    bool Insert(uint64_t u64_ID, uint32_t u32_Page)
+    {
+        if (!IsValid() || u64_ID == 0)
+            return false;
+
+        uint32_t u32_Slot = Hash(u64_ID);
+        while (mu64_Keys[u32_Slot] != 0)
+        {
+            if (mu64_Keys[u32_Slot] == u64_ID)
+            {
+                mu16_Pages[u32_Slot] = u32_Page;
+                return true;
+            }
+            u32_Slot = (u32_Slot + 1) & mu32_Mask;
+        }
+
+        // Long probe sequences would make the lookup slow (and an empty slot is required to terminate Find())
+        if (mu32_Count + 1 > GetSlotCount() / 4 * 3)
+            return false;
+
+        mu64_Keys[u32_Slot] = u64_ID;
+        mu16_Pages[u32_Slot] = u32_Page;
+        mu32_Count++;
+        return true;
+    }
+
+    bool Find(uint64_t u64_ID, uint32_t *pu32_Page)
+    {
+        if (!IsValid() || u64_ID == 0)
+            return false;
+
+        uint32_t u32_Slot = Hash(u64_ID);
+        while (mu64_Keys[u32_Slot] != 0)
+        {
+            if (mu64_Keys[u32_Slot] == u64_ID)
+            {
+                *pu32_Page = mu16_Pages[u32_Slot];
+                return true;
+            }
+            u32_Slot = (u32_Slot + 1) & mu32_Mask;
+        }
+        return false;
+    }
+
+    // Removes an entry using backward shift deletion, so no tombstones are required
+    // and the probe sequences stay as short as after a fresh build.
+    bool Remove(uint64_t u64_ID)
+    {
+        if (!IsValid() || u64_ID == 0)
+            return false;
+
+        uint32_t u32_Slot = Hash(u64_ID);
+        while (mu64_Keys[u32_Slot] != u64_ID)
+        {
+            if (mu64_Keys[u32_Slot] == 0)
+                return false;
+            u32_Slot = (u32_Slot + 1) & mu32_Mask;
+        }
+
+        uint32_t u32_Next = u32_Slot;
+        while (true)
+        {
+            u32_Next = (u32_Next + 1) & mu32_Mask;
+            if (mu64_Keys[u32_Next] == 0)
+                break;
+
+            // An entry may only be moved into the gap if the gap lies between its home slot and its current slot.
+            uint32_t u32_Home = Hash(mu64_Keys[u32_Next]);
+            if (((u32_Next - u32_Home) & mu32_Mask) >= ((u32_Next - u32_Slot) & mu32_Mask))
+            {
+                mu64_Keys[u32_Slot] = mu64_Keys[u32_Next];
+                mu16_Pages[u32_Slot] = mu16_Pages[u32_Next];
+                u32_Slot = u32_Next;
+            }
+        }
+
+        mu64_Keys[u32_Slot] = 0;
+        mu32_Count--;
+        return true;
+    }
+
+    uint32_t GetCount()
+    {
+        return mu32_Count;
+    }
+
+    uint32_t GetSlotCount()
+    {
+        return IsValid() ? mu32_Mask + 1 : 0;
+    }
+
+    // The RAM occupied by the index in bytes
+    uint32_t GetMemoryUsage()
+    {
+        return GetSlotCount() * UIDINDEX_SLOT_SIZE;
+    }
+
+private:
+    uint64_t *mu64_Keys;  // The card UIDs, 0 = empty slot
+    uint16_t *mu16_Pages; // The leaf page in the user store for each slot
+    uint32_t mu32_Mask;   // Slot count - 1 (the slot count is always a power of 2)
+    uint32_t mu32_Count;  // Number of used slots
+
+    // The lower bytes of a 4 byte UID are always set and the upper ones are zero,
+    // so the bits must be mixed before they can be used as slot number (Fibonacci hashing).
+    uint32_t Hash(uint64_t u64_ID)
+    {
+        return (uint32_t)((u64_ID * 0x9E3779B97F4A7C15ull) >> 32) & mu32_Mask;
+    }
+};
+
+#endif // UIDINDEX_H
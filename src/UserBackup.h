@@ -0,0 +1,360 @@
+#ifndef USERBACKUP_H
+#define USERBACKUP_H
+
+#include "UserManager.h"
+
+// The backup format (little endian, packed):
+//   kBackupHeader, u32_Count * kBackupRecord in ascending UID order, uint32_t checksum (FNV-1a of the records)
+// The name buffer is copied including the random data behind the name, because the application key of a
+// personalized Desfire card is derived from it (see DoorOpener::GenerateDesfireSecrets()).
+#define BACKUP_MAGIC 0x31424744 // "DGB1"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+// The export is sent in pieces of this size, one per main loop iteration (see handleExport() in main.cpp)
+#define EXPORT_CHUNK_SIZE 512
+
+struct __attribute__((packed)) kBackupHeader
+{
+    uint32_t u32_Magic;
+    uint32_t u32_Count;
+};
+
+struct __attribute__((packed)) kBackupRecord
+{
+    uint64_t u64_ID;
+    byte u8_Flags;
+    char s8_Name[NAME_BUF_SIZE];
+};
+
+// Streams the user store into a backup. Read() fills a fixed buffer with as many complete items as fit,
+// so the whole database is never held in RAM and the backup can be sent in pieces from the main loop.
+// If the user store is modified before Read() returns 0, the rest of the backup would not match the part that has
+// already been sent: Read() stops and IsOutdated() returns true.
+class UserExport
+{
+public:
+    void Begin()
+    {
+        mu8_Step = STEP_HEADER;
+        mu16_Leaf = userStore.GetFirstLeaf();
+        mu8_Entry = 0;
+        mu32_Checksum = FNV_OFFSET;
+        mu32_Commits = dbJournal.GetCommitCount();
+        mb_LeafValid = userStore.ReadLeaf(mu16_Leaf, &mk_Leaf);
+    }
+
+    // Returns the number of bytes written to pu8_Buffer (at least sizeof(kBackupRecord) bytes), 0 at the end
+    uint32_t Read(byte *pu8_Buffer, uint32_t u32_Size)
+    {
+        if (IsOutdated())
+            return 0;
+
+        uint32_t u32_Pos = 0;
+        if (mu8_Step == STEP_HEADER)
+        {
+            kBackupHeader k_Header;
+            k_Header.u32_Magic = BACKUP_MAGIC;
+            k_Header.u32_Count = userStore.GetUserCount();
+            memcpy(pu8_Buffer, &k_Header, sizeof(k_Header));
+            u32_Pos = sizeof(k_Header);
+            mu8_Step = STEP_RECORDS;
+        }
+
+        while (mu8_Step == STEP_RECORDS && u32_Pos + sizeof(kBackupRecord) <= u32_Size)
+        {
+            if (!NextRecord((kBackupRecord *)(pu8_Buffer + u32_Pos)))
+            {
+                mu8_Step = STEP_CHECKSUM;
+                break;
+            }
+
+            mu32_Checksum = Checksum(mu32_Checksum, pu8_Buffer + u32_Pos, sizeof(kBackupRecord));
+            u32_Pos += sizeof(kBackupRecord);
+        }
+
+        if (mu8_Step == STEP_CHECKSUM && u32_Pos + sizeof(uint32_t) <= u32_Size)
+        {
+            memcpy(pu8_Buffer + u32_Pos, &mu32_Checksum, sizeof(uint32_t));
+            u32_Pos += sizeof(uint32_t);
+            mu8_Step = STEP_DONE;
+        }
+        return u32_Pos;
+    }
+
+    // true if the user store has been modified since Begin()
+    bool IsOutdated()
+    {
+        return dbJournal.GetCommitCount() != mu32_Commits;
+    }
+
+    static uint32_t Checksum(uint32_t u32_Hash, const byte *pu8_Data, uint32_t u32_Length)
+    {
+        for (uint32_t i = 0; i < u32_Length; i++)
+        {
+            u32_Hash = (u32_Hash ^ pu8_Data[i]) * FNV_PRIME;
+        }
+        return u32_Hash;
+    }
+
+private:
+    enum eStep
+    {
+        STEP_HEADER,
+        STEP_RECORDS,
+        STEP_CHECKSUM,
+        STEP_DONE,
+    };
+
+    byte mu8_Step;
+    uint16_t mu16_Leaf;
+    byte mu8_Entry;
+    bool mb_LeafValid;
+    uint32_t mu32_Checksum;
+    uint32_t mu32_Commits; // dbJournal.GetCommitCount() at Begin()
+    kLeafPage mk_Leaf;
+
+    // Walks through the leaves in UID order
+    bool NextRecord(kBackupRecord *pk_Record)
+    {
+        kUserCold k_Cold;
+        while (mb_LeafValid)
+        {
+            if (mu8_Entry >= mk_Leaf.u8_Count)
+            {
+                mu16_Leaf = mk_Leaf.u16_Next;
+                mu8_Entry = 0;
+                mb_LeafValid = mu16_Leaf != 0 && userStore.ReadLeaf(mu16_Leaf, &mk_Leaf);
+                continue;
+            }
+
+            kUserHot *pk_Hot = &mk_Leaf.k_Entries[mu8_Entry++];
+            if (!userStore.ReadCold(pk_Hot->u16_ColdKey, &k_Cold))
+                continue;
+
+            pk_Record->u64_ID = pk_Hot->u64_ID;
+            pk_Record->u8_Flags = pk_Hot->u8_Flags;
+            memcpy(pk_Record->s8_Name, k_Cold.s8_Name, NAME_BUF_SIZE);
+            return true;
+        }
+        return false;
+    }
+};
+
+// Builds a new user store from a backup that arrives in chunks of any size.
+// The data is validated while it is written into DB_IMPORT_FILE. The active database is only replaced by End()
+// after the complete backup has been validated, so a broken upload leaves the users unchanged.
+class UserImport
+{
+public:
+    bool Begin()
+    {
+        ms8_Error = NULL;
+        mi_File = SPIFFS.open(DB_IMPORT_FILE, "w+");
+        if (!mi_File)
+            return Fail("cannot create file");
+
+        // The import file is not in use until it is complete, so it needs no journal
+        mi_Journal.Open(&mi_File, NULL);
+        mi_Store.Open(&mi_Journal);
+        mi_Store.Create();
+        mi_Journal.BeginTransaction();
+
+        mu8_Step = STEP_HEADER;
+        mu32_Fill = 0;
+        mu32_Count = 0;
+        mu32_Records = 0;
+        mu64_LastID = 0;
+        mu32_Checksum = FNV_OFFSET;
+        return true;
+    }
+
+    // Returns false if the data is invalid, then the import must be aborted
+    bool Write(const byte *pu8_Data, uint32_t u32_Length)
+    {
+        while (u32_Length > 0 && ms8_Error == NULL)
+        {
+            if (mu8_Step == STEP_DONE)
+                return Fail("data after the checksum");
+
+            uint32_t u32_Need = GetItemSize() - mu32_Fill;
+            uint32_t u32_Chunk = min(u32_Need, u32_Length);
+            memcpy(mu8_Item + mu32_Fill, pu8_Data, u32_Chunk);
+            mu32_Fill += u32_Chunk;
+            pu8_Data += u32_Chunk;
+            u32_Length -= u32_Chunk;
+
+            if (mu32_Fill == GetItemSize())
+            {
+                mu32_Fill = 0;
+                ProcessItem();
+            }
+        }
+        return ms8_Error == NULL;
+    }
+
+    // Validates the end of the backup and replaces the user database
+    bool End()
+    {
+        if (ms8_Error != NULL)
+            return false;
+
+        if (mu8_Step != STEP_DONE)
+            return Fail("incomplete data");
+
+        bool b_Written = mi_Journal.CommitTransaction();
+        mi_File.close();
+        if (!b_Written)
+            return Fail("file system full");
+
+        // From now on the import is completed even if the power fails
+        if (!SPIFFS.rename(DB_IMPORT_FILE, DB_IMPORT_READY))
+            return Fail("file system full");
+
+        UserManager::InstallImport();
+        return true;
+    }
+
+    void Abort()
+    {
+        if (mi_File)
+            mi_File.close();
+
+        SPIFFS.remove(DB_IMPORT_FILE);
+    }
+
+    uint32_t GetRecordCount()
+    {
+        return mu32_Records;
+    }
+
+    const char *GetError()
+    {
+        return ms8_Error ? ms8_Error : "";
+    }
+
+private:
+    enum eStep
+    {
+        STEP_HEADER,
+        STEP_RECORDS,
+        STEP_CHECKSUM,
+        STEP_DONE,
+    };
+
+    File mi_File;
+    JournaledFile mi_Journal;
+    UserStore mi_Store;
+    byte mu8_Step;
+    byte mu8_Item[sizeof(kBackupRecord)]; // The item that is currently received
+    uint32_t mu32_Fill;                   // Bytes of mu8_Item received so far
+    uint32_t mu32_Count;                  // The number of records announced in the header
+    uint32_t mu32_Records;
+    uint64_t mu64_LastID;
+    uint32_t mu32_Checksum;
+    const char *ms8_Error;
+
+    uint32_t GetItemSize()
+    {
+        switch (mu8_Step)
+        {
+        case STEP_HEADER:
+            return sizeof(kBackupHeader);
+        case STEP_RECORDS:
+            return sizeof(kBackupRecord);
+        default:
+            return sizeof(uint32_t);
+        }
+    }
+
+    void ProcessItem()
+    {
+        switch (mu8_Step)
+        {
+        case STEP_HEADER:
+        {
+            kBackupHeader *pk_Header = (kBackupHeader *)mu8_Item;
+            if (pk_Header->u32_Magic != BACKUP_MAGIC)
+            {
+                Fail("not a user backup");
+                return;
+            }
+            if (pk_Header->u32_Count > MAX_USERS)
+            {
+                Fail("too many users");
+                return;
+            }
+
+            mu32_Count = pk_Header->u32_Count;
+            mu8_Step = mu32_Count ? STEP_RECORDS : STEP_CHECKSUM;
+            return;
+        }
+        case STEP_RECORDS:
+        {
+            kBackupRecord *pk_Record = (kBackupRecord *)mu8_Item;
+            mu32_Checksum = UserExport::Checksum(mu32_Checksum, mu8_Item, sizeof(kBackupRecord));
+
+            // Ascending UIDs also exclude duplicates
+            if (pk_Record->u64_ID <= mu64_LastID || pk_Record->u8_Flags > DOOR_BOTH ||
+                pk_Record->s8_Name[0] == 0 || memchr(pk_Record->s8_Name, 0, NAME_BUF_SIZE) == NULL)
+            {
+                Fail("invalid record");
+                return;
+            }
+
+            kUserHot k_Hot;
+            k_Hot.u64_ID = pk_Record->u64_ID;
+            k_Hot.u8_Flags = pk_Record->u8_Flags;
+            k_Hot.u16_ColdKey = mi_Store.AllocCold();
+
+            kUserCold k_Cold;
+            k_Cold.u64_ID = pk_Record->u64_ID;
+            memcpy(k_Cold.s8_Name, pk_Record->s8_Name, NAME_BUF_SIZE);
+            if (k_Hot.u16_ColdKey == 0)
+            {
+                Fail("file system full");
+                return;
+            }
+            mi_Store.WriteCold(k_Hot.u16_ColdKey, &k_Cold);
+            if (!mi_Store.Insert(&k_Hot, &OnLeafChanged))
+            {
+                Fail("file system full");
+                return;
+            }
+
+            mu64_LastID = pk_Record->u64_ID;
+            if (++mu32_Records == mu32_Count)
+                mu8_Step = STEP_CHECKSUM;
+            return;
+        }
+        case STEP_CHECKSUM:
+        {
+            uint32_t u32_Checksum;
+            memcpy(&u32_Checksum, mu8_Item, sizeof(uint32_t));
+            if (u32_Checksum != mu32_Checksum)
+            {
+                Fail("checksum mismatch");
+                return;
+            }
+
+            mu8_Step = STEP_DONE;
+            return;
+        }
+        }
+    }
+
+    // The indexes are built when the new store is installed
+    static void OnLeafChanged(uint64_t u64_ID, uint16_t u16_Leaf)
+    {
+    }
+
+    bool Fail(const char *s8_Error)
+    {
+        if (ms8_Error == NULL)
+            ms8_Error = s8_Error;
+        return false;
+    }
+};
+
+#endif // USERBACKUP_H
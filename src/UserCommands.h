@@ -0,0 +1,222 @@
+#ifndef USERCOMMANDS_H
+#define USERCOMMANDS_H
+
+#include "UserManager.h"
+
+// The maximum number of failed lines that are listed in the result
+#define USER_COMMANDS_MAX_ERRORS 8
+
+// Executes a batch of user commands received over MQTT. The batch is plain text with one command per line:
+//
+//   ID <token>                   optional first line, the token is copied into the result
+//   SET <uid> <doors> [<name>]   sets the doors of the user with this UID.
+//                                An unknown UID is stored as a new user, this requires the name.
+//                                <doors> = 0, 1, 2, 3 or NONE, DOOR1, DOOR2, DOOR12
+//   DEL <uid>                    deletes the user with this UID
+//   DELNAME <name>               deletes the user with this name
+//   CLEAR                        deletes all users
+//
+// <uid> is the card UID in hex as shown by LIST, 4 or 7 bytes without spaces (e.g. 04A1B2C3D4E5F6).
+// A new user stored by SET gets a name with random data like one added by ADD, but the card is not personalized.
+// This is sufficient for random ID cards that already have the PICC master key (these are authenticated
+// with the master key), a default Desfire card must be enrolled with ADD at the reader.
+//
+// All commands are executed in one UserManager batch, so the flash is written once instead of per user and a power
+// failure leaves either all or none of the changes. A failing line does not stop the batch.
+// The result is a JSON object like {"id":"42","ok":120,"failed":1,"users":377,"errors":[{"line":17,"error":"not found"}]}
+// A batch that modifies more pages than the journal can hold (JOURNAL_MAX_PAGES, about 180 new users in a database
+// of 8000 users) is rejected as a whole and nothing is changed: {"id":"42","error":"batch too large","line":143,"users":377}
+// "line" is the line where the batch has stopped. Split such a batch into smaller ones.
+class UserCommands
+{
+public:
+    // Executes the commands in s8_Commands (modified in place, u32_Length bytes, no terminating zero required)
+    // and writes the result into s8_Result.
+    static void Execute(char *s8_Commands, uint32_t u32_Length, char *s8_Result, int s32_ResultSize)
+    {
+        const char *s8_Token = "";
+        uint32_t u32_Ok = 0;
+        uint32_t u32_Failed = 0;
+        uint32_t u32_Line = 0;
+        char s8_Errors[USER_COMMANDS_MAX_ERRORS * 48] = "";
+        int s32_ErrorPos = 0;
+        const char *s8_BatchError = NULL; // The batch has been rejected as a whole
+
+        UserManager::BeginBatch();
+
+        char *s8_End = s8_Commands + u32_Length;
+        char *s8_Line = s8_Commands;
+        while (s8_Line < s8_End)
+        {
+            // Split off the next line
+            char *s8_Next = s8_Line;
+            while (s8_Next < s8_End && *s8_Next != '\n' && *s8_Next != '\r')
+            {
+                s8_Next++;
+            }
+            char *s8_Command = SkipSpaces(s8_Line);
+            s8_Line = s8_Next + 1;
+            if (s8_Next < s8_End && *s8_Next == '\r' && s8_Line < s8_End && *s8_Line == '\n')
+                s8_Line++;
+            *s8_Next = 0; // the MQTT library reserves a byte behind the payload for the terminating zero
+            u32_Line++;
+
+            if (*s8_Command == 0)
+                continue;
+
+            if (u32_Line == 1 && Utils::strnicmp(s8_Command, "ID ", 3) == 0)
+            {
+                s8_Token = SkipSpaces(s8_Command + 3);
+                continue;
+            }
+
+            if (UserManager::IsBatchFull())
+            {
+                s8_BatchError = "batch too large";
+                break;
+            }
+
+            const char *s8_Error = ExecuteLine(s8_Command);
+            if (s8_Error == NULL)
+            {
+                u32_Ok++;
+                continue;
+            }
+
+            u32_Failed++;
+            if (u32_Failed <= USER_COMMANDS_MAX_ERRORS)
+            {
+                s32_ErrorPos += sprintf(s8_Errors + s32_ErrorPos, "%s{\"line\":%u,\"error\":\"%s\"}",
+                                        s32_ErrorPos ? "," : "", u32_Line, s8_Error);
+            }
+        }
+
+        if (s8_BatchError != NULL)
+            UserManager::AbortBatch();
+        else if (!UserManager::CommitBatch())
+            s8_BatchError = "write failed";
+
+        if (s8_BatchError != NULL)
+        {
+            Utils::Print("Rejected user commands from MQTT: ");
+            Utils::Print(s8_BatchError, LF);
+            snprintf(s8_Result, s32_ResultSize, "{\"id\":\"%.32s\",\"error\":\"%s\",\"line\":%u,\"users\":%u}",
+                     s8_Token, s8_BatchError, u32_Line, UserManager::GetUserCount());
+            return;
+        }
+
+        Utils::Print("Executed user commands from MQTT: ");
+        Utils::PrintDec(u32_Ok);
+        Utils::Print(" ok, ");
+        Utils::PrintDec(u32_Failed);
+        Utils::Print(" failed\r\n");
+
+        snprintf(s8_Result, s32_ResultSize, "{\"id\":\"%.32s\",\"ok\":%u,\"failed\":%u,\"users\":%u,\"errors\":[%s]}",
+                 s8_Token, u32_Ok, u32_Failed, UserManager::GetUserCount(), s8_Errors);
+    }
+
+private:
+    // Returns NULL on success or the error message
+    static const char *ExecuteLine(char *s8_Command)
+    {
+        if (Utils::stricmp(s8_Command, "CLEAR") == 0)
+        {
+            UserManager::DeleteAllUsers();
+            return NULL;
+        }
+
+        if (Utils::strnicmp(s8_Command, "DELNAME ", 8) == 0)
+        {
+            char *s8_Name = SkipSpaces(s8_Command + 8);
+            return UserManager::DeleteUser(s8_Name) ? NULL : "not found";
+        }
+
+        if (Utils::strnicmp(s8_Command, "DEL ", 4) == 0)
+        {
+            kUser k_User;
+            char *s8_Rest;
+            if (!ParseUid(s8_Command + 4, &k_User, &s8_Rest))
+                return "invalid uid";
+
+            return UserManager::DeleteUser(k_User.ID.u64) ? NULL : "not found";
+        }
+
+        if (Utils::strnicmp(s8_Command, "SET ", 4) == 0)
+        {
+            kUser k_User;
+            char *s8_Rest;
+            if (!ParseUid(s8_Command + 4, &k_User, &s8_Rest))
+                return "invalid uid";
+
+            if (!ParseDoors(&s8_Rest, &k_User.u8_Flags))
+                return "invalid doors";
+
+            kUserHot k_Hot;
+            if (UserManager::FindHot(k_User.ID.u64, &k_Hot))
+                return UserManager::SetUserFlags(k_User.ID.u64, k_User.u8_Flags) ? NULL : "write failed";
+
+            char *s8_Name = SkipSpaces(s8_Rest);
+            if (*s8_Name == 0)
+                return "name required";
+            if (strlen(s8_Name) >= NAME_BUF_SIZE)
+                return "name too long";
+
+            kUser k_Found;
+            if (UserManager::FindUser(s8_Name, &k_Found))
+                return "name exists";
+
+            // Random data behind the name as in DoorOpener::AddCard()
+            Utils::GenerateRandom((byte *)k_User.s8_Name, NAME_BUF_SIZE);
+            strcpy(k_User.s8_Name, s8_Name);
+            return UserManager::InsertUser(&k_User) ? NULL : "store full";
+        }
+
+        return "unknown command";
+    }
+
+    static bool ParseUid(char *s8_Text, kUser *pk_User, char **ps8_Rest)
+    {
+        const char *s8_Rest;
+        if (!UserManager::ParseUid(s8_Text, &pk_User->ID.u64, &s8_Rest) || (*s8_Rest != 0 && *s8_Rest != ' '))
+            return false;
+
+        *ps8_Rest = (char *)s8_Rest;
+        return true;
+    }
+
+    static bool ParseDoors(char **ps8_Text, byte *pu8_Flags)
+    {
+        static const char *s8_Names[] = {"NONE", "DOOR1", "DOOR2", "DOOR12"};
+
+        char *s8_Word = SkipSpaces(*ps8_Text);
+        char *s8_End = s8_Word;
+        while (*s8_End != 0 && *s8_End != ' ')
+        {
+            s8_End++;
+        }
+
+        int s32_Len = s8_End - s8_Word;
+        for (byte i = 0; i <= DOOR_BOTH; i++)
+        {
+            if ((s32_Len == 1 && *s8_Word == '0' + i) ||
+                (s32_Len == (int)strlen(s8_Names[i]) && Utils::strnicmp(s8_Word, s8_Names[i], s32_Len) == 0))
+            {
+                *pu8_Flags = i;
+                *ps8_Text = s8_End;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static char *SkipSpaces(char *s8_Text)
+    {
+        while (*s8_Text == ' ' || *s8_Text == '\t')
+        {
+            s8_Text++;
+        }
+        return s8_Text;
+    }
+};
+
+#endif // USERCOMMANDS_H
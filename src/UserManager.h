@@ -3,12 +3,52 @@
 
 #include "FS.h"
 #include "EDB.h"
+#include "JournaledFile.h"
+#include "UserStore.h"
+#include "UidFilter.h"
+#include "UidIndex.h"
+#include "NameIndex.h"
 #include "debug.h"
 
 #define DB_FILE "/users.db"
-#define DB_TABLE_SIZE 8192
-#define MAX_USERS 32
-#define NAME_BUF_SIZE 64
+#define DB_JOURNAL_FILE "/users.jnl"
+
+// An imported database is written to DB_IMPORT_FILE (see UserImport). When it is complete it is renamed to
+// DB_IMPORT_READY and then replaces DB_FILE. A ready import is also installed at the next boot.
+#define DB_IMPORT_FILE "/users.imp"
+#define DB_IMPORT_READY "/users.rdy"
+
+// The user store grows page by page (see UserStore.h), the only limit is the size of the file system.
+// With 1 MB SPIFFS approx. 10000 users can be stored.
+#define MAX_USERS 10000
+
+// The RAM indexes are allocated with this many free entries and grow when they are full.
+// If an index would exceed its size limit it is disabled and the lookups go through the B+tree.
+#define DB_INDEX_RESERVE 32
+
+// The RAM indexes never take the largest free heap block below this size.
+// WiFi, the web server and MQTT need it, an exhausted heap would crash the firmware instead of slowing it down.
+// While an index grows the old and the new table exist at the same time, the floor is checked before each step.
+#define DB_HEAP_FLOOR 20480
+
+// The maximum size of each RAM index.
+// The UID filter (2 byte per user) keeps 16 bit fingerprints up to approx. 3600 users. Above that the fingerprints get
+// shorter (8 bit up to approx. 7300 users, 5 bit at 10000 users), so more unknown cards are looked up in the flash.
+// The UID index (10 byte per slot) stays enabled up to 768 users, above that a card lookup reads height + 1 pages.
+// The name index (8 byte per user) stays enabled up to 512 users, above that a name lookup scans the user store.
+#define DB_FILTER_MAX_BYTES 8192
+#define DB_UID_INDEX_MAX_BYTES 10240
+#define DB_NAME_INDEX_MAX_BYTES 4096
+
+// Older firmware versions stored the users in EDB tables.
+// Such a file is renamed to DB_LEGACY_FILE and migrated when the database is opened.
+// Version 1: kUser records in a single EDB table at offset 0.
+// Version 2: a 16 byte header with DB_V2_MAGIC, followed by a hot EDB table (kUserHot, the cold key is the
+//            record number in the cold table) and a cold EDB table (kUserCold).
+#define DB_LEGACY_FILE "/users.v1"
+#define DB_V2_MAGIC 0x32554744 // "DGU2"
+#define DB_V2_HOT_OFFSET 16
+#define DB_V2_COLD_OFFSET (DB_V2_HOT_OFFSET + 2048)
 
 enum eUserFlags
 {
@@ -18,7 +58,8 @@ enum eUserFlags
     DOOR_BOTH = DOOR_ONE | DOOR_TWO,
 };
 
-// This structure is stored for each user
+// This structure is used by the application for each user.
+// It is also the record layout of a version 1 database.
 struct kUser
 {
     // Constructor
@@ -41,20 +82,38 @@ struct kUser
 };
 
 // Database stuff
+// All file access goes through the journal, which collects the writes of a transaction
+// and commits them with one flush (see UserManager::BeginBatch()).
 File dbFile;
-void DBWriter(unsigned long address, const byte *data, unsigned int recsize)
+JournaledFile dbJournal;
+UserStore userStore;
+
+// The legacy database is only read during the migration
+File legacyFile;
+void LegacyDBWriter(unsigned long address, const byte *data, unsigned int recsize)
 {
-    dbFile.seek(address, SeekSet);
-    dbFile.write(data, recsize);
-    dbFile.flush();
 }
 
-void DBReader(unsigned long address, byte *data, unsigned int recsize)
+void LegacyDBReader(unsigned long address, byte *data, unsigned int recsize)
 {
-    dbFile.seek(address, SeekSet);
-    dbFile.read(data, recsize);
+    legacyFile.seek(address, SeekSet);
+    legacyFile.read(data, recsize);
 }
-EDB db(&DBWriter, &DBReader);
+EDB legacyDb(&LegacyDBWriter, &LegacyDBReader);
+EDB legacyColdDb(&LegacyDBWriter, &LegacyDBReader);
+
+// Rejects unknown cards, maps the card UID to the leaf page in the user store and the user name to the cold key,
+// see BuildIndex()
+UidFilter uidFilter;
+UidIndex uidIndex;
+NameIndex nameIndex;
+
+// Called after a user record has been stored, modified or deleted. u64_ID = 0 means all users.
+typedef void (*UserChangedCallback)(uint64_t u64_ID);
+UserChangedCallback userChangedCallback = NULL;
+
+// Called by UserManager::VisitUsers() for each user
+typedef void (*UserVisitor)(kUser *pk_User);
 
 class UserManager
 {
@@ -62,25 +121,42 @@ public:
     static void InitDatabase()
     {
         SPIFFS.begin();
-        if (SPIFFS.exists(DB_FILE))
+        if (SPIFFS.exists(DB_IMPORT_READY))
+        {
+            // The power failed while an import was installed
+            SwapImport();
+        }
+        else if (SPIFFS.exists(DB_IMPORT_FILE))
+        {
+            // An upload that has been interrupted
+            SPIFFS.remove(DB_IMPORT_FILE);
+        }
+
+        if (SPIFFS.exists(DB_LEGACY_FILE))
+        {
+            // The migration has been interrupted -> start it anew
+            MigrateLegacyDatabase();
+        }
+        else if (SPIFFS.exists(DB_FILE))
         {
             dbFile = SPIFFS.open(DB_FILE, "r+");
             if (dbFile)
             {
+                // Complete or roll back a write that has been interrupted by a power failure
+                dbJournal.Open(&dbFile, DB_JOURNAL_FILE);
+                dbJournal.Recover();
+
                 DEBUG("Opening users database %s...", DB_FILE);
-                EDB_Status result = db.open(0);
-                if (result == EDB_OK)
+                if (userStore.Open(&dbJournal))
                 {
                     DEBUG("Done.");
                 }
                 else
                 {
-                    DEBUG("Error:");
-                    DEBUG("Did not find a valid database in %s.", DB_FILE);
-                    DEBUG("Creating new table... ");
-                    db.create(0, DB_TABLE_SIZE, (unsigned int)sizeof(kUser));
-                    DEBUG("Done.");
-                    return;
+                    DEBUG("Found a database in an old format.");
+                    dbFile.close();
+                    SPIFFS.rename(DB_FILE, DB_LEGACY_FILE);
+                    MigrateLegacyDatabase();
                 }
             }
             else
@@ -90,72 +166,362 @@ public:
         }
         else
         {
-            DEBUG("Creating table...");
-            dbFile = SPIFFS.open(DB_FILE, "w+");
-            db.create(0, DB_TABLE_SIZE, (unsigned int)sizeof(kUser));
-            DEBUG("Done.");
+            CreateDatabase();
         }
+
+        BuildIndex();
+    }
+
+    // Replaces the database with the complete import DB_IMPORT_READY and reloads the users
+    static void InstallImport()
+    {
+        if (dbFile)
+            dbFile.close();
+
+        SwapImport();
+        InitDatabase();
+        NotifyChanged(0);
+    }
+
+    static void SwapImport()
+    {
+        Utils::Print("Installing the imported user database...\r\n");
+        SPIFFS.remove(DB_JOURNAL_FILE);
+        SPIFFS.remove(DB_FILE);
+        SPIFFS.rename(DB_IMPORT_READY, DB_FILE);
+    }
+
+    // All modifications between BeginBatch() and CommitBatch() are written to flash at once and survive a power
+    // failure either completely or not at all. Use this for bulk operations. Without a batch each user operation
+    // is committed on its own. Calls may be nested.
+    // A batch can modify up to JOURNAL_MAX_PAGES pages, see JournaledFile::GetFreePages().
+    static void BeginBatch()
+    {
+        dbJournal.BeginTransaction();
+    }
+
+    // returns false if the batch has failed, then none of its modifications has been stored
+    static bool CommitBatch()
+    {
+        if (dbJournal.CommitTransaction())
+            return true;
+
+        // The copy of the store header and the RAM indexes still contain the discarded modifications
+        if (!dbJournal.IsTransactionOpen())
+            ReloadDatabase();
+        return false;
+    }
+
+    // returns true if the current batch may not have room for another user operation
+    static bool IsBatchFull()
+    {
+        return dbJournal.GetFreePages() < userStore.GetMaxInsertPages();
+    }
+
+    // Discards all modifications of the current batch
+    static void AbortBatch()
+    {
+        dbJournal.RollbackTransaction();
+        ReloadDatabase();
     }
 
-    static void PrintDBError(EDB_Status err)
+    // Reads the store header again and rebuilds the RAM indexes
+    static void ReloadDatabase()
     {
-        Serial.print("ERROR: ");
-        switch (err)
+        userStore.Open(&dbJournal);
+        BuildIndex();
+        NotifyChanged(0);
+    }
+
+    static void CreateDatabase()
+    {
+        DEBUG("Creating user store...");
+        // A journal without database belongs to a file that no longer exists
+        SPIFFS.remove(DB_JOURNAL_FILE);
+        dbFile = SPIFFS.open(DB_FILE, "w+");
+        dbJournal.Open(&dbFile, DB_JOURNAL_FILE);
+        userStore.Open(&dbJournal);
+        userStore.Create();
+        DEBUG("Done.");
+    }
+
+    // Copies all users from DB_LEGACY_FILE into a new user store.
+    // The legacy file is deleted only after the new database has been written completely.
+    static void MigrateLegacyDatabase()
+    {
+        Utils::Print("Migrating the user database to the paged format...\r\n");
+        CreateDatabase();
+
+        legacyFile = SPIFFS.open(DB_LEGACY_FILE, "r");
+        if (!legacyFile)
+            return;
+
+        uint32_t u32_Magic = 0;
+        LegacyDBReader(0, (byte *)&u32_Magic, sizeof(u32_Magic));
+
+        BeginBatch();
+        kUser k_User;
+        if (u32_Magic == DB_V2_MAGIC)
         {
-        case EDB_OUT_OF_RANGE:
-            Serial.println("Recno out of range");
-            break;
-        case EDB_TABLE_FULL:
-            Serial.println("Table full");
-            break;
-        case EDB_OK:
-        default:
-            Serial.println("OK");
-            break;
+            kUserHot k_Hot;
+            kUserCold k_Cold;
+            legacyDb.open(DB_V2_HOT_OFFSET);
+            legacyColdDb.open(DB_V2_COLD_OFFSET);
+            for (unsigned long recno = 1; recno <= legacyDb.count(); recno++)
+            {
+                if (legacyDb.readRec(recno, EDB_REC k_Hot) == EDB_OK &&
+                    legacyColdDb.readRec(k_Hot.u16_ColdKey, EDB_REC k_Cold) == EDB_OK && k_Hot.u64_ID != 0)
+                {
+                    MakeUser(&k_Hot, &k_Cold, &k_User);
+                    MigrateUser(&k_User);
+                }
+            }
+        }
+        else
+        {
+            legacyDb.open(0);
+            for (unsigned long recno = 1; recno <= legacyDb.count(); recno++)
+            {
+                if (legacyDb.readRec(recno, EDB_REC k_User) == EDB_OK && k_User.ID.u64 != 0)
+                    MigrateUser(&k_User);
+            }
+        }
+        CommitBatch();
+
+        legacyFile.close();
+        SPIFFS.remove(DB_LEGACY_FILE);
+        Utils::Print("Done.\r\n");
+    }
+
+    // The migration starts anew if it is interrupted, so it is committed in several steps when the journal is full
+    static void MigrateUser(kUser *pk_User)
+    {
+        if (IsBatchFull())
+        {
+            CommitBatch();
+            BeginBatch();
+        }
+        InsertUser(pk_User);
+    }
+
+    // Walks once through all leaves and cold records and stores the UIDs and name hashes in the RAM indexes.
+    // If an index exceeds its limit (see GetIndexLimit()), FindUser() falls back to searching the user store.
+    static void BuildIndex()
+    {
+        if (!dbFile)
+            return;
+
+        BuildFilter(userStore.GetUserCount() + DB_INDEX_RESERVE);
+
+        if (!uidIndex.Init(userStore.GetUserCount() + DB_INDEX_RESERVE, GetIndexLimit(DB_UID_INDEX_MAX_BYTES)))
+            Utils::Print("UID index disabled (memory limit), falling back to searching the database.\r\n");
+
+        if (!nameIndex.Init(userStore.GetUserCount() + DB_INDEX_RESERVE, GetIndexLimit(DB_NAME_INDEX_MAX_BYTES)))
+            Utils::Print("Name index disabled (memory limit), falling back to linear search.\r\n");
+
+        kLeafPage k_Leaf;
+        kUserCold k_Cold;
+        for (uint16_t u16_Leaf = userStore.GetFirstLeaf(); userStore.ReadLeaf(u16_Leaf, &k_Leaf); u16_Leaf = k_Leaf.u16_Next)
+        {
+            for (int i = 0; i < k_Leaf.u8_Count; i++)
+            {
+                OnLeafChanged(k_Leaf.k_Entries[i].u64_ID, u16_Leaf);
+                if (nameIndex.IsValid() && userStore.ReadCold(k_Leaf.k_Entries[i].u16_ColdKey, &k_Cold))
+                    IndexName(k_Cold.s8_Name, k_Leaf.k_Entries[i].u16_ColdKey);
+            }
+        }
+
+        char s8_Buf[100];
+        sprintf(s8_Buf, "User store: %u users, %u pages, tree height %u\r\n", userStore.GetUserCount(), userStore.GetPageCount(), userStore.GetHeight());
+        Utils::Print(s8_Buf);
+        PrintFilterStats();
+        sprintf(s8_Buf, "UID index: %u users, %u slots, %u bytes RAM\r\n", uidIndex.GetCount(), uidIndex.GetSlotCount(), uidIndex.GetMemoryUsage());
+        Utils::Print(s8_Buf);
+        sprintf(s8_Buf, "Name index: %u users, %u bytes RAM\r\n", nameIndex.GetCount(), nameIndex.GetMemoryUsage());
+        Utils::Print(s8_Buf);
+    }
+
+    // Returns the number of bytes a RAM index may allocate: at most u32_MaxBytes, and the largest free heap block
+    // must not drop below DB_HEAP_FLOOR. An index is allocated in one piece, so the total free heap does not matter.
+    static uint32_t GetIndexLimit(uint32_t u32_MaxBytes)
+    {
+        uint32_t u32_Block = ESP.getMaxFreeBlockSize();
+        if (u32_Block <= DB_HEAP_FLOOR)
+            return 0;
+
+        return min(u32_MaxBytes, u32_Block - DB_HEAP_FLOOR);
+    }
+
+    // Fills the UID filter with all enrolled users.
+    // If the filter overflows (very unlikely below the load limit) it is rebuilt with twice the capacity.
+    static void BuildFilter(uint32_t u32_Capacity)
+    {
+        kLeafPage k_Leaf;
+        while (true)
+        {
+            if (!uidFilter.Init(u32_Capacity, GetIndexLimit(DB_FILTER_MAX_BYTES)))
+            {
+                Utils::Print("UID filter disabled (memory limit).\r\n");
+                return;
+            }
+
+            bool b_Success = true;
+            for (uint16_t u16_Leaf = userStore.GetFirstLeaf(); b_Success && userStore.ReadLeaf(u16_Leaf, &k_Leaf); u16_Leaf = k_Leaf.u16_Next)
+            {
+                for (int i = 0; b_Success && i < k_Leaf.u8_Count; i++)
+                {
+                    b_Success = uidFilter.Insert(k_Leaf.k_Entries[i].u64_ID);
+                }
+            }
+
+            if (b_Success)
+                return;
+
+            u32_Capacity *= 2;
+        }
+    }
+
+    static void PrintFilterStats()
+    {
+        char s8_Buf[120];
+        uint32_t u32_Ppm = uidFilter.GetFalsePositivePpm();
+        sprintf(s8_Buf, "UID filter: %u users, %u bit fingerprints, %u bytes RAM, false positive rate %u.%04u%%\r\n",
+                uidFilter.GetCount(), uidFilter.GetPrintBits(), uidFilter.GetMemoryUsage(), u32_Ppm / 10000, u32_Ppm % 10000);
+        Utils::Print(s8_Buf);
+        sprintf(s8_Buf, "UID filter: %u lookups, %u unknown cards rejected, %u false positives\r\n",
+                uidFilter.GetLookupCount(), uidFilter.GetRejectedCount(), uidFilter.GetFalsePositiveCount());
+        Utils::Print(s8_Buf);
+    }
+
+    // Called by the user store whenever a UID is stored in a (new) leaf page
+    static void OnLeafChanged(uint64_t u64_ID, uint16_t u16_Leaf)
+    {
+        if (!uidIndex.IsValid() || uidIndex.Insert(u64_ID, u16_Leaf))
+            return;
+
+        if (!uidIndex.Grow(GetIndexLimit(DB_UID_INDEX_MAX_BYTES)) || !uidIndex.Insert(u64_ID, u16_Leaf))
+        {
+            // An incomplete index would reject valid cards
+            Utils::Print("UID index disabled (memory limit), falling back to searching the database.\r\n");
+            uidIndex.Free();
+        }
+    }
+
+    static void IndexName(const char *s8_Name, uint16_t u16_ColdKey)
+    {
+        if (!nameIndex.IsValid() || nameIndex.Insert(s8_Name, u16_ColdKey))
+            return;
+
+        if (!nameIndex.Grow(GetIndexLimit(DB_NAME_INDEX_MAX_BYTES)) || !nameIndex.Insert(s8_Name, u16_ColdKey))
+        {
+            Utils::Print("Name index disabled (memory limit), falling back to linear search.\r\n");
+            nameIndex.Free();
         }
     }
 
+    // Other modules that keep data derived from the user records (e.g. the DESFire secret cache)
+    // are notified of changes here.
+    static void SetChangedCallback(UserChangedCallback f_Callback)
+    {
+        userChangedCallback = f_Callback;
+    }
+
+    static void NotifyChanged(uint64_t u64_ID)
+    {
+        if (userChangedCallback)
+            userChangedCallback(u64_ID);
+    }
+
     static void DeleteAllUsers()
     {
-        db.clear();
+        userStore.Create();
+        uidFilter.Clear();
+        uidIndex.Clear();
+        nameIndex.Clear();
+        NotifyChanged(0);
+    }
+
+    static uint32_t GetUserCount()
+    {
+        return userStore.GetUserCount();
     }
 
-    static bool FindUser(uint64_t u64_ID, kUser *pk_User) {
-        unsigned long recNo;
-        return FindUser(u64_ID, pk_User, &recNo);
+    static bool FindUser(uint64_t u64_ID, kUser *pk_User)
+    {
+        kUserHot k_Hot;
+        if (!FindHot(u64_ID, &k_Hot))
+            return false;
+
+        // Only now that the UID has matched, the name is read
+        kUserCold k_Cold;
+        if (!userStore.ReadCold(k_Hot.u16_ColdKey, &k_Cold))
+            return false;
+
+        MakeUser(&k_Hot, &k_Cold, pk_User);
+        return true;
     }
 
-    static bool FindUser(uint64_t u64_ID, kUser *pk_User, unsigned long *recno)
+    // Searches the hot record of the UID
+    static bool FindHot(uint64_t u64_ID, kUserHot *pk_Hot)
     {
         if (u64_ID == 0)
             return false;
 
-        for ((*recno) = 1; (*recno) <= db.count(); (*recno)++)
+        // An unknown card is rejected without accessing the storage file
+        if (!uidFilter.MayContain(u64_ID))
+            return false;
+
+        bool b_Found;
+        if (uidIndex.IsValid())
+        {
+            // A known card costs one page read
+            uint32_t u32_Leaf;
+            b_Found = uidIndex.Find(u64_ID, &u32_Leaf) && userStore.FindInLeaf(u32_Leaf, u64_ID, pk_Hot);
+        }
+        else
+        {
+            uint16_t u16_Leaf;
+            b_Found = userStore.Find(u64_ID, pk_Hot, &u16_Leaf);
+        }
+
+        if (!b_Found && uidFilter.IsValid())
+            uidFilter.CountFalsePositive();
+        return b_Found;
+    }
+
+    // Finds a user by name (case insensitive)
+    static bool FindUser(const char *name, kUser *pk_User)
+    {
+        kUserCold k_Cold;
+        kUserHot k_Hot;
+        if (nameIndex.IsValid())
         {
-            DEBUG("Reading record with no %ld", *recno);
-            EDB_Status result = db.readRec((*recno), EDB_REC (*pk_User));
-            if (result == EDB_OK)
+            // Only the records with a matching hash are read from the storage file
+            uint32_t u32_Hash = NameIndex::Hash(name);
+            for (uint32_t i = nameIndex.LowerBound(u32_Hash); i < nameIndex.GetCount() && nameIndex.GetHash(i) == u32_Hash; i++)
             {
-                if (pk_User->ID.u64 == u64_ID)
+                if (userStore.ReadCold(nameIndex.GetColdKey(i), &k_Cold) && k_Cold.u64_ID != 0 &&
+                    Utils::stricmp(k_Cold.s8_Name, name) == 0)
                 {
+                    if (!FindHot(k_Cold.u64_ID, &k_Hot))
+                        return false;
+
+                    MakeUser(&k_Hot, &k_Cold, pk_User);
                     return true;
                 }
             }
+            return false;
         }
-        return false;
-    }
 
-    static bool FindUser(const char *name, kUser *pk_User, unsigned long *recno)
-    {
-        for ((*recno) = 1; (*recno) <= db.count(); (*recno)++)
+        kLeafPage k_Leaf;
+        for (uint16_t u16_Leaf = userStore.GetFirstLeaf(); userStore.ReadLeaf(u16_Leaf, &k_Leaf); u16_Leaf = k_Leaf.u16_Next)
         {
-            DEBUG("Reading record with no %ld", *recno);
-            EDB_Status result = db.readRec((*recno), EDB_REC (*pk_User));
-            if (result == EDB_OK)
+            for (int i = 0; i < k_Leaf.u8_Count; i++)
             {
-                DEBUG("Result OK, comparing...");
-                if (strcmp(pk_User->s8_Name, name))
+                DEBUG("Reading cold record %d", k_Leaf.k_Entries[i].u16_ColdKey);
+                if (userStore.ReadCold(k_Leaf.k_Entries[i].u16_ColdKey, &k_Cold) && Utils::stricmp(k_Cold.s8_Name, name) == 0)
                 {
+                    MakeUser(&k_Leaf.k_Entries[i], &k_Cold, pk_User);
                     return true;
                 }
             }
@@ -163,33 +529,75 @@ public:
         return false;
     }
 
-    // Insert the user alphabetically sorted into the storage file
+    static void MakeUser(kUserHot *pk_Hot, kUserCold *pk_Cold, kUser *pk_User)
+    {
+        pk_User->ID.u64 = pk_Hot->u64_ID;
+        pk_User->u8_Flags = pk_Hot->u8_Flags;
+        memcpy(pk_User->s8_Name, pk_Cold->s8_Name, NAME_BUF_SIZE);
+    }
+
     static bool StoreNewUser(kUser *pk_NewUser)
     {
         DEBUG("Storing new user named %s..:", pk_NewUser->s8_Name);
-        EDB_Status result = db.appendRec(EDB_REC (*pk_NewUser));
-        if (result != EDB_OK)
-        {
-            PrintDBError(result);
+        if (!InsertUser(pk_NewUser))
             return false;
-        }
+
         DEBUG("User has been stored.");
         Utils::Print("New user stored successfully:\r\n");
         PrintUser(pk_NewUser);
         return true;
     }
 
+    // Stores the name in a free cold record and inserts the user into the B+tree
+    static bool InsertUser(kUser *pk_NewUser)
+    {
+        if (userStore.GetUserCount() >= MAX_USERS)
+        {
+            Utils::Print("ERROR: User store full\r\n");
+            return false;
+        }
+
+        BeginBatch();
+        kUserHot k_Hot;
+        k_Hot.u64_ID = pk_NewUser->ID.u64;
+        k_Hot.u8_Flags = pk_NewUser->u8_Flags;
+        k_Hot.u16_ColdKey = userStore.AllocCold();
+
+        bool b_Success = k_Hot.u16_ColdKey != 0;
+        if (b_Success)
+        {
+            kUserCold k_Cold;
+            k_Cold.u64_ID = pk_NewUser->ID.u64;
+            memcpy(k_Cold.s8_Name, pk_NewUser->s8_Name, NAME_BUF_SIZE);
+            userStore.WriteCold(k_Hot.u16_ColdKey, &k_Cold);
+
+            b_Success = userStore.Insert(&k_Hot, &OnLeafChanged);
+        }
+        if (!CommitBatch())
+            return false;
+
+        if (!b_Success)
+        {
+            Utils::Print("ERROR: The file system is full\r\n");
+            return false;
+        }
+
+        if (uidFilter.IsValid() && !uidFilter.Insert(k_Hot.u64_ID))
+            BuildFilter(uidFilter.GetSlotCount());
+
+        IndexName(pk_NewUser->s8_Name, k_Hot.u16_ColdKey);
+        NotifyChanged(k_Hot.u64_ID);
+        return true;
+    }
+
     // Deletes a user by ID
     static bool DeleteUser(uint64_t u64_ID)
     {
         DEBUG("Deleting user with UID %lld...", u64_ID);
-        unsigned long recNo;
         kUser k_User;
-        if (FindUser(u64_ID, &k_User, &recNo))
+        if (FindUser(u64_ID, &k_User))
         {
-            DEBUG ("User found at recno %ld.", recNo);
-            db.deleteRec(recNo);
-            DEBUG("User has been deleted.");
+            DeleteRecord(&k_User);
             return true;
         }
         return false;
@@ -199,30 +607,58 @@ public:
     static bool DeleteUser(const char *name)
     {
         DEBUG("Deleting user with name %s...", name);
-        unsigned long recNo;
         kUser k_User;
-        if (FindUser(name, &k_User, &recNo))
+        if (FindUser(name, &k_User))
         {
-            DEBUG ("User found at recno %ld.", recNo);
-            db.deleteRec(recNo);
-            DEBUG("User has been deleted.");
+            DeleteRecord(&k_User);
             return true;
         }
         return false;
     }
 
+    // Removes the hot record from the B+tree and frees the cold record (this also erases the random data).
+    static void DeleteRecord(kUser *pk_User)
+    {
+        kUserHot k_Hot;
+        if (!FindHot(pk_User->ID.u64, &k_Hot))
+            return;
+
+        BeginBatch();
+        userStore.Remove(k_Hot.u64_ID);
+        userStore.FreeCold(k_Hot.u16_ColdKey);
+        if (!CommitBatch())
+            return;
+
+        uidFilter.Remove(k_Hot.u64_ID);
+        uidIndex.Remove(k_Hot.u64_ID);
+        nameIndex.Remove(pk_User->s8_Name, k_Hot.u16_ColdKey);
+        NotifyChanged(k_Hot.u64_ID);
+        DEBUG("User has been deleted.");
+    }
+
     // Modifies the flags of a user.
+    // The hot record is updated in place, so the UID and name indexes stay valid.
     // returns false if the user does not exist.
     static bool SetUserFlags(char *s8_Name, byte u8_NewFlags)
     {
-        unsigned long recNo;
         kUser k_User;
-        if (FindUser(s8_Name, &k_User, &recNo )) {
-            k_User.u8_Flags = u8_NewFlags;
-            db.updateRec(recNo,EDB_REC k_User);
-            return true;
-        }
-        return false;
+        return FindUser(s8_Name, &k_User) && SetUserFlags(k_User.ID.u64, u8_NewFlags);
+    }
+
+    static bool SetUserFlags(uint64_t u64_ID, byte u8_NewFlags)
+    {
+        kUserHot k_Hot;
+        if (!FindHot(u64_ID, &k_Hot))
+            return false;
+
+        k_Hot.u8_Flags = u8_NewFlags;
+        BeginBatch();
+        bool b_Success = userStore.Insert(&k_Hot, &OnLeafChanged);
+        if (!CommitBatch() || !b_Success)
+            return false;
+
+        NotifyChanged(k_Hot.u64_ID);
+        return true;
     }
 
     // Prints lines like
@@ -258,23 +694,97 @@ public:
         }
     }
 
+    // Calls f_Visitor for at most u32_Max users with a UID greater than u64_After, in UID order.
+    // Only the leaves of these users are read (plus the path from the root), so a page of a large
+    // user list costs a few page reads instead of a scan.
+    // Returns the number of users visited.
+    static uint32_t VisitUsers(uint64_t u64_After, uint32_t u32_Max, UserVisitor f_Visitor)
+    {
+        kUserHot k_Hot;
+        uint16_t u16_Leaf = userStore.GetFirstLeaf();
+        if (u64_After != 0)
+            userStore.Find(u64_After, &k_Hot, &u16_Leaf);
+
+        uint32_t u32_Count = 0;
+        kUser k_User;
+        kLeafPage k_Leaf;
+        kUserCold k_Cold;
+        for (; u32_Count < u32_Max && userStore.ReadLeaf(u16_Leaf, &k_Leaf); u16_Leaf = k_Leaf.u16_Next)
+        {
+            for (int i = 0; i < k_Leaf.u8_Count && u32_Count < u32_Max; i++)
+            {
+                if (k_Leaf.k_Entries[i].u64_ID <= u64_After || !userStore.ReadCold(k_Leaf.k_Entries[i].u16_ColdKey, &k_Cold))
+                    continue;
+
+                MakeUser(&k_Leaf.k_Entries[i], &k_Cold, &k_User);
+                f_Visitor(&k_User);
+                u32_Count++;
+            }
+
+            if (k_Leaf.u16_Next == 0)
+                break;
+        }
+        return u32_Count;
+    }
+
+    // Parses a card UID in hex as printed by PrintUser(): 4 or 7 bytes without spaces (e.g. 04A1B2C3D4E5F6).
+    // ps8_Rest receives the position behind the UID.
+    static bool ParseUid(const char *s8_Text, uint64_t *pu64_ID, const char **ps8_Rest)
+    {
+        kUser k_User;
+        int s32_Digits = 0;
+        while (*s8_Text == ' ')
+        {
+            s8_Text++;
+        }
+        while (isxdigit(*s8_Text))
+        {
+            if (s32_Digits == 14)
+                return false;
+
+            byte u8_Nibble = isdigit(*s8_Text) ? *s8_Text - '0' : (toupper(*s8_Text) - 'A' + 10);
+            k_User.ID.u8[s32_Digits / 2] |= (s32_Digits % 2) ? u8_Nibble : (u8_Nibble << 4);
+            s32_Digits++;
+            s8_Text++;
+        }
+
+        *pu64_ID = k_User.ID.u64;
+        if (ps8_Rest)
+            *ps8_Rest = s8_Text;
+        return s32_Digits == 8 || s32_Digits == 14;
+    }
+
+    // The reverse of ParseUid(), s8_Uid must have 15 bytes
+    static void FormatUid(uint64_t u64_ID, char *s8_Uid)
+    {
+        for (int i = 0; i < 7; i++)
+        {
+            sprintf(s8_Uid + 2 * i, "%02X", (byte)(u64_ID >> (8 * i)));
+        }
+    }
+
     static void ListAllUsers()
     {
         Utils::Print("Users stored in database:\r\n");
 
-        if (db.count() == 0)
+        if (userStore.GetUserCount() == 0)
         {
             Utils::Print("No users.\r\n");
             return;
         }
 
         kUser k_User;
-        for (unsigned long recno = 1; recno <= db.count(); recno++)
+        kLeafPage k_Leaf;
+        kUserCold k_Cold;
+        for (uint16_t u16_Leaf = userStore.GetFirstLeaf(); userStore.ReadLeaf(u16_Leaf, &k_Leaf); u16_Leaf = k_Leaf.u16_Next)
         {
-            EDB_Status result = db.readRec(recno, EDB_REC k_User);
-            if (result == EDB_OK)
+            for (int i = 0; i < k_Leaf.u8_Count; i++)
             {
-                PrintUser(&k_User);
+                if (userStore.ReadCold(k_Leaf.k_Entries[i].u16_ColdKey, &k_Cold))
+                {
+                    MakeUser(&k_Leaf.k_Entries[i], &k_Cold, &k_User);
+                    PrintUser(&k_User);
+                }
             }
         }
     }
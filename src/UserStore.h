@@ -0,0 +1,488 @@
+#ifndef USERSTORE_H
+#define USERSTORE_H
+
+#include "JournaledFile.h"
+
+// The user store is a paged file that grows with the number of users.
+// Page 0 contains the kStoreHeader. All other pages are either
+// - B+tree pages (kInnerPage / kLeafPage) holding the "hot" records (kUserHot), sorted by card UID, or
+// - cold pages holding STORE_COLD_PER_PAGE "cold" records (kUserCold) with the user name and the random data.
+// A lookup reads one page per tree level (height + 1 pages), a tree of height 3 holds more than 100000 users.
+// The pages have the same size as the pages of the journal, so a modified page is always written as a whole.
+#define STORE_PAGE_SIZE JOURNAL_PAGE_SIZE
+#define STORE_MAGIC 0x33554744 // "DGU3"
+#define STORE_MAX_HEIGHT 8
+#define STORE_LEAF_ENTRIES 22  // (256 - 4) / sizeof(kUserHot)
+#define STORE_INNER_KEYS 25    // (256 - 4 - 2) / (8 + 2)
+#define STORE_COLD_PER_PAGE 3  // 256 / sizeof(kUserCold)
+
+#define NAME_BUF_SIZE 64
+
+enum ePageType
+{
+    PAGE_LEAF = 1,
+    PAGE_INNER = 2,
+};
+
+// Record of the B+tree leaves.
+struct __attribute__((packed)) kUserHot
+{
+    uint64_t u64_ID;
+    byte u8_Flags;
+    uint16_t u16_ColdKey; // The cold record that belongs to this user (page << 2 | index in page)
+};
+
+// Cold record, read only after a UID has matched.
+// Cold records never move, so the cold key of a user stays valid. Deleted records are reused.
+struct kUserCold
+{
+    uint64_t u64_ID; // 0 = free record, then the first two bytes of s8_Name contain the next free cold key
+    char s8_Name[NAME_BUF_SIZE];
+};
+
+struct kStoreHeader
+{
+    uint32_t u32_Magic;
+    uint32_t u32_UserCount;
+    uint16_t u16_Root;      // Root page of the B+tree (a leaf while the tree has height 0)
+    uint16_t u16_PageCount; // Number of pages in the file including the header page
+    uint16_t u16_ColdFree;  // First free cold record, 0 = none
+    byte u8_Height;         // Number of inner levels above the leaves
+    byte u8_Reserved;
+};
+
+struct __attribute__((packed)) kLeafPage
+{
+    byte u8_Type;
+    byte u8_Count;
+    uint16_t u16_Next; // The right neighbour (for iterating all users in UID order), 0 = last leaf
+    kUserHot k_Entries[STORE_LEAF_ENTRIES];
+};
+
+// u16_Children[i] contains the UIDs < u64_Keys[i], u16_Children[u8_Count] the UIDs >= u64_Keys[u8_Count - 1]
+struct __attribute__((packed)) kInnerPage
+{
+    byte u8_Type;
+    byte u8_Count; // number of keys
+    uint16_t u16_Reserved;
+    uint64_t u64_Keys[STORE_INNER_KEYS];
+    uint16_t u16_Children[STORE_INNER_KEYS + 1];
+};
+
+static_assert(sizeof(kStoreHeader) <= STORE_PAGE_SIZE, "kStoreHeader too large");
+static_assert(sizeof(kLeafPage) <= STORE_PAGE_SIZE, "kLeafPage too large");
+static_assert(sizeof(kInnerPage) <= STORE_PAGE_SIZE, "kInnerPage too large");
+static_assert(STORE_COLD_PER_PAGE * sizeof(kUserCold) <= STORE_PAGE_SIZE, "Too many cold records per page");
+
+// Called for every UID that has been stored in another leaf page (after inserting or splitting a leaf).
+typedef void (*LeafChangedCallback)(uint64_t u64_ID, uint16_t u16_Leaf);
+
+class UserStore
+{
+public:
+    UserStore()
+    {
+        mpi_File = NULL;
+        memset(&mk_Header, 0, sizeof(mk_Header));
+    }
+
+    // returns false if the file does not contain a user store
+    bool Open(JournaledFile *pi_File)
+    {
+        mpi_File = pi_File;
+        mpi_File->Read(0, (byte *)&mk_Header, sizeof(mk_Header));
+        return mk_Header.u32_Magic == STORE_MAGIC;
+    }
+
+    // Creates an empty store: the header page and an empty root leaf.
+    void Create()
+    {
+        memset(&mk_Header, 0, sizeof(mk_Header));
+        mk_Header.u32_Magic = STORE_MAGIC;
+        mk_Header.u16_PageCount = 1;
+
+        kLeafPage k_Leaf;
+        memset(&k_Leaf, 0, sizeof(k_Leaf));
+        k_Leaf.u8_Type = PAGE_LEAF;
+
+        mpi_File->BeginTransaction();
+        mk_Header.u16_Root = AllocPage();
+        WritePage(mk_Header.u16_Root, &k_Leaf, sizeof(k_Leaf));
+        WriteHeader();
+        mpi_File->CommitTransaction();
+    }
+
+    uint32_t GetUserCount()
+    {
+        return mk_Header.u32_UserCount;
+    }
+
+    uint32_t GetPageCount()
+    {
+        return mk_Header.u16_PageCount;
+    }
+
+    uint32_t GetHeight()
+    {
+        return mk_Header.u8_Height;
+    }
+
+    // The maximum number of pages that an Insert() together with AllocCold() and WriteCold() modifies:
+    // the header, a cold page, the leaf and its new right neighbour, a split on every inner level and a new root
+    uint32_t GetMaxInsertPages()
+    {
+        return 2 * mk_Header.u8_Height + 5;
+    }
+
+    // Descends from the root to the leaf that may contain the UID.
+    // pu16_Leaf receives the leaf page even if the UID was not found.
+    bool Find(uint64_t u64_ID, kUserHot *pk_Hot, uint16_t *pu16_Leaf)
+    {
+        *pu16_Leaf = Descend(u64_ID, NULL, NULL);
+        return FindInLeaf(*pu16_Leaf, u64_ID, pk_Hot);
+    }
+
+    // Searches a single leaf page (e.g. the page that the UID index has returned)
+    bool FindInLeaf(uint16_t u16_Leaf, uint64_t u64_ID, kUserHot *pk_Hot)
+    {
+        kLeafPage k_Leaf;
+        if (!ReadLeaf(u16_Leaf, &k_Leaf))
+            return false;
+
+        int s32_Pos = LeafLowerBound(&k_Leaf, u64_ID);
+        if (s32_Pos >= k_Leaf.u8_Count || k_Leaf.k_Entries[s32_Pos].u64_ID != u64_ID)
+            return false;
+
+        *pk_Hot = k_Leaf.k_Entries[s32_Pos];
+        return true;
+    }
+
+    // Inserts a new hot record or replaces the record with the same UID.
+    // fk_Changed is called for the new UID and for all UIDs that have been moved to a new leaf by a split.
+    // returns false if the store is full or the write has failed (see JournaledFile::CommitTransaction()).
+    bool Insert(kUserHot *pk_Hot, LeafChangedCallback fk_Changed)
+    {
+        uint16_t u16_Path[STORE_MAX_HEIGHT];
+        byte u8_Slots[STORE_MAX_HEIGHT];
+        uint16_t u16_Leaf = Descend(pk_Hot->u64_ID, u16_Path, u8_Slots);
+
+        kLeafPage k_Leaf;
+        if (!ReadLeaf(u16_Leaf, &k_Leaf))
+            return false;
+
+        int s32_Pos = LeafLowerBound(&k_Leaf, pk_Hot->u64_ID);
+        if (s32_Pos < k_Leaf.u8_Count && k_Leaf.k_Entries[s32_Pos].u64_ID == pk_Hot->u64_ID)
+        {
+            k_Leaf.k_Entries[s32_Pos] = *pk_Hot;
+            return WritePage(u16_Leaf, &k_Leaf, sizeof(k_Leaf));
+        }
+
+        if (mk_Header.u16_PageCount == 0xFFFF)
+            return false;
+
+        mpi_File->BeginTransaction();
+        mk_Header.u32_UserCount++;
+
+        if (k_Leaf.u8_Count < STORE_LEAF_ENTRIES)
+        {
+            InsertIntoLeaf(&k_Leaf, s32_Pos, pk_Hot);
+            WritePage(u16_Leaf, &k_Leaf, sizeof(k_Leaf));
+            WriteHeader();
+            if (!mpi_File->CommitTransaction())
+                return false;
+
+            fk_Changed(pk_Hot->u64_ID, u16_Leaf);
+            return true;
+        }
+
+        // Split the full leaf: The left half stays in place, the right half moves to a new page.
+        kUserHot k_All[STORE_LEAF_ENTRIES + 1];
+        memcpy(k_All, k_Leaf.k_Entries, s32_Pos * sizeof(kUserHot));
+        k_All[s32_Pos] = *pk_Hot;
+        memcpy(&k_All[s32_Pos + 1], &k_Leaf.k_Entries[s32_Pos], (k_Leaf.u8_Count - s32_Pos) * sizeof(kUserHot));
+
+        kLeafPage k_Right;
+        memset(&k_Right, 0, sizeof(k_Right));
+        k_Right.u8_Type = PAGE_LEAF;
+        k_Right.u8_Count = (STORE_LEAF_ENTRIES + 1) / 2;
+        k_Right.u16_Next = k_Leaf.u16_Next;
+        k_Leaf.u8_Count = STORE_LEAF_ENTRIES + 1 - k_Right.u8_Count;
+
+        uint16_t u16_Right = AllocPage();
+        k_Leaf.u16_Next = u16_Right;
+        memcpy(k_Leaf.k_Entries, k_All, k_Leaf.u8_Count * sizeof(kUserHot));
+        memcpy(k_Right.k_Entries, &k_All[k_Leaf.u8_Count], k_Right.u8_Count * sizeof(kUserHot));
+
+        WritePage(u16_Leaf, &k_Leaf, sizeof(k_Leaf));
+        WritePage(u16_Right, &k_Right, sizeof(k_Right));
+        InsertIntoParent(u16_Path, u8_Slots, mk_Header.u8_Height, k_Right.k_Entries[0].u64_ID, u16_Right);
+        WriteHeader();
+        if (!mpi_File->CommitTransaction())
+            return false;
+
+        if (s32_Pos < k_Leaf.u8_Count)
+            fk_Changed(pk_Hot->u64_ID, u16_Leaf);
+        for (int i = 0; i < k_Right.u8_Count; i++)
+        {
+            fk_Changed(k_Right.k_Entries[i].u64_ID, u16_Right);
+        }
+        return true;
+    }
+
+    // Removes the hot record.
+    // Leaves that become underfull are not merged. The inner keys stay valid separators,
+    // so this does not affect the correctness, only the fill level of the pages.
+    bool Remove(uint64_t u64_ID)
+    {
+        uint16_t u16_Leaf = Descend(u64_ID, NULL, NULL);
+        kLeafPage k_Leaf;
+        if (!ReadLeaf(u16_Leaf, &k_Leaf))
+            return false;
+
+        int s32_Pos = LeafLowerBound(&k_Leaf, u64_ID);
+        if (s32_Pos >= k_Leaf.u8_Count || k_Leaf.k_Entries[s32_Pos].u64_ID != u64_ID)
+            return false;
+
+        memmove(&k_Leaf.k_Entries[s32_Pos], &k_Leaf.k_Entries[s32_Pos + 1], (k_Leaf.u8_Count - s32_Pos - 1) * sizeof(kUserHot));
+        k_Leaf.u8_Count--;
+
+        mpi_File->BeginTransaction();
+        WritePage(u16_Leaf, &k_Leaf, sizeof(k_Leaf));
+        mk_Header.u32_UserCount--;
+        WriteHeader();
+        mpi_File->CommitTransaction();
+        return true;
+    }
+
+    // The leftmost leaf. Follow kLeafPage::u16_Next to iterate all users in UID order.
+    uint16_t GetFirstLeaf()
+    {
+        uint16_t u16_Page = mk_Header.u16_Root;
+        for (int h = 0; h < mk_Header.u8_Height; h++)
+        {
+            kInnerPage k_Inner;
+            ReadPage(u16_Page, &k_Inner, sizeof(k_Inner));
+            u16_Page = k_Inner.u16_Children[0];
+        }
+        return u16_Page;
+    }
+
+    bool ReadLeaf(uint16_t u16_Page, kLeafPage *pk_Leaf)
+    {
+        if (u16_Page == 0 || u16_Page >= mk_Header.u16_PageCount)
+            return false;
+
+        ReadPage(u16_Page, pk_Leaf, sizeof(kLeafPage));
+        return pk_Leaf->u8_Type == PAGE_LEAF && pk_Leaf->u8_Count <= STORE_LEAF_ENTRIES;
+    }
+
+    // ---------------------------- cold records ----------------------------
+
+    // returns a free cold key or 0 if the file is full
+    uint16_t AllocCold()
+    {
+        kUserCold k_Cold;
+        uint16_t u16_Key = mk_Header.u16_ColdFree;
+        if (u16_Key != 0)
+        {
+            ReadCold(u16_Key, &k_Cold);
+            memcpy(&mk_Header.u16_ColdFree, k_Cold.s8_Name, sizeof(uint16_t));
+            WriteHeader();
+            return u16_Key;
+        }
+
+        if (mk_Header.u16_PageCount >= 0x3FFF) // The page number must fit into 14 bits of the cold key
+            return 0;
+
+        // Start a new cold page. The first record is returned, all others are added to the free list.
+        mpi_File->BeginTransaction();
+        uint16_t u16_Page = AllocPage();
+        for (int i = STORE_COLD_PER_PAGE - 1; i > 0; i--)
+        {
+            FreeCold((u16_Page << 2) | i);
+        }
+        WriteHeader();
+        mpi_File->CommitTransaction();
+        return u16_Page << 2;
+    }
+
+    bool ReadCold(uint16_t u16_Key, kUserCold *pk_Cold)
+    {
+        if (u16_Key == 0 || (u16_Key >> 2) >= mk_Header.u16_PageCount)
+            return false;
+
+        mpi_File->Read(ColdAddress(u16_Key), (byte *)pk_Cold, sizeof(kUserCold));
+        return true;
+    }
+
+    void WriteCold(uint16_t u16_Key, kUserCold *pk_Cold)
+    {
+        mpi_File->Write(ColdAddress(u16_Key), (const byte *)pk_Cold, sizeof(kUserCold));
+    }
+
+    // Overwrites the record with zeroes (this also erases the random data) and adds it to the free list
+    void FreeCold(uint16_t u16_Key)
+    {
+        kUserCold k_Cold;
+        memset(&k_Cold, 0, sizeof(k_Cold));
+        memcpy(k_Cold.s8_Name, &mk_Header.u16_ColdFree, sizeof(uint16_t));
+
+        mpi_File->BeginTransaction();
+        WriteCold(u16_Key, &k_Cold);
+        mk_Header.u16_ColdFree = u16_Key;
+        WriteHeader();
+        mpi_File->CommitTransaction();
+    }
+
+private:
+    JournaledFile *mpi_File;
+    kStoreHeader mk_Header; // A copy of page 0
+
+    void ReadPage(uint16_t u16_Page, void *p_Data, uint32_t u32_Size)
+    {
+        mpi_File->Read((uint32_t)u16_Page * STORE_PAGE_SIZE, (byte *)p_Data, u32_Size);
+    }
+
+    bool WritePage(uint16_t u16_Page, const void *p_Data, uint32_t u32_Size)
+    {
+        return mpi_File->Write((uint32_t)u16_Page * STORE_PAGE_SIZE, (const byte *)p_Data, u32_Size);
+    }
+
+    void WriteHeader()
+    {
+        WritePage(0, &mk_Header, sizeof(mk_Header));
+    }
+
+    // Pages are appended at the end of the file. WriteHeader() must be called afterwards.
+    uint16_t AllocPage()
+    {
+        return mk_Header.u16_PageCount++;
+    }
+
+    uint32_t ColdAddress(uint16_t u16_Key)
+    {
+        return (uint32_t)(u16_Key >> 2) * STORE_PAGE_SIZE + (u16_Key & 3) * sizeof(kUserCold);
+    }
+
+    // returns the leaf page for the UID.
+    // If pu16_Path is not NULL it receives the inner pages from the root downwards and pu8_Slots the child index taken in each of them.
+    uint16_t Descend(uint64_t u64_ID, uint16_t *pu16_Path, byte *pu8_Slots)
+    {
+        uint16_t u16_Page = mk_Header.u16_Root;
+        for (int h = 0; h < mk_Header.u8_Height; h++)
+        {
+            kInnerPage k_Inner;
+            ReadPage(u16_Page, &k_Inner, sizeof(k_Inner));
+
+            // upper bound: the number of keys <= u64_ID
+            int s32_Low = 0;
+            int s32_High = k_Inner.u8_Count;
+            while (s32_Low < s32_High)
+            {
+                int s32_Mid = (s32_Low + s32_High) / 2;
+                if (k_Inner.u64_Keys[s32_Mid] <= u64_ID)
+                    s32_Low = s32_Mid + 1;
+                else
+                    s32_High = s32_Mid;
+            }
+
+            if (pu16_Path)
+            {
+                pu16_Path[h] = u16_Page;
+                pu8_Slots[h] = s32_Low;
+            }
+            u16_Page = k_Inner.u16_Children[s32_Low];
+        }
+        return u16_Page;
+    }
+
+    int LeafLowerBound(kLeafPage *pk_Leaf, uint64_t u64_ID)
+    {
+        int s32_Low = 0;
+        int s32_High = pk_Leaf->u8_Count;
+        while (s32_Low < s32_High)
+        {
+            int s32_Mid = (s32_Low + s32_High) / 2;
+            if (pk_Leaf->k_Entries[s32_Mid].u64_ID < u64_ID)
+                s32_Low = s32_Mid + 1;
+            else
+                s32_High = s32_Mid;
+        }
+        return s32_Low;
+    }
+
+    void InsertIntoLeaf(kLeafPage *pk_Leaf, int s32_Pos, kUserHot *pk_Hot)
+    {
+        memmove(&pk_Leaf->k_Entries[s32_Pos + 1], &pk_Leaf->k_Entries[s32_Pos], (pk_Leaf->u8_Count - s32_Pos) * sizeof(kUserHot));
+        pk_Leaf->k_Entries[s32_Pos] = *pk_Hot;
+        pk_Leaf->u8_Count++;
+    }
+
+    // Inserts the separator u64_Key and the new right page u16_Right into the inner page at level s32_Level - 1.
+    // Splits full inner pages up to the root. If the root splits the tree grows by one level.
+    void InsertIntoParent(uint16_t *pu16_Path, byte *pu8_Slots, int s32_Level, uint64_t u64_Key, uint16_t u16_Right)
+    {
+        while (s32_Level > 0)
+        {
+            s32_Level--;
+            uint16_t u16_Page = pu16_Path[s32_Level];
+            int s32_Slot = pu8_Slots[s32_Level];
+
+            kInnerPage k_Inner;
+            ReadPage(u16_Page, &k_Inner, sizeof(k_Inner));
+
+            uint64_t u64_Keys[STORE_INNER_KEYS + 1];
+            uint16_t u16_Children[STORE_INNER_KEYS + 2];
+            int s32_Count = k_Inner.u8_Count;
+            memcpy(u64_Keys, k_Inner.u64_Keys, s32_Count * sizeof(uint64_t));
+            memcpy(u16_Children, k_Inner.u16_Children, (s32_Count + 1) * sizeof(uint16_t));
+            memmove(&u64_Keys[s32_Slot + 1], &u64_Keys[s32_Slot], (s32_Count - s32_Slot) * sizeof(uint64_t));
+            memmove(&u16_Children[s32_Slot + 2], &u16_Children[s32_Slot + 1], (s32_Count - s32_Slot) * sizeof(uint16_t));
+            u64_Keys[s32_Slot] = u64_Key;
+            u16_Children[s32_Slot + 1] = u16_Right;
+            s32_Count++;
+
+            if (s32_Count <= STORE_INNER_KEYS)
+            {
+                k_Inner.u8_Count = s32_Count;
+                memcpy(k_Inner.u64_Keys, u64_Keys, s32_Count * sizeof(uint64_t));
+                memcpy(k_Inner.u16_Children, u16_Children, (s32_Count + 1) * sizeof(uint16_t));
+                WritePage(u16_Page, &k_Inner, sizeof(k_Inner));
+                return;
+            }
+
+            // Split: The middle key moves up, the keys left of it stay, the keys right of it move to a new page.
+            int s32_Mid = s32_Count / 2;
+            kInnerPage k_Right;
+            memset(&k_Right, 0, sizeof(k_Right));
+            k_Right.u8_Type = PAGE_INNER;
+            k_Right.u8_Count = s32_Count - s32_Mid - 1;
+            memcpy(k_Right.u64_Keys, &u64_Keys[s32_Mid + 1], k_Right.u8_Count * sizeof(uint64_t));
+            memcpy(k_Right.u16_Children, &u16_Children[s32_Mid + 1], (k_Right.u8_Count + 1) * sizeof(uint16_t));
+
+            k_Inner.u8_Count = s32_Mid;
+            memcpy(k_Inner.u64_Keys, u64_Keys, s32_Mid * sizeof(uint64_t));
+            memcpy(k_Inner.u16_Children, u16_Children, (s32_Mid + 1) * sizeof(uint16_t));
+
+            u16_Right = AllocPage();
+            u64_Key = u64_Keys[s32_Mid];
+            WritePage(u16_Page, &k_Inner, sizeof(k_Inner));
+            WritePage(u16_Right, &k_Right, sizeof(k_Right));
+        }
+
+        // The root has been split -> new root
+        kInnerPage k_Root;
+        memset(&k_Root, 0, sizeof(k_Root));
+        k_Root.u8_Type = PAGE_INNER;
+        k_Root.u8_Count = 1;
+        k_Root.u64_Keys[0] = u64_Key;
+        k_Root.u16_Children[0] = mk_Header.u16_Root;
+        k_Root.u16_Children[1] = u16_Right;
+
+        mk_Header.u16_Root = AllocPage();
+        mk_Header.u8_Height++;
+        WritePage(mk_Header.u16_Root, &k_Root, sizeof(k_Root));
+    }
+};
+
+#endif // USERSTORE_H
@@ -5,9 +5,22 @@
 #include "EEPROM.h"
 #include <ESP8266WiFi.h>
 #include "DoorOpener.h"
+#include "AccessEvents.h"
+#include "UserCommands.h"
+#include "UserBackup.h"
+#include "RestApi.h"
+#include "Metrics.h"
 
 void wifiConnected();
 void configSaved();
+void accessEvent(const kAccessEvent *event);
+void publishAccessEvents();
+void mqttMessage(eMqttTopic topic, char *payload, int length);
+void handleExport();
+void continueExport();
+void endExport();
+void handleImport();
+void handleImportUpload();
 
 DNSServer dnsServer;
 WebServer server(80);
@@ -30,6 +43,12 @@ boolean needReset = false;
 boolean connected = false;
 
 DoorOpener doorOpener;
+AccessEventBatch accessEvents;
+UserImport *userImport = NULL; // only allocated while an import is uploaded
+UserExport *userExport = NULL; // only allocated while an export is downloaded
+WiFiClient exportClient;
+RestApi restApi;
+Metrics metrics;
 
 void setup()
 {
@@ -65,12 +84,18 @@ void setup()
 	{
 		// Setup MQTT publisher
 		mqttClient.setup(mqttConfig);
+		mqttClient.setMessageCallback(&mqttMessage);
 
 		// Setup door opener
+		doorOpener.SetAccessCallback(&accessEvent);
 		doorOpener.setup();
 	}
 
 	server.on("/", [] { iotWebConf.handleConfig(); });
+	server.on("/users/export", HTTP_GET, handleExport);
+	server.on("/users/import", HTTP_POST, handleImport, handleImportUpload);
+	restApi.setup(&server, &doorOpener);
+	metrics.setup(&server, &doorOpener, &mqttClient);
 	server.onNotFound([]() { iotWebConf.handleNotFound(); });
 
 	DEBUG("Setup done.");
@@ -83,6 +108,8 @@ void loop()
 	yield();
 
 	doorOpener.loop();
+	publishAccessEvents();
+	continueExport();
 	yield();
 
 	if (needReset)
@@ -112,4 +139,193 @@ void wifiConnected()
 	DEBUG("WiFi connection established.");
 	connected = true;
 	mqttClient.connect();
-}
\ No newline at end of file
+}
+
+void accessEvent(const kAccessEvent *event)
+{
+	accessEvents.Add(event);
+}
+
+void publishAccessEvents()
+{
+	if (!accessEvents.IsDue(millis()))
+	{
+		return;
+	}
+
+	// The batch is formatted directly into the MQTT queue
+	char *payload = mqttClient.reserve(MQTT_TOPIC_EVENTS);
+	if (payload == NULL)
+	{
+		accessEvents.Clear();
+		return;
+	}
+	if (accessEvents.Format(payload, MQTT_PAYLOAD_SIZE) > 0)
+	{
+		mqttClient.commit();
+	}
+}
+
+void mqttMessage(eMqttTopic topic, char *payload, int length)
+{
+	if (topic != MQTT_TOPIC_USERS)
+	{
+		return;
+	}
+
+	char *result = mqttClient.reserve(MQTT_TOPIC_USERS_RESULT);
+	if (result == NULL)
+	{
+		return;
+	}
+	UserCommands::Execute(payload, length, result, MQTT_PAYLOAD_SIZE);
+	mqttClient.commit();
+}
+
+// Starts to stream the user database as a backup file (see UserBackup.h) with chunked transfer encoding.
+// The handler only sends the HTTP header. The data follows in pieces of EXPORT_CHUNK_SIZE bytes from loop()
+// (continueExport()), so the door keeps working while 10000 users (approx. 730 KB) are downloaded.
+void handleExport()
+{
+	// The user backup contains the data the card keys are derived from, so it requires the terminal password
+	if (!restApi.authenticate())
+	{
+		return;
+	}
+	if (userExport != NULL)
+	{
+		server.send(503, "text/plain", "Another export is running.\n");
+		return;
+	}
+	// InstallImport() replaces the database without a commit, so IsOutdated() would not stop the export
+	if (userImport != NULL)
+	{
+		server.send(503, "text/plain", "An import is running.\n");
+		return;
+	}
+
+	DEBUG("Exporting %u users.", UserManager::GetUserCount());
+	userExport = new UserExport();
+	userExport->Begin();
+
+	// The web server forgets the connection after the handler, the copy keeps it open
+	exportClient = server.client();
+	exportClient.print("HTTP/1.1 200 OK\r\n"
+					   "Content-Type: application/octet-stream\r\n"
+					   "Content-Disposition: attachment; filename=users.bak\r\n"
+					   "Transfer-Encoding: chunked\r\n"
+					   "Connection: close\r\n\r\n");
+}
+
+// Sends the next chunk of a running export. Only writes as much as the TCP buffer accepts, so it never blocks.
+// If the users are modified during the export, the connection is closed without the last chunk,
+// so the client sees an incomplete download instead of an inconsistent backup.
+void continueExport()
+{
+	if (userExport == NULL)
+	{
+		return;
+	}
+	if (!exportClient.connected())
+	{
+		DEBUG("The export has been aborted by the client.");
+		endExport();
+		return;
+	}
+	if (exportClient.availableForWrite() < EXPORT_CHUNK_SIZE + 16)
+	{
+		return;
+	}
+
+	static byte buffer[EXPORT_CHUNK_SIZE];
+	uint32_t length = userExport->Read(buffer, sizeof(buffer));
+	if (userExport->IsOutdated())
+	{
+		DEBUG("The users have been modified, the export is aborted.");
+		endExport();
+		return;
+	}
+
+	char size[12];
+	snprintf(size, sizeof(size), "%X\r\n", length);
+	exportClient.print(size);
+	if (length == 0)
+	{
+		// The last chunk
+		exportClient.print("\r\n");
+		endExport();
+		return;
+	}
+	exportClient.write(buffer, length);
+	exportClient.print("\r\n");
+}
+
+void endExport()
+{
+	exportClient.stop();
+	delete userExport;
+	userExport = NULL;
+}
+
+// Receives the backup file of a multipart upload (e.g. curl -u admin:<password> -F file=@users.bak http://<ip>/users/import)
+// chunk by chunk. The users are only replaced when the complete file is valid.
+void handleImportUpload()
+{
+	HTTPUpload &upload = server.upload();
+	switch (upload.status)
+	{
+	case UPLOAD_FILE_START:
+		// The import replaces the user store, which would corrupt a running export
+		if (userImport == NULL && userExport == NULL && (PASSWORD[0] == 0 || server.authenticate(IOTWEBCONF_ADMIN_USER_NAME, PASSWORD)))
+		{
+			DEBUG("Importing users from %s.", upload.filename.c_str());
+			userImport = new UserImport();
+			userImport->Begin();
+		}
+		break;
+	case UPLOAD_FILE_WRITE:
+		if (userImport != NULL)
+		{
+			userImport->Write(upload.buf, upload.currentSize);
+		}
+		break;
+	case UPLOAD_FILE_ABORTED:
+		if (userImport != NULL)
+		{
+			userImport->Abort();
+			delete userImport;
+			userImport = NULL;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void handleImport()
+{
+	if (!restApi.authenticate())
+	{
+		return;
+	}
+	if (userImport == NULL)
+	{
+		server.send(400, "text/plain", "No backup file uploaded.\n");
+		return;
+	}
+
+	char message[80];
+	if (userImport->End())
+	{
+		snprintf(message, sizeof(message), "Imported %u users.\n", userImport->GetRecordCount());
+		server.send(200, "text/plain", message);
+	}
+	else
+	{
+		snprintf(message, sizeof(message), "Import failed: %s. The users have not been changed.\n", userImport->GetError());
+		userImport->Abort();
+		server.send(400, "text/plain", message);
+	}
+	delete userImport;
+	userImport = NULL;
+}
@@ -0,0 +1,125 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// A minimal stand-in for the Arduino core, so the firmware classes can be compiled on the host ([env:native]).
+// Only what DoorOpener, UserManager and their dependencies use is provided.
+// delay() does not sleep but advances a simulated clock, so the latency of the simulated PN532 (see Desfire.h)
+// is added to millis() and micros() without slowing down the benchmarks.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+
+// The pins of the D1 mini
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define LED_BUILTIN D4
+
+#define NATIVE_PIN_COUNT 17
+
+// The level of each output pin and the time (micros()) of the last change
+byte nativePinLevel[NATIVE_PIN_COUNT];
+uint32_t nativePinChanged[NATIVE_PIN_COUNT];
+
+// Microseconds added to the real time by delay()
+uint64_t nativeClockOffset = 0;
+
+inline uint64_t NativeMicros64()
+{
+    static std::chrono::steady_clock::time_point k_Start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - k_Start).count() +
+           nativeClockOffset;
+}
+
+inline unsigned long millis()
+{
+    return (unsigned long)(NativeMicros64() / 1000);
+}
+
+inline unsigned long micros()
+{
+    return (unsigned long)NativeMicros64();
+}
+
+inline void delayMicroseconds(unsigned int u32_Micros)
+{
+    nativeClockOffset += u32_Micros;
+}
+
+inline void delay(unsigned long u32_Millis)
+{
+    nativeClockOffset += (uint64_t)u32_Millis * 1000;
+}
+
+inline void yield()
+{
+}
+
+inline void pinMode(uint8_t u8_Pin, uint8_t u8_Mode)
+{
+}
+
+inline void digitalWrite(uint8_t u8_Pin, uint8_t u8_Level)
+{
+    if (u8_Pin >= NATIVE_PIN_COUNT || nativePinLevel[u8_Pin] == u8_Level)
+        return;
+
+    nativePinLevel[u8_Pin] = u8_Level;
+    nativePinChanged[u8_Pin] = micros();
+}
+
+inline void tone(uint8_t u8_Pin, unsigned int u16_Frequency, unsigned long u32_Duration = 0)
+{
+}
+
+inline void noTone(uint8_t u8_Pin)
+{
+}
+
+// The heap of a D1 mini with WiFi, the web server and MQTT running.
+// A test can lower it to check how the firmware behaves when the heap is exhausted.
+uint32_t nativeFreeHeap = 40000;
+
+class EspClass
+{
+public:
+    uint32_t getFreeHeap()
+    {
+        return nativeFreeHeap;
+    }
+
+    uint32_t getMaxFreeBlockSize()
+    {
+        return nativeFreeHeap;
+    }
+
+    uint32_t getChipId()
+    {
+        return 0x00D00126;
+    }
+};
+
+EspClass ESP;
+
+#endif // NATIVE_ARDUINO_H
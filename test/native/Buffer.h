@@ -0,0 +1,6 @@
+#ifndef NATIVE_BUFFER_H
+#define NATIVE_BUFFER_H
+
+// Stand-in for the Buffer.h of the desfire_rfid library. The buffer classes are only used inside the library.
+
+#endif // NATIVE_BUFFER_H
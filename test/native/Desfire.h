@@ -0,0 +1,734 @@
+#ifndef NATIVE_DESFIRE_H
+#define NATIVE_DESFIRE_H
+
+// A simulated PN532 with DESFire cards in place of the Desfire class of the desfire_rfid library.
+// It has the same interface as far as DoorOpener and DoorReader use it, so DoorOpener runs unchanged on the host.
+//
+// The cards (SimulatedCard) keep their keys, applications and files like a real DESFire EV1 card:
+// a factory card has the 2K3DES zero key with version 0, a personalized card the keys written by AddCard(),
+// a random ID card reports a new 4 byte random UID each time the RF field is switched on.
+// desfireSim holds the card that is currently in the RF field, counts the PN532 commands and models the time
+// each frame needs on the bus by advancing the simulated clock (see delay() in Arduino.h).
+//
+// The keys are compared byte by byte and CryptDataCBC() is a simple deterministic mixing function, not DES.
+
+#include "Utils.h"
+
+#define SIM_MAX_APPLICATIONS 4
+#define SIM_MAX_FILE_SIZE 32
+
+// Bytes of a command frame besides the data: PN532 frame header + checksum in both directions and the ACK frame
+#define SIM_FRAME_BYTES 20
+
+// The time the PN532 waits for the answer of a card that has left the RF field
+#define SIM_CARD_TIMEOUT_US 50000
+
+// The time of the PN532 reset in begin()
+#define SIM_RESET_MS 400
+
+enum eCardType
+{
+    CARD_Unknown = 0,   // Mifare Classic or other card
+    CARD_Desfire = 1,   // A Desfire card with normal 7 byte UID  (bit 0)
+    CARD_DesRandom = 3, // A Desfire card with 4 byte random UID  (bit 0 + 1)
+};
+
+enum DESFireKeyType
+{
+    DF_KEY_INVALID = 0xFF,
+    DF_KEY_2K3DES = 0x00, // for DFEV1_INS_AUTHENTICATE_ISO + DFEV1_INS_AUTHENTICATE_LEGACY
+    DF_KEY_3K3DES = 0x40, // for DFEV1_INS_AUTHENTICATE_ISO
+    DF_KEY_AES = 0x80,    // for DFEV1_INS_AUTHENTICATE_AES
+};
+
+enum DESFireCBC
+{
+    CBC_SEND,
+    CBC_RECEIVE,
+};
+
+enum DESFireCipher
+{
+    KEY_ENCIPHER,
+    KEY_DECIPHER,
+};
+
+enum DESFireKeySettings
+{
+    KS_ALLOW_CHANGE_MK = 0x01,
+    KS_LISTING_WITHOUT_MK = 0x02,
+    KS_CREATE_DELETE_WITHOUT_MK = 0x04,
+    KS_CONFIGURATION_CHANGEABLE = 0x08,
+    KS_CHANGE_KEY_WITH_MK = 0x00,
+    KS_CHANGE_KEY_FROZEN = 0xF0,
+    KS_FACTORY_DEFAULT = 0x0F,
+};
+
+enum DESFireAccessRights
+{
+    AR_KEY0 = 0x00,
+    AR_FREE = 0x0E,
+    AR_NEVER = 0x0F,
+};
+
+struct DESFireFilePermissions
+{
+    DESFireAccessRights e_ReadAccess;
+    DESFireAccessRights e_WriteAccess;
+    DESFireAccessRights e_ReadAndWriteAccess;
+    DESFireAccessRights e_ChangeAccess;
+};
+
+class DESFireKey
+{
+public:
+    DESFireKey()
+    {
+        memset(mu8_Key, 0, sizeof(mu8_Key));
+        mu8_KeySize = 0;
+        mu8_Version = 0;
+        me_KeyType = DF_KEY_INVALID;
+    }
+
+    DESFireKeyType GetKeyType()
+    {
+        return me_KeyType;
+    }
+
+    byte GetKeyVersion()
+    {
+        return mu8_Version;
+    }
+
+    virtual bool SetKeyData(const byte *u8_Key, int s32_KeySize, byte u8_Version)
+    {
+        return false;
+    }
+
+    // The key as stored on the card
+    bool IsSameKey(const DESFireKey *pi_Key)
+    {
+        return me_KeyType == pi_Key->me_KeyType && mu8_KeySize == pi_Key->mu8_KeySize &&
+               memcmp(mu8_Key, pi_Key->mu8_Key, mu8_KeySize) == 0;
+    }
+
+protected:
+    byte mu8_Key[24];
+    byte mu8_KeySize;
+    byte mu8_Version;
+    DESFireKeyType me_KeyType;
+};
+
+class DES : public DESFireKey
+{
+public:
+    // 8 byte keys are treated like 2K3DES keys with two identical halves
+    bool SetKeyData(const byte *u8_Key, int s32_KeySize, byte u8_Version)
+    {
+        if (s32_KeySize != 8 && s32_KeySize != 16 && s32_KeySize != 24)
+            return false;
+
+        memcpy(mu8_Key, u8_Key, s32_KeySize);
+        if (s32_KeySize == 8)
+            memcpy(mu8_Key + 8, u8_Key, 8);
+
+        mu8_KeySize = s32_KeySize == 24 ? 24 : 16;
+        mu8_Version = u8_Version;
+        me_KeyType = s32_KeySize == 24 ? DF_KEY_3K3DES : DF_KEY_2K3DES;
+        return true;
+    }
+
+    // Deterministic, so the derived card secrets are the same for each tap. This is NOT a cipher.
+    bool CryptDataCBC(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte *u8_Out, const byte *u8_In, int s32_ByteCount)
+    {
+        if (mu8_KeySize == 0 || (s32_ByteCount % 8) != 0)
+            return false;
+
+        byte u8_Chain = 0x5A;
+        for (int i = 0; i < s32_ByteCount; i++)
+        {
+            u8_Chain = (byte)((u8_In[i] ^ mu8_Key[i % mu8_KeySize]) + u8_Chain * 31 + i);
+            u8_Out[i] = u8_Chain;
+        }
+        return true;
+    }
+};
+
+class AES : public DESFireKey
+{
+public:
+    // Only the first 16 bytes of a longer key are used
+    bool SetKeyData(const byte *u8_Key, int s32_KeySize, byte u8_Version)
+    {
+        if (s32_KeySize < 16)
+            return false;
+
+        memcpy(mu8_Key, u8_Key, 16);
+        mu8_KeySize = 16;
+        mu8_Version = u8_Version;
+        me_KeyType = DF_KEY_AES;
+        return true;
+    }
+};
+
+struct kSimApplication
+{
+    uint32_t u32_ID;
+    DESFireKey k_Key; // key 0 (the application master key)
+    byte u8_KeySettings;
+    bool b_HasFile;
+    byte u8_FileID;
+    byte u8_FileSize;
+    byte u8_FileData[SIM_MAX_FILE_SIZE];
+};
+
+// A card as it leaves the factory. The state changes with the commands that DoorOpener sends.
+class SimulatedCard
+{
+public:
+    // b_Desfire = false -> a Mifare Classic card with 4 byte UID
+    SimulatedCard(uint64_t u64_UID, bool b_Desfire)
+    {
+        memcpy(mu8_UID, &u64_UID, 7);
+        mb_Desfire = b_Desfire;
+        mb_RandomID = false;
+        mu32_Applications = 0;
+
+        // The factory default PICC master key
+        byte u8_Zero[16] = {0};
+        DES i_Default;
+        i_Default.SetKeyData(u8_Zero, 16, 0);
+        mk_PiccKey = i_Default;
+    }
+
+    uint64_t GetUID()
+    {
+        uint64_t u64_UID = 0;
+        memcpy(&u64_UID, mu8_UID, mb_Desfire ? 7 : 4);
+        return u64_UID;
+    }
+
+    bool IsDesfire()
+    {
+        return mb_Desfire;
+    }
+
+    bool IsRandomID()
+    {
+        return mb_RandomID;
+    }
+
+    // 0 = factory default key
+    byte GetPiccKeyVersion()
+    {
+        return mk_PiccKey.GetKeyVersion();
+    }
+
+    uint32_t GetApplicationCount()
+    {
+        return mu32_Applications;
+    }
+
+private:
+    friend class DesfireSimulator;
+    friend class Desfire;
+
+    byte mu8_UID[7];
+    bool mb_Desfire;
+    bool mb_RandomID;
+    DESFireKey mk_PiccKey;
+    kSimApplication mk_Applications[SIM_MAX_APPLICATIONS];
+    uint32_t mu32_Applications;
+
+    kSimApplication *FindApplication(uint32_t u32_ID)
+    {
+        for (uint32_t i = 0; i < mu32_Applications; i++)
+        {
+            if (mk_Applications[i].u32_ID == u32_ID)
+                return &mk_Applications[i];
+        }
+        return NULL;
+    }
+
+    void DeleteApplication(kSimApplication *pk_App)
+    {
+        *pk_App = mk_Applications[--mu32_Applications];
+    }
+};
+
+// Returns the time in microseconds that a frame with u32_Bytes bytes needs on the bus, see ReaderTransport::GetFrameMicros()
+typedef uint32_t (*SimFrameLatency)(uint32_t u32_Bytes);
+
+// The PN532 and its RF field
+class DesfireSimulator
+{
+public:
+    DesfireSimulator()
+    {
+        mpk_Card = NULL;
+        mf_FrameLatency = NULL;
+        mb_FieldOn = false;
+        mu32_TimeoutAt = 0;
+        mu32_Timeouts = 0;
+        mu8_LastError = 0;
+        ResetSession();
+        ResetStats();
+    }
+
+    // Puts a card into the RF field (NULL = no card)
+    void PlaceCard(SimulatedCard *pk_Card)
+    {
+        mpk_Card = pk_Card;
+        ResetSession();
+    }
+
+    void RemoveCard()
+    {
+        PlaceCard(NULL);
+    }
+
+    void SetFrameLatency(SimFrameLatency f_Latency)
+    {
+        mf_FrameLatency = f_Latency;
+    }
+
+    // The u32_Command'th card command from now on (1 = the next one) fails with a timeout (GetLastPN532Error() == 0x01)
+    void InjectTimeout(uint32_t u32_Command)
+    {
+        mu32_TimeoutAt = mu32_CardCommands + u32_Command;
+    }
+
+    void ResetStats()
+    {
+        mu32_Frames = 0;
+        mu32_CardCommands = 0;
+        mu64_BusMicros = 0;
+    }
+
+    // All frames sent to the PN532 (including RF field and configuration commands)
+    uint32_t GetFrameCount()
+    {
+        return mu32_Frames;
+    }
+
+    // The commands exchanged with a card
+    uint32_t GetCardCommandCount()
+    {
+        return mu32_CardCommands;
+    }
+
+    uint32_t GetTimeoutCount()
+    {
+        return mu32_Timeouts;
+    }
+
+    // The simulated time spent on the bus
+    uint64_t GetBusMicros()
+    {
+        return mu64_BusMicros;
+    }
+
+private:
+    friend class Desfire;
+
+    SimulatedCard *mpk_Card;
+    SimFrameLatency mf_FrameLatency;
+    bool mb_FieldOn;
+    byte mu8_RandomUID[4];
+    uint32_t mu32_Selected;  // The selected application, 0 = PICC level
+    bool mb_Authenticated;   // with key 0 of the selected application
+    byte mu8_LastError;
+    uint32_t mu32_TimeoutAt; // mu32_CardCommands value of the injected timeout, 0 = none
+    uint32_t mu32_Timeouts;
+    uint32_t mu32_Frames;
+    uint32_t mu32_CardCommands;
+    uint64_t mu64_BusMicros;
+
+    // A card loses its state when it leaves the RF field or the field is switched off
+    void ResetSession()
+    {
+        mu32_Selected = 0;
+        mb_Authenticated = false;
+        Utils::GenerateRandom(mu8_RandomUID, 4);
+        mu8_RandomUID[0] = 0x08; // random UIDs start with 0x08 (ISO 14443-3)
+    }
+
+    void Frame(uint32_t u32_Send, uint32_t u32_Receive)
+    {
+        mu32_Frames++;
+        if (!mf_FrameLatency)
+            return;
+
+        uint32_t u32_Micros = mf_FrameLatency(u32_Send + u32_Receive + SIM_FRAME_BYTES);
+        mu64_BusMicros += u32_Micros;
+        delayMicroseconds(u32_Micros);
+    }
+
+    // Sends a command to the card. Returns false with error 0x01 if the card does not answer.
+    bool CardCommand(uint32_t u32_Send, uint32_t u32_Receive)
+    {
+        Frame(u32_Send, u32_Receive);
+        mu32_CardCommands++;
+        mu8_LastError = 0;
+
+        if (mpk_Card == NULL || !mb_FieldOn || !mpk_Card->mb_Desfire || mu32_CardCommands == mu32_TimeoutAt)
+        {
+            if (mu32_CardCommands == mu32_TimeoutAt)
+                mu32_TimeoutAt = 0;
+
+            mu32_Timeouts++;
+            mu64_BusMicros += SIM_CARD_TIMEOUT_US;
+            delayMicroseconds(SIM_CARD_TIMEOUT_US);
+            mu8_LastError = 0x01;
+            mb_Authenticated = false;
+            return false;
+        }
+        return true;
+    }
+
+    // The card has answered with an error status (the PN532 itself has no error)
+    bool CardError()
+    {
+        mb_Authenticated = false;
+        return false;
+    }
+
+    DESFireKey *GetSelectedKey()
+    {
+        if (mu32_Selected == 0)
+            return &mpk_Card->mk_PiccKey;
+
+        kSimApplication *pk_App = mpk_Card->FindApplication(mu32_Selected);
+        return pk_App ? &pk_App->k_Key : NULL;
+    }
+};
+
+DesfireSimulator desfireSim;
+
+// The commands of the desfire_rfid library that DoorOpener uses
+class Desfire
+{
+public:
+    Desfire()
+    {
+        byte u8_Zero[24] = {0};
+        DES2_DEFAULT_KEY.SetKeyData(u8_Zero, 16, 0);
+        DES3_DEFAULT_KEY.SetKeyData(u8_Zero, 24, 0);
+        AES_DEFAULT_KEY.SetKeyData(u8_Zero, 16, 0);
+    }
+
+    DES DES2_DEFAULT_KEY;
+    DES DES3_DEFAULT_KEY;
+    AES AES_DEFAULT_KEY;
+
+    void InitSoftwareSPI(byte u8_Clk, byte u8_Miso, byte u8_Mosi, byte u8_Sel, byte u8_Reset)
+    {
+    }
+
+    void InitHardwareSPI(byte u8_Sel, byte u8_Reset)
+    {
+    }
+
+    void InitI2C(byte u8_Reset)
+    {
+    }
+
+    void begin()
+    {
+        delay(SIM_RESET_MS);
+        desfireSim.mb_FieldOn = false;
+        desfireSim.ResetSession();
+    }
+
+    void SetDebugLevel(byte u8_Level)
+    {
+    }
+
+    byte GetLastPN532Error()
+    {
+        return desfireSim.mu8_LastError;
+    }
+
+    bool GetFirmwareVersion(byte *pIcType, byte *pVersionHi, byte *pVersionLo, byte *pFlags)
+    {
+        desfireSim.Frame(1, 5);
+        *pIcType = 0x32;
+        *pVersionHi = 1;
+        *pVersionLo = 6;
+        *pFlags = 7;
+        return true;
+    }
+
+    bool SetPassiveActivationRetries()
+    {
+        desfireSim.Frame(5, 1);
+        return true;
+    }
+
+    bool SamConfig()
+    {
+        desfireSim.Frame(4, 1);
+        return true;
+    }
+
+    // If no card is present u8_UidLength = 0 is returned
+    bool ReadPassiveTargetID(byte *u8_UidBuffer, byte *pu8_UidLength, eCardType *pe_CardType)
+    {
+        desfireSim.Frame(3, 19);
+        if (!desfireSim.mb_FieldOn)
+        {
+            desfireSim.mb_FieldOn = true;
+            desfireSim.ResetSession();
+        }
+
+        desfireSim.mu8_LastError = 0;
+        desfireSim.mu32_Selected = 0;
+        desfireSim.mb_Authenticated = false;
+        *pu8_UidLength = 0;
+        *pe_CardType = CARD_Unknown;
+
+        SimulatedCard *pk_Card = desfireSim.mpk_Card;
+        if (pk_Card == NULL)
+            return true;
+
+        if (!pk_Card->mb_Desfire)
+        {
+            memcpy(u8_UidBuffer, pk_Card->mu8_UID, 4);
+            *pu8_UidLength = 4;
+        }
+        else if (pk_Card->mb_RandomID)
+        {
+            memcpy(u8_UidBuffer, desfireSim.mu8_RandomUID, 4);
+            *pu8_UidLength = 4;
+            *pe_CardType = CARD_DesRandom;
+        }
+        else
+        {
+            memcpy(u8_UidBuffer, pk_Card->mu8_UID, 7);
+            *pu8_UidLength = 7;
+            *pe_CardType = CARD_Desfire;
+        }
+        return true;
+    }
+
+    bool SwitchOffRfField()
+    {
+        desfireSim.Frame(3, 1);
+        desfireSim.mb_FieldOn = false;
+        desfireSim.ResetSession();
+        return true;
+    }
+
+    bool SelectApplication(uint32_t u32_AppID)
+    {
+        if (!desfireSim.CardCommand(4, 1))
+            return false;
+
+        if (u32_AppID != 0 && !desfireSim.mpk_Card->FindApplication(u32_AppID))
+            return desfireSim.CardError();
+
+        desfireSim.mu32_Selected = u32_AppID;
+        desfireSim.mb_Authenticated = false;
+        return true;
+    }
+
+    bool GetKeyVersion(byte u8_KeyNo, byte *pu8_Version)
+    {
+        if (!desfireSim.CardCommand(2, 2))
+            return false;
+
+        *pu8_Version = desfireSim.GetSelectedKey()->GetKeyVersion();
+        return true;
+    }
+
+    // Two frames: challenge and response
+    bool Authenticate(byte u8_KeyNo, DESFireKey *pi_Key)
+    {
+        if (!desfireSim.CardCommand(2, 17) || !desfireSim.CardCommand(33, 17))
+            return false;
+
+        if (!desfireSim.GetSelectedKey()->IsSameKey(pi_Key))
+            return desfireSim.CardError();
+
+        desfireSim.mb_Authenticated = true;
+        return true;
+    }
+
+    // Requires authentication with the PICC master key
+    bool GetRealCardID(byte u8_UID[7])
+    {
+        if (!desfireSim.CardCommand(1, 17))
+            return false;
+
+        if (desfireSim.mu32_Selected != 0 || !desfireSim.mb_Authenticated)
+            return desfireSim.CardError();
+
+        memcpy(u8_UID, desfireSim.mpk_Card->mu8_UID, 7);
+        return true;
+    }
+
+    bool ChangeKey(byte u8_KeyNo, DESFireKey *pi_NewKey, DESFireKey *pi_CurKey)
+    {
+        if (!desfireSim.CardCommand(42, 9))
+            return false;
+
+        if (!desfireSim.mb_Authenticated)
+            return desfireSim.CardError();
+
+        *desfireSim.GetSelectedKey() = *pi_NewKey;
+        desfireSim.mb_Authenticated = false; // a key change requires a new authentication
+        return true;
+    }
+
+    bool ChangeKeySettings(DESFireKeySettings e_NewSettings)
+    {
+        if (!desfireSim.CardCommand(10, 9))
+            return false;
+
+        if (!desfireSim.mb_Authenticated)
+            return desfireSim.CardError();
+
+        kSimApplication *pk_App = desfireSim.mpk_Card->FindApplication(desfireSim.mu32_Selected);
+        if (pk_App)
+            pk_App->u8_KeySettings = e_NewSettings;
+        return true;
+    }
+
+    bool CreateApplication(uint32_t u32_AppID, DESFireKeySettings e_Settings, byte u8_KeyCount, DESFireKeyType e_KeyType)
+    {
+        if (!desfireSim.CardCommand(6, 1))
+            return false;
+
+        SimulatedCard *pk_Card = desfireSim.mpk_Card;
+        if (desfireSim.mu32_Selected != 0 || !desfireSim.mb_Authenticated || pk_Card->FindApplication(u32_AppID) ||
+            pk_Card->mu32_Applications == SIM_MAX_APPLICATIONS)
+            return desfireSim.CardError();
+
+        kSimApplication *pk_App = &pk_Card->mk_Applications[pk_Card->mu32_Applications++];
+        *pk_App = kSimApplication();
+        pk_App->u32_ID = u32_AppID;
+        pk_App->u8_KeySettings = e_Settings;
+        if (e_KeyType == DF_KEY_AES)
+            pk_App->k_Key = AES_DEFAULT_KEY;
+        else if (e_KeyType == DF_KEY_3K3DES)
+            pk_App->k_Key = DES3_DEFAULT_KEY;
+        else
+            pk_App->k_Key = DES2_DEFAULT_KEY;
+        return true;
+    }
+
+    // GetApplicationIDs + DeleteApplication if the application exists
+    bool DeleteApplicationIfExists(uint32_t u32_AppID)
+    {
+        if (!desfireSim.CardCommand(1, 1 + 3 * SIM_MAX_APPLICATIONS))
+            return false;
+
+        kSimApplication *pk_App = desfireSim.mpk_Card->FindApplication(u32_AppID);
+        if (!pk_App)
+            return true;
+
+        if (!desfireSim.CardCommand(4, 1))
+            return false;
+
+        if (desfireSim.mu32_Selected != 0 || !desfireSim.mb_Authenticated)
+            return desfireSim.CardError();
+
+        desfireSim.mpk_Card->DeleteApplication(pk_App);
+        return true;
+    }
+
+    bool CreateStdDataFile(byte u8_FileID, DESFireFilePermissions *pk_Permis, int s32_FileSize)
+    {
+        if (!desfireSim.CardCommand(8, 1))
+            return false;
+
+        kSimApplication *pk_App = desfireSim.mpk_Card->FindApplication(desfireSim.mu32_Selected);
+        if (!pk_App || !desfireSim.mb_Authenticated || pk_App->b_HasFile || s32_FileSize > SIM_MAX_FILE_SIZE)
+            return desfireSim.CardError();
+
+        pk_App->b_HasFile = true;
+        pk_App->u8_FileID = u8_FileID;
+        pk_App->u8_FileSize = s32_FileSize;
+        memset(pk_App->u8_FileData, 0, SIM_MAX_FILE_SIZE);
+        return true;
+    }
+
+    bool ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte *u8_DataBuffer)
+    {
+        if (!desfireSim.CardCommand(8, 9 + s32_Length))
+            return false;
+
+        kSimApplication *pk_App = GetFile(u8_FileID, s32_Offset, s32_Length);
+        if (!pk_App)
+            return desfireSim.CardError();
+
+        memcpy(u8_DataBuffer, pk_App->u8_FileData + s32_Offset, s32_Length);
+        return true;
+    }
+
+    bool WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, const byte *u8_DataBuffer)
+    {
+        if (!desfireSim.CardCommand(8 + s32_Length, 9))
+            return false;
+
+        kSimApplication *pk_App = GetFile(u8_FileID, s32_Offset, s32_Length);
+        if (!pk_App)
+            return desfireSim.CardError();
+
+        memcpy(pk_App->u8_FileData + s32_Offset, u8_DataBuffer, s32_Length);
+        return true;
+    }
+
+    // Requires authentication with the PICC master key. This cannot be reversed.
+    bool EnableRandomIDForever()
+    {
+        if (!desfireSim.CardCommand(18, 9))
+            return false;
+
+        if (desfireSim.mu32_Selected != 0 || !desfireSim.mb_Authenticated)
+            return desfireSim.CardError();
+
+        desfireSim.mpk_Card->mb_RandomID = true;
+        return true;
+    }
+
+protected:
+    byte mu8_PacketBuffer[64];
+
+    // The raw PN532 commands of DoorReader (Diagnose and RFConfiguration)
+    bool SendCommandCheckAck(byte *cmd, byte cmdlen)
+    {
+        desfireSim.Frame(cmdlen, 3);
+        mu8_Response[0] = 0xD5;
+        mu8_Response[1] = cmd[0] + 1;
+        mu8_Response[2] = 0x00;
+
+        // Diagnose test 6: card presence detection, status 0x01 = the card does not answer
+        if (cmd[0] == 0x00 && (!desfireSim.mpk_Card || !desfireSim.mb_FieldOn))
+            mu8_Response[2] = 0x01;
+        return true;
+    }
+
+    byte ReadData(byte *buff, byte len)
+    {
+        byte u8_Len = min(len, (byte)sizeof(mu8_Response));
+        memcpy(buff, mu8_Response, u8_Len);
+        return u8_Len;
+    }
+
+private:
+    byte mu8_Response[3];
+
+    // Requires authentication with the application master key
+    kSimApplication *GetFile(byte u8_FileID, int s32_Offset, int s32_Length)
+    {
+        kSimApplication *pk_App = desfireSim.mpk_Card->FindApplication(desfireSim.mu32_Selected);
+        if (!pk_App || !desfireSim.mb_Authenticated || !pk_App->b_HasFile || pk_App->u8_FileID != u8_FileID ||
+            s32_Offset + s32_Length > pk_App->u8_FileSize)
+            return NULL;
+
+        return pk_App;
+    }
+};
+
+#endif // NATIVE_DESFIRE_H
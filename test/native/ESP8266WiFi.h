@@ -0,0 +1,50 @@
+#ifndef NATIVE_ESP8266WIFI_H
+#define NATIVE_ESP8266WIFI_H
+
+// Stand-in for the WiFi classes of the ESP8266 core. There is no network: a name always resolves
+// and the connection to the broker is simulated by the MQTTClient stand-in (see MQTT.h).
+
+#include "Arduino.h"
+
+class IPAddress
+{
+public:
+    IPAddress() : mu32_Address(0)
+    {
+    }
+
+    IPAddress(uint8_t u8_A, uint8_t u8_B, uint8_t u8_C, uint8_t u8_D)
+        : mu32_Address(u8_A | (u8_B << 8) | (u8_C << 16) | ((uint32_t)u8_D << 24))
+    {
+    }
+
+    operator uint32_t() const
+    {
+        return mu32_Address;
+    }
+
+private:
+    uint32_t mu32_Address;
+};
+
+class WiFiClient
+{
+public:
+    void setTimeout(unsigned long u32_Timeout)
+    {
+    }
+};
+
+class WiFiClass
+{
+public:
+    int hostByName(const char *s8_Host, IPAddress &k_Result, uint32_t u32_Timeout)
+    {
+        k_Result = IPAddress(192, 168, 0, 1);
+        return 1;
+    }
+};
+
+WiFiClass WiFi;
+
+#endif // NATIVE_ESP8266WIFI_H
@@ -0,0 +1,162 @@
+#ifndef NATIVE_FS_H
+#define NATIVE_FS_H
+
+// A file-backed stand-in for SPIFFS: the file "/users.db" is stored as NATIVE_FS_ROOT "/users.db" on the host.
+// Every access is counted in nativeFileStats, so a benchmark can report the I/O that an operation causes.
+
+#include "Arduino.h"
+#include <string>
+#include <sys/stat.h>
+
+#ifndef NATIVE_FS_ROOT
+#define NATIVE_FS_ROOT ".pio/native_fs"
+#endif
+
+enum SeekMode
+{
+    SeekSet = SEEK_SET,
+    SeekCur = SEEK_CUR,
+    SeekEnd = SEEK_END,
+};
+
+struct kNativeFileStats
+{
+    uint32_t u32_Reads;
+    uint32_t u32_ReadBytes;
+    uint32_t u32_Writes;
+    uint32_t u32_WriteBytes;
+    uint32_t u32_Seeks;
+    uint32_t u32_Flushes;
+    uint32_t u32_Opens;
+};
+
+kNativeFileStats nativeFileStats;
+
+class File
+{
+public:
+    File(FILE *pf_File = NULL)
+    {
+        mpf_File = pf_File;
+    }
+
+    bool seek(uint32_t u32_Pos, SeekMode e_Mode)
+    {
+        nativeFileStats.u32_Seeks++;
+        return mpf_File && fseek(mpf_File, u32_Pos, e_Mode) == 0;
+    }
+
+    size_t read(byte *pu8_Data, size_t u32_Length)
+    {
+        if (!mpf_File)
+            return 0;
+
+        size_t u32_Read = fread(pu8_Data, 1, u32_Length, mpf_File);
+        nativeFileStats.u32_Reads++;
+        nativeFileStats.u32_ReadBytes += u32_Read;
+        return u32_Read;
+    }
+
+    size_t write(const byte *pu8_Data, size_t u32_Length)
+    {
+        if (!mpf_File)
+            return 0;
+
+        size_t u32_Written = fwrite(pu8_Data, 1, u32_Length, mpf_File);
+        nativeFileStats.u32_Writes++;
+        nativeFileStats.u32_WriteBytes += u32_Written;
+        return u32_Written;
+    }
+
+    void flush()
+    {
+        if (!mpf_File)
+            return;
+
+        fflush(mpf_File);
+        nativeFileStats.u32_Flushes++;
+    }
+
+    size_t position()
+    {
+        return mpf_File ? ftell(mpf_File) : 0;
+    }
+
+    size_t size()
+    {
+        if (!mpf_File)
+            return 0;
+
+        long s32_Pos = ftell(mpf_File);
+        fseek(mpf_File, 0, SEEK_END);
+        long s32_Size = ftell(mpf_File);
+        fseek(mpf_File, s32_Pos, SEEK_SET);
+        return s32_Size;
+    }
+
+    void close()
+    {
+        if (mpf_File)
+            fclose(mpf_File);
+        mpf_File = NULL;
+    }
+
+    operator bool() const
+    {
+        return mpf_File != NULL;
+    }
+
+private:
+    FILE *mpf_File;
+};
+
+class NativeFS
+{
+public:
+    bool begin()
+    {
+        // Creates the parent directory too, so the default root works in a fresh checkout
+        std::string s_Path = NATIVE_FS_ROOT;
+        for (size_t i = 1; i <= s_Path.size(); i++)
+        {
+            if (i == s_Path.size() || s_Path[i] == '/')
+                mkdir(s_Path.substr(0, i).c_str(), 0777);
+        }
+        return true;
+    }
+
+    bool exists(const char *s8_Path)
+    {
+        struct stat k_Stat;
+        return stat(GetPath(s8_Path).c_str(), &k_Stat) == 0;
+    }
+
+    // Supports the modes "r", "r+", "w", "w+", "a" and "a+" of SPIFFS
+    File open(const char *s8_Path, const char *s8_Mode)
+    {
+        std::string s_Mode = s8_Mode;
+        s_Mode += "b";
+        nativeFileStats.u32_Opens++;
+        return File(fopen(GetPath(s8_Path).c_str(), s_Mode.c_str()));
+    }
+
+    bool remove(const char *s8_Path)
+    {
+        return ::remove(GetPath(s8_Path).c_str()) == 0;
+    }
+
+    bool rename(const char *s8_From, const char *s8_To)
+    {
+        return ::rename(GetPath(s8_From).c_str(), GetPath(s8_To).c_str()) == 0;
+    }
+
+private:
+    std::string GetPath(const char *s8_Path)
+    {
+        return std::string(NATIVE_FS_ROOT) + s8_Path;
+    }
+};
+
+NativeFS SPIFFS;
+
+#endif // NATIVE_FS_H
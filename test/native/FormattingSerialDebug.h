@@ -0,0 +1,11 @@
+#ifndef NATIVE_FORMATTINGSERIALDEBUG_H
+#define NATIVE_FORMATTINGSERIALDEBUG_H
+
+// Stand-in for the MicroDebug library: the debug output is discarded on the host
+#define DEBUG(...) \
+    do             \
+    {              \
+    } while (0)
+#define SERIAL_DEBUG_SETUP(baud)
+
+#endif // NATIVE_FORMATTINGSERIALDEBUG_H
@@ -0,0 +1,77 @@
+#ifndef NATIVE_MQTT_H
+#define NATIVE_MQTT_H
+
+// Stand-in for the MQTT library (arduino-mqtt). There is no broker: nativeMqttBrokerUp decides whether
+// connect() succeeds, a published message is only counted and the last one is kept.
+
+#include "ESP8266WiFi.h"
+
+bool nativeMqttBrokerUp = true;
+uint32_t nativeMqttPublished = 0;
+char nativeMqttLastTopic[200];
+char nativeMqttLastPayload[600];
+
+class MQTTClient;
+typedef void (*MQTTClientCallbackAdvanced)(MQTTClient *client, char topic[], char bytes[], int length);
+
+class MQTTClient
+{
+public:
+    explicit MQTTClient(int s32_BufferSize)
+    {
+    }
+
+    void begin(const char *s8_Host, int s32_Port, WiFiClient &i_Client)
+    {
+    }
+
+    void setHost(IPAddress k_Address, int s32_Port)
+    {
+    }
+
+    void setOptions(int s32_KeepAlive, bool b_CleanSession, int s32_Timeout)
+    {
+    }
+
+    void onMessageAdvanced(MQTTClientCallbackAdvanced f_Callback)
+    {
+    }
+
+    bool connect(const char *s8_ClientID, const char *s8_User, const char *s8_Password)
+    {
+        mb_Connected = nativeMqttBrokerUp;
+        return mb_Connected;
+    }
+
+    bool connected()
+    {
+        mb_Connected = mb_Connected && nativeMqttBrokerUp;
+        return mb_Connected;
+    }
+
+    bool subscribe(const char *s8_Topic)
+    {
+        return connected();
+    }
+
+    bool loop()
+    {
+        return connected();
+    }
+
+    bool publish(const char *s8_Topic, const char *s8_Payload)
+    {
+        if (!connected())
+            return false;
+
+        nativeMqttPublished++;
+        snprintf(nativeMqttLastTopic, sizeof(nativeMqttLastTopic), "%s", s8_Topic);
+        snprintf(nativeMqttLastPayload, sizeof(nativeMqttLastPayload), "%s", s8_Payload);
+        return true;
+    }
+
+private:
+    bool mb_Connected = false;
+};
+
+#endif // NATIVE_MQTT_H
@@ -0,0 +1,20 @@
+#ifndef NATIVE_SECRETS_H
+#define NATIVE_SECRETS_H
+
+// Test secrets for the host build. Never use these values on a real door.
+
+// The PICC master key (3K3DES) that AddCard() stores on the card
+const byte SECRET_PICC_MASTER_KEY[24] = {0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B,
+                                         0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27};
+
+// The keys from which the application master key and the stored value are derived
+const byte SECRET_APPLICATION_KEY[24] = {0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B,
+                                         0x3C, 0x3D, 0x3E, 0x3F, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+const byte SECRET_STORE_VALUE_KEY[24] = {0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B,
+                                         0x5C, 0x5D, 0x5E, 0x5F, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67};
+
+#define CARD_APPLICATION_ID 0xAA401F
+#define CARD_FILE_ID 0
+#define CARD_KEY_VERSION 0x10
+
+#endif // NATIVE_SECRETS_H
@@ -0,0 +1,107 @@
+#ifndef NATIVE_UTILS_H
+#define NATIVE_UTILS_H
+
+// Stand-in for the Utils and SerialClass classes of the desfire_rfid library.
+// The terminal output goes to stdout unless nativeQuiet is set, the terminal input is taken from nativeSerialInput.
+
+#include "Arduino.h"
+#include <string>
+#include <strings.h>
+
+#define LF "\r\n"
+
+bool nativeQuiet = false;
+std::string nativeSerialInput;
+
+class Utils
+{
+public:
+    static void Print(const char *s8_Text, const char *s8_LF = NULL)
+    {
+        if (!nativeQuiet)
+            printf("%s%s", s8_Text, s8_LF ? s8_LF : "");
+    }
+
+    static void PrintDec(int s32_Data, const char *s8_LF = NULL)
+    {
+        char s8_Buf[20];
+        sprintf(s8_Buf, "%d", s32_Data);
+        Print(s8_Buf, s8_LF);
+    }
+
+    static void PrintHexBuf(const byte *u8_Data, const uint32_t u32_DataLen, const char *s8_LF = NULL, int s32_Brace1 = -1, int s32_Brace2 = -1)
+    {
+        for (uint32_t i = 0; i < u32_DataLen && !nativeQuiet; i++)
+        {
+            printf("%02X ", u8_Data[i]);
+        }
+        Print("", s8_LF);
+    }
+
+    static void PrintInterval(uint64_t u64_Time, const char *s8_LF = NULL)
+    {
+        char s8_Buf[30];
+        sprintf(s8_Buf, "%u ms", (uint32_t)u64_Time);
+        Print(s8_Buf, s8_LF);
+    }
+
+    static uint64_t GetMillis64()
+    {
+        return NativeMicros64() / 1000;
+    }
+
+    static void DelayMilli(int s32_MilliSeconds)
+    {
+        delay(s32_MilliSeconds);
+    }
+
+    static void SetPinMode(byte u8_Pin, byte u8_Mode)
+    {
+        pinMode(u8_Pin, u8_Mode);
+    }
+
+    static void WritePin(byte u8_Pin, byte u8_Status)
+    {
+        digitalWrite(u8_Pin, u8_Status);
+    }
+
+    static void GenerateRandom(byte *u8_Random, int s32_Length)
+    {
+        for (int i = 0; i < s32_Length; i++)
+        {
+            u8_Random[i] = (byte)rand();
+        }
+    }
+
+    static int stricmp(const char *str1, const char *str2)
+    {
+        return strcasecmp(str1, str2);
+    }
+
+    static int strnicmp(const char *str1, const char *str2, uint32_t u32_MaxCount)
+    {
+        return strncasecmp(str1, str2, u32_MaxCount);
+    }
+};
+
+class SerialClass
+{
+public:
+    static bool Available()
+    {
+        return !nativeSerialInput.empty();
+    }
+
+    // Returns 0 if no character is available
+    static byte Read()
+    {
+        if (nativeSerialInput.empty())
+            return 0;
+
+        byte u8_Char = nativeSerialInput[0];
+        nativeSerialInput.erase(0, 1);
+        return u8_Char;
+    }
+};
+
+#endif // NATIVE_UTILS_H
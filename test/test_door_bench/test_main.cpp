@@ -0,0 +1,413 @@
+// End-to-end benchmarks of the card pipeline on the host: pio test -e native -v
+//
+// DoorOpener runs unmodified against the simulated PN532 and DESFire cards of test/native/Desfire.h.
+// The simulated clock advances by the bus time of each frame (see SimulatedTransport) and by the delays of the
+// firmware, so the tap-to-relay times below are what a reader on that bus would show, not the host CPU time.
+// The tap-to-relay time is measured from placing the card until the relay pin goes HIGH and therefore includes
+// the wait for the next poll.
+
+#include <unity.h>
+#include "Utils.h"
+#include "DoorOpener.h"
+
+// The number of taps per card and transport
+#define BENCH_TAPS 20
+
+// The longest time a tap, a command or the closing of the door may take (simulated milliseconds)
+#define BENCH_TIMEOUT 60000
+
+DoorOpener doorOpener;
+
+SimulatedCard aliceCard(0x04A1B2C3D4E5F6ull, true);
+SimulatedCard bobCard(0x04112233445566ull, true);
+SimulatedCard unknownCard(0x04778899AABBCCull, true);
+SimulatedCard classicCard(0xDEADBEEFull, false);
+
+// Soft SPI with 10 kHz clock, hardware SPI with 1 MHz, I2C with 400 kHz (9 clocks per byte)
+SimulatedTransport softSpiBus(1250);
+SimulatedTransport hardSpiBus(125000);
+SimulatedTransport i2cBus(44444);
+SimulatedTransport *benchBus = &softSpiBus;
+
+kAccessEvent benchEvent;
+uint32_t benchEvents = 0;
+
+uint32_t BenchFrameMicros(uint32_t u32_Bytes)
+{
+    return benchBus->GetFrameMicros(u32_Bytes);
+}
+
+void OnAccessEvent(const kAccessEvent *pk_Event)
+{
+    benchEvent = *pk_Event;
+    benchEvents++;
+}
+
+// Runs the main loop for u32_Millis of simulated time
+void RunFor(uint32_t u32_Millis)
+{
+    uint64_t u64_End = Utils::GetMillis64() + u32_Millis;
+    while (Utils::GetMillis64() < u64_End)
+    {
+        doorOpener.loop();
+        delay(1);
+    }
+}
+
+// Runs the main loop until the card pipeline is idle and both doors are closed
+void RunUntilIdle()
+{
+    uint64_t u64_End = Utils::GetMillis64() + BENCH_TIMEOUT;
+    do
+    {
+        doorOpener.loop();
+        delay(1);
+    } while ((doorOpener.GetCardState() != CARD_IDLE || doorOpener.IsDoorOpen(0) || doorOpener.IsDoorOpen(1)) &&
+             Utils::GetMillis64() < u64_End);
+
+    TEST_ASSERT_EQUAL(CARD_IDLE, doorOpener.GetCardState());
+}
+
+// Runs the main loop until the relay at u8_Pin has been switched off, returns the longest loop period (microseconds)
+uint32_t RunUntilClosed(byte u8_Pin)
+{
+    uint32_t u32_MaxPeriod = 0;
+    uint64_t u64_End = Utils::GetMillis64() + BENCH_TIMEOUT;
+    while (nativePinLevel[u8_Pin] == HIGH && Utils::GetMillis64() < u64_End)
+    {
+        uint32_t u32_Start = micros();
+        doorOpener.loop();
+        delay(1);
+        u32_MaxPeriod = max(u32_MaxPeriod, (uint32_t)(micros() - u32_Start));
+    }
+    TEST_ASSERT_EQUAL(LOW, nativePinLevel[u8_Pin]);
+    return u32_MaxPeriod;
+}
+
+// Runs the main loop until the relay at u8_Pin has been switched on
+void RunUntilOpen(byte u8_Pin)
+{
+    uint64_t u64_End = Utils::GetMillis64() + BENCH_TIMEOUT;
+    while (nativePinLevel[u8_Pin] != HIGH && Utils::GetMillis64() < u64_End)
+    {
+        doorOpener.loop();
+        delay(1);
+    }
+    TEST_ASSERT_EQUAL(HIGH, nativePinLevel[u8_Pin]);
+}
+
+// The relay has been held for OPEN_INTERVAL, the close is late by at most one loop period.
+// The interval is counted in milliseconds, so it may also end up to 1 ms early.
+void AssertHold(uint32_t u32_Opened, uint32_t u32_Closed, uint32_t u32_Period)
+{
+    uint32_t u32_Hold = u32_Closed - u32_Opened;
+    TEST_ASSERT_TRUE(u32_Hold + 1000 >= OPEN_INTERVAL * 1000);
+    TEST_ASSERT_TRUE(u32_Hold <= OPEN_INTERVAL * 1000 + u32_Period);
+}
+
+// Logs in, executes s8_Command with the card pk_Card in the RF field and logs out.
+// s8_Keys are typed after the command (e.g. "Y" to confirm).
+void RunCommand(const char *s8_Command, const char *s8_Keys, SimulatedCard *pk_Card)
+{
+    RunUntilIdle();
+    desfireSim.PlaceCard(pk_Card);
+
+    nativeSerialInput = std::string(PASSWORD "\r") + s8_Command + "\r" + s8_Keys + "EXIT\r";
+    uint64_t u64_End = Utils::GetMillis64() + BENCH_TIMEOUT;
+    while (!nativeSerialInput.empty() && Utils::GetMillis64() < u64_End)
+    {
+        doorOpener.loop();
+        delay(1);
+    }
+    TEST_ASSERT_TRUE(nativeSerialInput.empty());
+
+    // The card stays away for at least one poll, otherwise the next tap of the same card is ignored
+    desfireSim.RemoveCard();
+    RunFor(POLL_INTERVAL_IDLE);
+    RunUntilIdle();
+}
+
+struct kTapResult
+{
+    uint32_t u32_RelayMicros;   // from placing the card until the relay has been switched, 0 if no door opened
+    uint32_t u32_DecisionMillis; // kAccessEvent::u16_TotalMillis
+    uint32_t u32_Frames;         // frames on the bus until the decision
+    uint32_t u32_CardCommands;   // commands that reached the card until the decision
+    uint32_t u32_StepMicros;     // the longest doorOpener.loop() call until the decision
+    uint32_t u32_StepCommands;   // the most card commands sent by one doorOpener.loop() call
+    byte u8_PN532Error;          // GetLastPN532Error() at the decision
+    eAccessResult e_Result;
+};
+
+// Holds the card to the reader until the decision has been made and the relay has been switched
+void Tap(SimulatedCard *pk_Card, kTapResult *pk_Tap)
+{
+    RunUntilIdle();
+    memset(pk_Tap, 0, sizeof(kTapResult));
+
+    benchEvents = 0;
+    desfireSim.ResetStats();
+    uint32_t u32_Start = micros();
+    desfireSim.PlaceCard(pk_Card);
+
+    uint64_t u64_End = Utils::GetMillis64() + BENCH_TIMEOUT;
+    while (benchEvents == 0 && Utils::GetMillis64() < u64_End)
+    {
+        uint32_t u32_Commands = desfireSim.GetCardCommandCount();
+        uint32_t u32_Step = micros();
+        doorOpener.loop();
+        pk_Tap->u32_StepMicros = max(pk_Tap->u32_StepMicros, (uint32_t)(micros() - u32_Step));
+        pk_Tap->u32_StepCommands = max(pk_Tap->u32_StepCommands, desfireSim.GetCardCommandCount() - u32_Commands);
+        delay(1);
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, benchEvents);
+
+    // Each step of the card pipeline sends at most one command to the card (Authenticate has two frames)
+    TEST_ASSERT_TRUE(pk_Tap->u32_StepCommands <= 2);
+
+    pk_Tap->e_Result = (eAccessResult)benchEvent.u8_Result;
+    pk_Tap->u32_DecisionMillis = benchEvent.u16_TotalMillis;
+    pk_Tap->u32_Frames = desfireSim.GetFrameCount();
+    pk_Tap->u32_CardCommands = desfireSim.GetCardCommandCount();
+
+    Desfire i_Reader;
+    pk_Tap->u8_PN532Error = i_Reader.GetLastPN532Error();
+
+    if (benchEvent.u8_Doors & DOOR_ONE)
+    {
+        // The relay is switched in the same step that reports the access
+        while (nativePinLevel[DOOR_1_PIN] != HIGH && Utils::GetMillis64() < u64_End)
+        {
+            doorOpener.loop();
+            delay(1);
+        }
+        TEST_ASSERT_EQUAL(HIGH, nativePinLevel[DOOR_1_PIN]);
+        pk_Tap->u32_RelayMicros = nativePinChanged[DOOR_1_PIN] - u32_Start;
+    }
+
+    desfireSim.RemoveCard();
+    RunUntilIdle();
+    TEST_ASSERT_EQUAL(LOW, nativePinLevel[DOOR_1_PIN]);
+}
+
+// Taps pk_Card BENCH_TAPS times and prints one row of the table
+void BenchTaps(const char *s8_Bus, const char *s8_Card, SimulatedCard *pk_Card, eAccessResult e_Expected)
+{
+    uint64_t u64_RelaySum = 0;
+    uint32_t u32_RelayMax = 0;
+    uint32_t u32_DecisionSum = 0;
+    uint32_t u32_FrameSum = 0;
+    uint32_t u32_CommandSum = 0;
+    uint32_t u32_StepMax = 0;
+
+    kTapResult k_Tap;
+    for (int i = 0; i < BENCH_TAPS; i++)
+    {
+        Tap(pk_Card, &k_Tap);
+        TEST_ASSERT_EQUAL_STRING(ACCESS_RESULT_NAMES[e_Expected], ACCESS_RESULT_NAMES[k_Tap.e_Result]);
+
+        u64_RelaySum += k_Tap.u32_RelayMicros;
+        u32_RelayMax = max(u32_RelayMax, k_Tap.u32_RelayMicros);
+        u32_DecisionSum += k_Tap.u32_DecisionMillis;
+        u32_FrameSum += k_Tap.u32_Frames;
+        u32_CommandSum += k_Tap.u32_CardCommands;
+        u32_StepMax = max(u32_StepMax, k_Tap.u32_StepMicros);
+    }
+
+    printf("%-10s %-14s %-16s %10.1f %10.1f %11.1f %8.1f %9.1f %11.1f\n", s8_Bus, s8_Card, ACCESS_RESULT_NAMES[e_Expected],
+           u64_RelaySum / 1000.0 / BENCH_TAPS, u32_RelayMax / 1000.0, (double)u32_DecisionSum / BENCH_TAPS,
+           (double)u32_FrameSum / BENCH_TAPS, (double)u32_CommandSum / BENCH_TAPS, u32_StepMax / 1000.0);
+}
+
+void BenchBus(const char *s8_Bus, SimulatedTransport *pi_Bus)
+{
+    benchBus = pi_Bus;
+    BenchTaps(s8_Bus, "desfire", &aliceCard, ACCESS_GRANTED);
+    BenchTaps(s8_Bus, "desfire random", &bobCard, ACCESS_GRANTED);
+    BenchTaps(s8_Bus, "desfire", &unknownCard, ACCESS_UNKNOWN);
+    BenchTaps(s8_Bus, "classic", &classicCard, ACCESS_UNKNOWN);
+}
+
+void test_add_card()
+{
+    RunUntilIdle();
+    desfireSim.ResetStats();
+    uint64_t u64_Start = Utils::GetMillis64();
+    RunCommand("ADD Alice", "", &aliceCard);
+    printf("\nADD (soft SPI) took %u ms, %u card commands\n", (uint32_t)(Utils::GetMillis64() - u64_Start),
+           desfireSim.GetCardCommandCount());
+
+    kUser k_User;
+    TEST_ASSERT_TRUE(UserManager::FindUser(aliceCard.GetUID(), &k_User));
+    TEST_ASSERT_EQUAL_STRING("Alice", k_User.s8_Name);
+    TEST_ASSERT_EQUAL_UINT8(CARD_KEY_VERSION, aliceCard.GetPiccKeyVersion());
+    TEST_ASSERT_EQUAL_UINT32(1, aliceCard.GetApplicationCount());
+
+    // A Classic card cannot be personalized
+    RunCommand("ADD Carol", "", &classicCard);
+    TEST_ASSERT_EQUAL_UINT32(1, UserManager::GetUserCount());
+}
+
+void test_make_random_card()
+{
+    RunCommand("MAKERANDOM", "Y", &bobCard);
+    TEST_ASSERT_TRUE(bobCard.IsRandomID());
+
+    RunCommand("ADD Bob", "", &bobCard);
+    kUser k_User;
+    TEST_ASSERT_TRUE(UserManager::FindUser(bobCard.GetUID(), &k_User));
+    TEST_ASSERT_EQUAL_STRING("Bob", k_User.s8_Name);
+    TEST_ASSERT_EQUAL_UINT8(CARD_KEY_VERSION, bobCard.GetPiccKeyVersion());
+
+    // The real UID is read with the PICC master key, no application is required
+    TEST_ASSERT_EQUAL_UINT32(0, bobCard.GetApplicationCount());
+}
+
+void test_tap_latency()
+{
+    printf("\n%-10s %-14s %-16s %10s %10s %11s %8s %9s %11s\n", "bus", "card", "result", "relay ms", "max ms",
+           "decision ms", "frames", "card cmds", "max step ms");
+    BenchBus("soft SPI", &softSpiBus);
+    BenchBus("hard SPI", &hardSpiBus);
+    BenchBus("I2C", &i2cBus);
+    benchBus = &softSpiBus;
+}
+
+void test_card_timeout()
+{
+    // The card leaves the field during the authentication
+    kTapResult k_Tap;
+    desfireSim.InjectTimeout(3);
+    Tap(&aliceCard, &k_Tap);
+    TEST_ASSERT_EQUAL_STRING(ACCESS_RESULT_NAMES[ACCESS_TIMEOUT], ACCESS_RESULT_NAMES[k_Tap.e_Result]);
+    TEST_ASSERT_EQUAL_UINT32(0, k_Tap.u32_RelayMicros);
+    TEST_ASSERT_EQUAL_HEX8(0x01, k_Tap.u8_PN532Error);
+    TEST_ASSERT_EQUAL_UINT32(1, desfireSim.GetTimeoutCount());
+
+    // The next tap succeeds
+    Tap(&aliceCard, &k_Tap);
+    TEST_ASSERT_EQUAL_STRING(ACCESS_RESULT_NAMES[ACCESS_GRANTED], ACCESS_RESULT_NAMES[k_Tap.e_Result]);
+}
+
+void test_open_door()
+{
+    RunUntilIdle();
+    desfireSim.ResetStats();
+    uint32_t u32_Start = micros();
+    doorOpener.OpenDoor(DOOR_TWO);
+    TEST_ASSERT_EQUAL(HIGH, nativePinLevel[DOOR_2_PIN]);
+    TEST_ASSERT_EQUAL(LOW, nativePinLevel[DOOR_1_PIN]);
+    printf("\nOpenDoor took %u us, %u frames\n", nativePinChanged[DOOR_2_PIN] - u32_Start, desfireSim.GetFrameCount());
+
+    RunUntilIdle();
+    TEST_ASSERT_EQUAL(LOW, nativePinLevel[DOOR_2_PIN]);
+}
+
+void test_relays()
+{
+    // The hold time is OPEN_INTERVAL
+    RunUntilIdle();
+    doorOpener.OpenDoor(DOOR_ONE);
+    TEST_ASSERT_EQUAL(HIGH, nativePinLevel[DOOR_1_PIN]);
+    uint32_t u32_Open1 = nativePinChanged[DOOR_1_PIN];
+    uint32_t u32_Period = RunUntilClosed(DOOR_1_PIN);
+    AssertHold(u32_Open1, nativePinChanged[DOOR_1_PIN], u32_Period);
+
+    // Door 2 is opened while door 1 is open: each door keeps its own interval
+    RunUntilIdle();
+    doorOpener.OpenDoor(DOOR_ONE);
+    u32_Open1 = nativePinChanged[DOOR_1_PIN];
+    RunFor(OPEN_INTERVAL / 2);
+    doorOpener.OpenDoor(DOOR_TWO);
+    uint32_t u32_Open2 = nativePinChanged[DOOR_2_PIN];
+    TEST_ASSERT_EQUAL(HIGH, nativePinLevel[DOOR_1_PIN]);
+    TEST_ASSERT_EQUAL(HIGH, nativePinLevel[DOOR_2_PIN]);
+    TEST_ASSERT_EQUAL_UINT32(u32_Open1, nativePinChanged[DOOR_1_PIN]);
+
+    u32_Period = RunUntilClosed(DOOR_1_PIN);
+    AssertHold(u32_Open1, nativePinChanged[DOOR_1_PIN], u32_Period);
+    TEST_ASSERT_EQUAL(HIGH, nativePinLevel[DOOR_2_PIN]);
+    u32_Period = max(u32_Period, RunUntilClosed(DOOR_2_PIN));
+    AssertHold(u32_Open2, nativePinChanged[DOOR_2_PIN], u32_Period);
+
+    // The same card is tapped again while the door is open: the relay stays on and the interval starts again
+    RunUntilIdle();
+    desfireSim.PlaceCard(&aliceCard);
+    RunUntilOpen(DOOR_1_PIN);
+    u32_Open1 = nativePinChanged[DOOR_1_PIN];
+    desfireSim.RemoveCard();
+    RunFor(OPEN_INTERVAL / 2);
+
+    // The interval is extended at the start of the step that decides
+    desfireSim.PlaceCard(&aliceCard);
+    uint64_t u64_End = Utils::GetMillis64() + BENCH_TIMEOUT;
+    uint32_t u32_Extended = 0;
+    while (doorOpener.GetCardState() != CARD_RELEASE && Utils::GetMillis64() < u64_End)
+    {
+        u32_Extended = micros();
+        doorOpener.loop();
+        delay(1);
+    }
+    TEST_ASSERT_EQUAL(CARD_RELEASE, doorOpener.GetCardState());
+    desfireSim.RemoveCard();
+
+    TEST_ASSERT_EQUAL(HIGH, nativePinLevel[DOOR_1_PIN]);
+    TEST_ASSERT_EQUAL_UINT32(u32_Open1, nativePinChanged[DOOR_1_PIN]);
+    u32_Period = RunUntilClosed(DOOR_1_PIN);
+    AssertHold(u32_Extended, nativePinChanged[DOOR_1_PIN], u32_Period);
+}
+
+void test_restore_card()
+{
+    RunCommand("RESTORE", "", &aliceCard);
+    TEST_ASSERT_EQUAL_UINT8(0, aliceCard.GetPiccKeyVersion());
+    TEST_ASSERT_EQUAL_UINT32(0, aliceCard.GetApplicationCount());
+
+    kUser k_User;
+    TEST_ASSERT_FALSE(UserManager::FindUser(aliceCard.GetUID(), &k_User));
+
+    kTapResult k_Tap;
+    Tap(&aliceCard, &k_Tap);
+    TEST_ASSERT_EQUAL_STRING(ACCESS_RESULT_NAMES[ACCESS_UNKNOWN], ACCESS_RESULT_NAMES[k_Tap.e_Result]);
+}
+
+void test_stats()
+{
+    // The latency histograms of DoorOpener over all taps above
+    nativeQuiet = false;
+    RunCommand("STATS", "", NULL);
+    nativeQuiet = true;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int main(int argc, char **argv)
+{
+    nativeQuiet = true;
+    desfireSim.SetFrameLatency(&BenchFrameMicros);
+
+    // Start with an empty database
+    SPIFFS.begin();
+    SPIFFS.remove(DB_FILE);
+    SPIFFS.remove(DB_JOURNAL_FILE);
+
+    doorOpener.SetAccessCallback(&OnAccessEvent);
+    doorOpener.setup();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_add_card);
+    RUN_TEST(test_make_random_card);
+    RUN_TEST(test_tap_latency);
+    RUN_TEST(test_card_timeout);
+    RUN_TEST(test_open_door);
+    RUN_TEST(test_relays);
+    RUN_TEST(test_restore_card);
+    RUN_TEST(test_stats);
+    return UNITY_END();
+}
@@ -0,0 +1,183 @@
+// Checks that MqttClient does not allocate heap memory after setup(): pio test -e native -v
+//
+// The global operator new and (with glibc) malloc(), calloc() and realloc() are replaced by versions that count
+// the allocations. The MQTT library and the WiFi classes are stand-ins (test/native/MQTT.h, ESP8266WiFi.h),
+// so only the allocations of MqttClient itself are counted.
+
+#include <unity.h>
+#include <new>
+#include "Utils.h"
+#include "MqttClient.h"
+
+// The number of messages per test, several times MQTT_QUEUE_SIZE
+#define ALLOC_MESSAGES 100
+
+uint32_t allocCount = 0;
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+    allocCount++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    allocCount++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    allocCount++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+void *operator new(size_t size)
+{
+    allocCount++;
+    void *ptr = malloc(size);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+MqttClient mqttClient;
+
+void setUp()
+{
+    nativeMqttBrokerUp = true;
+}
+
+void tearDown()
+{
+}
+
+// Connects (if necessary) and sends all queued messages
+void Flush()
+{
+    for (int i = 0; i < MQTT_QUEUE_SIZE; i++)
+    {
+        mqttClient.loop();
+    }
+    TEST_ASSERT_TRUE(mqttClient.isConnected());
+    TEST_ASSERT_EQUAL_UINT32(0, mqttClient.getQueueLength());
+}
+
+// publish(), publishf(), reserve() + commit() and loop() while the broker is connected
+void test_publish_connected()
+{
+    Flush();
+    uint32_t u32_Published = nativeMqttPublished;
+
+    allocCount = 0;
+    for (uint32_t i = 0; i < ALLOC_MESSAGES; i++)
+    {
+        mqttClient.debug("debug message");
+        mqttClient.info("info message");
+        mqttClient.publishf(MQTT_TOPIC_EVENTS, "[{\"t\":%u,\"result\":\"%s\"}]", i, "granted");
+
+        char *payload = mqttClient.reserve(MQTT_TOPIC_USERS_RESULT);
+        TEST_ASSERT_TRUE(payload != NULL);
+        snprintf(payload, MQTT_PAYLOAD_SIZE, "{\"id\":\"%u\",\"ok\":1}", i);
+        mqttClient.commit();
+
+        mqttClient.loop();
+    }
+    uint32_t u32_Allocs = allocCount;
+
+    TEST_ASSERT_EQUAL_UINT32(0, u32_Allocs);
+    TEST_ASSERT_EQUAL_UINT32(4 * ALLOC_MESSAGES, nativeMqttPublished - u32_Published);
+    TEST_ASSERT_EQUAL_STRING("iot/doorguard/users/result", nativeMqttLastTopic);
+}
+
+// While the broker is down the queue overflows and loop() tries to reconnect
+void test_publish_disconnected()
+{
+    Flush();
+    nativeMqttBrokerUp = false;
+    uint32_t u32_Overflows = mqttClient.getOverflowCount();
+    uint32_t u32_Failed = mqttClient.getConnectFailedCount();
+
+    allocCount = 0;
+    for (uint32_t i = 0; i < ALLOC_MESSAGES; i++)
+    {
+        mqttClient.info("info message");
+        mqttClient.publishf(MQTT_TOPIC_EVENTS, "%u", i);
+        mqttClient.connect(); // the next loop() tries to reconnect
+        mqttClient.loop();
+    }
+    uint32_t u32_Allocs = allocCount;
+
+    TEST_ASSERT_EQUAL_UINT32(0, u32_Allocs);
+    TEST_ASSERT_EQUAL_UINT32(MQTT_QUEUE_SIZE, mqttClient.getQueueLength());
+    TEST_ASSERT_EQUAL_UINT32(2 * ALLOC_MESSAGES - MQTT_QUEUE_SIZE, mqttClient.getOverflowCount() - u32_Overflows);
+    TEST_ASSERT_EQUAL_UINT32(ALLOC_MESSAGES, mqttClient.getConnectFailedCount() - u32_Failed);
+
+    // After the reconnect the queued messages are sent, the hello message is queued behind them
+    nativeMqttBrokerUp = true;
+    mqttClient.connect();
+    Flush();
+}
+
+// A message that is too long is dropped without displacing a queued message
+void test_too_long()
+{
+    static char s8_Long[MQTT_PAYLOAD_SIZE + 1];
+    memset(s8_Long, 'x', MQTT_PAYLOAD_SIZE);
+    s8_Long[MQTT_PAYLOAD_SIZE] = 0;
+
+    nativeMqttBrokerUp = false;
+    for (int i = 0; i < MQTT_QUEUE_SIZE; i++)
+    {
+        mqttClient.info("queued");
+    }
+    uint32_t u32_Overflows = mqttClient.getOverflowCount();
+    uint32_t u32_Dropped = mqttClient.getDroppedCount();
+
+    allocCount = 0;
+    mqttClient.info(s8_Long);
+    mqttClient.publishf(MQTT_TOPIC_INFO, "%s!", s8_Long + 1);
+    TEST_ASSERT_EQUAL_UINT32(0, allocCount);
+
+    TEST_ASSERT_EQUAL_UINT32(MQTT_QUEUE_SIZE, mqttClient.getQueueLength());
+    TEST_ASSERT_EQUAL_UINT32(u32_Overflows, mqttClient.getOverflowCount());
+    TEST_ASSERT_EQUAL_UINT32(u32_Dropped + 2, mqttClient.getDroppedCount());
+
+    nativeMqttBrokerUp = true;
+    mqttClient.connect();
+    Flush();
+}
+
+int main(int argc, char **argv)
+{
+    MqttConfig config;
+    mqttClient.setup(config);
+    mqttClient.connect();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_publish_connected);
+    RUN_TEST(test_publish_disconnected);
+    RUN_TEST(test_too_long);
+    return UNITY_END();
+}
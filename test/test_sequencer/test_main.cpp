@@ -0,0 +1,188 @@
+// Plays the Sequencer patterns on a fake clock and checks the recorded buzzer and LED timeline: pio test -e native -v
+//
+// Sequencer::loop() gets the time as a parameter, so the clock is just a variable here. Only the changes of the
+// outputs are recorded (that is all Sequencer passes to the callbacks).
+
+#include <unity.h>
+#include "Sequencer.h"
+
+#define TIMELINE_SIZE 32
+
+// One change of an output
+struct kChange
+{
+    uint32_t u32_Time;
+    bool b_LED;         // true: LED changed, false: tone changed
+    uint16_t u16_Value; // the frequency or the eLED
+};
+
+Sequencer sequencer;
+uint64_t fakeNow;
+kChange timeline[TIMELINE_SIZE];
+int timelineCount;
+
+void OnTone(uint16_t u16_Frequency)
+{
+    TEST_ASSERT_TRUE(timelineCount < TIMELINE_SIZE);
+    timeline[timelineCount++] = {(uint32_t)fakeNow, false, u16_Frequency};
+}
+
+void OnLED(eLED e_LED)
+{
+    TEST_ASSERT_TRUE(timelineCount < TIMELINE_SIZE);
+    timeline[timelineCount++] = {(uint32_t)fakeNow, true, (uint16_t)e_LED};
+}
+
+// Calls loop() at u64_Time
+void LoopAt(uint64_t u64_Time)
+{
+    fakeNow = u64_Time;
+    sequencer.loop(fakeNow);
+}
+
+// Calls loop() every millisecond from now until the pattern has ended, returns the time of the end
+uint32_t PlayToEnd()
+{
+    uint64_t u64_End = fakeNow + 10000;
+    while (sequencer.IsBusy() && fakeNow < u64_End)
+    {
+        LoopAt(fakeNow + 1);
+    }
+    TEST_ASSERT_FALSE(sequencer.IsBusy());
+    return (uint32_t)fakeNow;
+}
+
+// Compares the recorded changes with k_Expected (the times are relative to u32_Start)
+void AssertTimeline(uint32_t u32_Start, const kChange *pk_Expected, int s32_Count)
+{
+    TEST_ASSERT_EQUAL_UINT32(s32_Count, timelineCount);
+    for (int i = 0; i < s32_Count; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT32(u32_Start + pk_Expected[i].u32_Time, timeline[i].u32_Time);
+        TEST_ASSERT_EQUAL(pk_Expected[i].b_LED, timeline[i].b_LED);
+        TEST_ASSERT_EQUAL_UINT32(pk_Expected[i].u16_Value, timeline[i].u16_Value);
+    }
+}
+
+// Plays e_Pattern with a loop() call every millisecond and compares the timeline
+void AssertPattern(ePattern e_Pattern, const kChange *pk_Expected, int s32_Count)
+{
+    uint32_t u32_Start = (uint32_t)fakeNow;
+    sequencer.Play(e_Pattern);
+    LoopAt(fakeNow);
+    PlayToEnd();
+    AssertTimeline(u32_Start, pk_Expected, s32_Count);
+}
+
+void setUp()
+{
+    sequencer.Stop();
+    fakeNow += 1000;
+    timelineCount = 0;
+}
+
+void tearDown()
+{
+}
+
+void test_init()
+{
+    const kChange k_Expected[] = {{0, false, 3000}, {0, true, LED_GREEN}, {200, false, 0}, {1000, true, LED_OFF}};
+    AssertPattern(PATTERN_INIT, k_Expected, 4);
+}
+
+void test_ok()
+{
+    const kChange k_Expected[] = {{0, false, 2000}, {70, false, 0}, {100, false, 3000}, {250, false, 0}};
+    AssertPattern(PATTERN_OK, k_Expected, 4);
+}
+
+void test_error()
+{
+    const kChange k_Expected[] = {{0, false, 2000}, {0, true, LED_RED}, {70, false, 0}, {100, false, 1000},
+                                  {300, false, 0}, {1000, true, LED_OFF}};
+    AssertPattern(PATTERN_ERROR, k_Expected, 6);
+}
+
+void test_timeout()
+{
+    const kChange k_Expected[] = {{0, true, LED_RED}, {200, true, LED_OFF}};
+    AssertPattern(PATTERN_TIMEOUT, k_Expected, 2);
+}
+
+void test_reader_fault()
+{
+    const kChange k_Expected[] = {{0, true, LED_RED}, {2000, true, LED_OFF}};
+    AssertPattern(PATTERN_READER_FAULT, k_Expected, 2);
+}
+
+// A late loop() call switches the outputs late, but the following steps stay anchored to the end of the
+// previous step, so the pattern is not stretched.
+void test_late_loop()
+{
+    uint32_t u32_Start = (uint32_t)fakeNow;
+    sequencer.Play(PATTERN_OK);
+    LoopAt(u32_Start);
+    LoopAt(u32_Start + 90);  // the first step has ended at 70
+    LoopAt(u32_Start + 99);  // the pause ends at 100, not at 90 + 30
+    TEST_ASSERT_EQUAL_UINT32(2, timelineCount);
+    LoopAt(u32_Start + 101);
+    LoopAt(u32_Start + 249);
+    TEST_ASSERT_TRUE(sequencer.IsBusy());
+    LoopAt(u32_Start + 250);
+    TEST_ASSERT_FALSE(sequencer.IsBusy());
+
+    const kChange k_Expected[] = {{0, false, 2000}, {90, false, 0}, {101, false, 3000}, {250, false, 0}};
+    AssertTimeline(u32_Start, k_Expected, 4);
+
+    // A loop() call after the end of the whole pattern ends it immediately with the outputs off
+    timelineCount = 0;
+    u32_Start = (uint32_t)fakeNow;
+    sequencer.Play(PATTERN_ERROR);
+    LoopAt(u32_Start);
+    LoopAt(u32_Start + 5000);
+    TEST_ASSERT_FALSE(sequencer.IsBusy());
+    TEST_ASSERT_EQUAL_UINT32(u32_Start + 5000, timeline[timelineCount - 1].u32_Time);
+    TEST_ASSERT_TRUE(timeline[timelineCount - 1].b_LED);
+    TEST_ASSERT_EQUAL_UINT32(LED_OFF, timeline[timelineCount - 1].u16_Value);
+}
+
+// A queued pattern starts when the current one ends, Play() aborts the current one
+void test_queue()
+{
+    uint32_t u32_Start = (uint32_t)fakeNow;
+    sequencer.Play(PATTERN_READER_FAULT);
+    LoopAt(u32_Start);
+    sequencer.Queue(PATTERN_INIT);
+    PlayToEnd();
+
+    const kChange k_Expected[] = {{0, true, LED_RED}, {2000, true, LED_OFF}, {2000, false, 3000},
+                                  {2000, true, LED_GREEN}, {2200, false, 0}, {3000, true, LED_OFF}};
+    AssertTimeline(u32_Start, k_Expected, 6);
+
+    timelineCount = 0;
+    u32_Start = (uint32_t)fakeNow;
+    sequencer.Play(PATTERN_ERROR);
+    LoopAt(u32_Start);
+    LoopAt(u32_Start + 50);
+    sequencer.Play(PATTERN_TIMEOUT);
+    PlayToEnd();
+
+    const kChange k_Abort[] = {{0, false, 2000}, {0, true, LED_RED}, {51, false, 0}, {251, true, LED_OFF}};
+    AssertTimeline(u32_Start, k_Abort, 4);
+}
+
+int main(int argc, char **argv)
+{
+    sequencer.Begin(&OnTone, &OnLED);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_init);
+    RUN_TEST(test_ok);
+    RUN_TEST(test_error);
+    RUN_TEST(test_timeout);
+    RUN_TEST(test_reader_fault);
+    RUN_TEST(test_late_loop);
+    RUN_TEST(test_queue);
+    return UNITY_END();
+}
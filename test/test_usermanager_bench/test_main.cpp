@@ -0,0 +1,343 @@
+// Benchmarks of the UserManager operations on the host: pio test -e native -v
+//
+// Each operation is run for all users of a database with 10, 100, 1000 and MAX_USERS users.
+// The table shows the wall time and the file accesses per operation, counted by the SPIFFS stand-in (test/native/FS.h).
+// On the ESP8266 a read or write costs far more than the wall time measured here, so the I/O columns are the
+// numbers to compare when the storage is changed.
+// The free heap of the device is simulated (nativeFreeHeap in test/native/Arduino.h), so the RAM indexes hit the same
+// limits as on the device and the large databases are searched through the B+tree.
+
+#include <unity.h>
+#include "Utils.h"
+#include "UserManager.h"
+
+// The number of lookups by name (each one is a separate search)
+#define BENCH_NAME_LOOKUPS 100
+
+// The number of users inserted by one batch in test_batch()
+#define BENCH_BATCH_SIZE 100
+
+kNativeFileStats benchStats;
+unsigned long benchStart;
+
+// A distinct 7 byte UID for each index (multiplying with an odd number is a bijection modulo 2^56)
+uint64_t BenchUid(uint32_t u32_Index)
+{
+    return ((u32_Index + 1) * 0x9E3779B97F4A7C15ull) & 0x00FFFFFFFFFFFFFFull;
+}
+
+// UIDs that are not enrolled
+uint64_t BenchUnknownUid(uint32_t u32_Index)
+{
+    return BenchUid(u32_Index + 2 * MAX_USERS);
+}
+
+void BenchName(uint32_t u32_Index, char *s8_Name)
+{
+    sprintf(s8_Name, "User %05u", u32_Index);
+}
+
+// Starts with an empty database
+void BenchReset()
+{
+    dbFile.close();
+    SPIFFS.begin();
+    SPIFFS.remove(DB_FILE);
+    SPIFFS.remove(DB_JOURNAL_FILE);
+    UserManager::InitDatabase();
+}
+
+void BenchBegin()
+{
+    benchStats = nativeFileStats;
+    benchStart = micros();
+}
+
+// Prints the averages per operation since BenchBegin()
+void BenchEnd(uint32_t u32_Users, const char *s8_Operation, uint32_t u32_Ops)
+{
+    double d_Micros = micros() - benchStart;
+    printf("%6u  %-12s %6u %10.1f %8.1f %10.1f %8.1f %10.1f %8.1f %8.2f\n", u32_Users, s8_Operation, u32_Ops,
+           d_Micros / u32_Ops,
+           (double)(nativeFileStats.u32_Reads - benchStats.u32_Reads) / u32_Ops,
+           (double)(nativeFileStats.u32_ReadBytes - benchStats.u32_ReadBytes) / u32_Ops,
+           (double)(nativeFileStats.u32_Writes - benchStats.u32_Writes) / u32_Ops,
+           (double)(nativeFileStats.u32_WriteBytes - benchStats.u32_WriteBytes) / u32_Ops,
+           (double)(nativeFileStats.u32_Seeks - benchStats.u32_Seeks) / u32_Ops,
+           (double)(nativeFileStats.u32_Flushes - benchStats.u32_Flushes) / u32_Ops);
+}
+
+void BenchUsers(uint32_t u32_Users)
+{
+    BenchReset();
+    printf("\n%6s  %-12s %6s %10s %8s %10s %8s %10s %8s %8s\n", "users", "operation", "ops", "us/op", "reads",
+           "bytes rd", "writes", "bytes wr", "seeks", "flushes");
+
+    kUser k_User;
+    uint32_t u32_Commits = dbJournal.GetCommitCount();
+    BenchBegin();
+    for (uint32_t i = 0; i < u32_Users; i++)
+    {
+        k_User = kUser();
+        k_User.ID.u64 = BenchUid(i);
+        k_User.u8_Flags = DOOR_ONE;
+        BenchName(i, k_User.s8_Name);
+        TEST_ASSERT_TRUE(UserManager::InsertUser(&k_User));
+    }
+    BenchEnd(u32_Users, "insert", u32_Users);
+    TEST_ASSERT_EQUAL_UINT32(u32_Users, UserManager::GetUserCount());
+
+    // Each insert is one transaction, also if the split of a leaf cascades up to the root
+    TEST_ASSERT_EQUAL_UINT32(u32_Users, dbJournal.GetCommitCount() - u32_Commits);
+
+    BenchBegin();
+    for (uint32_t i = 0; i < u32_Users; i++)
+    {
+        TEST_ASSERT_TRUE(UserManager::FindUser(BenchUid(i), &k_User));
+    }
+    BenchEnd(u32_Users, "find uid", u32_Users);
+
+    BenchBegin();
+    for (uint32_t i = 0; i < u32_Users; i++)
+    {
+        TEST_ASSERT_FALSE(UserManager::FindUser(BenchUnknownUid(i), &k_User));
+    }
+    BenchEnd(u32_Users, "find unknown", u32_Users);
+
+    char s8_Name[NAME_BUF_SIZE];
+    uint32_t u32_Lookups = min(u32_Users, (uint32_t)BENCH_NAME_LOOKUPS);
+    BenchBegin();
+    for (uint32_t i = 0; i < u32_Lookups; i++)
+    {
+        uint32_t u32_Index = i * (u32_Users / u32_Lookups);
+        BenchName(u32_Index, s8_Name);
+        TEST_ASSERT_TRUE(UserManager::FindUser(s8_Name, &k_User));
+        TEST_ASSERT_TRUE(k_User.ID.u64 == BenchUid(u32_Index));
+    }
+    BenchEnd(u32_Users, "find name", u32_Lookups);
+
+    BenchBegin();
+    for (uint32_t i = 0; i < u32_Users; i++)
+    {
+        TEST_ASSERT_TRUE(UserManager::SetUserFlags(BenchUid(i), DOOR_BOTH));
+    }
+    BenchEnd(u32_Users, "set flags", u32_Users);
+
+    // Opening the database includes building the UID filter and the indexes
+    dbFile.close();
+    BenchBegin();
+    UserManager::InitDatabase();
+    BenchEnd(u32_Users, "open", 1);
+    TEST_ASSERT_EQUAL_UINT32(u32_Users, UserManager::GetUserCount());
+
+    BenchBegin();
+    for (uint32_t i = 0; i < u32_Users; i++)
+    {
+        TEST_ASSERT_TRUE(UserManager::DeleteUser(BenchUid(i)));
+    }
+    BenchEnd(u32_Users, "delete", u32_Users);
+    TEST_ASSERT_EQUAL_UINT32(0, UserManager::GetUserCount());
+}
+
+void test_10_users()
+{
+    BenchUsers(10);
+}
+
+void test_100_users()
+{
+    BenchUsers(100);
+}
+
+void test_1000_users()
+{
+    BenchUsers(1000);
+}
+
+void test_max_users()
+{
+    BenchUsers(MAX_USERS);
+}
+
+// Inserts u32_Count new users with one batch
+bool BenchBatch(uint32_t u32_First, uint32_t u32_Count)
+{
+    kUser k_User;
+    UserManager::BeginBatch();
+    for (uint32_t i = u32_First; i < u32_First + u32_Count; i++)
+    {
+        k_User = kUser();
+        k_User.ID.u64 = BenchUid(i);
+        k_User.u8_Flags = DOOR_ONE;
+        BenchName(i, k_User.s8_Name);
+        UserManager::InsertUser(&k_User);
+    }
+    return UserManager::CommitBatch();
+}
+
+// A batch is written with one commit however many pages it modifies, and a power failure before the commit
+// leaves the database unchanged.
+void test_batch()
+{
+    BenchReset();
+    for (uint32_t i = 0; i < MAX_USERS / 2; i += BENCH_BATCH_SIZE)
+    {
+        TEST_ASSERT_TRUE(BenchBatch(i, BENCH_BATCH_SIZE));
+    }
+    uint32_t u32_Users = UserManager::GetUserCount();
+
+    uint32_t u32_Commits = dbJournal.GetCommitCount();
+    BenchBegin();
+    TEST_ASSERT_TRUE(BenchBatch(u32_Users, BENCH_BATCH_SIZE));
+    BenchEnd(u32_Users, "batch insert", BENCH_BATCH_SIZE);
+    TEST_ASSERT_EQUAL_UINT32(1, dbJournal.GetCommitCount() - u32_Commits);
+    TEST_ASSERT_EQUAL_UINT32(u32_Users + BENCH_BATCH_SIZE, UserManager::GetUserCount());
+
+    // The power fails in the middle of a batch: the pages in the journal have no commit record
+    kUser k_User;
+    UserManager::BeginBatch();
+    for (uint32_t i = 0; i < BENCH_BATCH_SIZE; i++)
+    {
+        TEST_ASSERT_TRUE(UserManager::DeleteUser(BenchUid(i)));
+    }
+    TEST_ASSERT_TRUE(SPIFFS.exists(DB_JOURNAL_FILE));
+    dbFile.close();
+    UserManager::InitDatabase();
+
+    TEST_ASSERT_EQUAL_UINT32(u32_Users + BENCH_BATCH_SIZE, UserManager::GetUserCount());
+    for (uint32_t i = 0; i < u32_Users + BENCH_BATCH_SIZE; i++)
+    {
+        TEST_ASSERT_TRUE(UserManager::FindUser(BenchUid(i), &k_User));
+    }
+
+    // A batch that modifies more than JOURNAL_MAX_PAGES pages fails as a whole
+    TEST_ASSERT_FALSE(BenchBatch(u32_Users + BENCH_BATCH_SIZE, 10 * JOURNAL_MAX_PAGES));
+    TEST_ASSERT_EQUAL_UINT32(u32_Users + BENCH_BATCH_SIZE, UserManager::GetUserCount());
+    TEST_ASSERT_FALSE(UserManager::FindUser(BenchUid(u32_Users + BENCH_BATCH_SIZE), &k_User));
+}
+
+// The commit record has been written, but the data file cannot be written (or the power fails while it is written):
+// the committed journal is replayed at the next start
+void test_replay()
+{
+    BenchReset();
+    TEST_ASSERT_TRUE(BenchBatch(0, 2 * BENCH_BATCH_SIZE));
+
+    UserManager::BeginBatch();
+    for (uint32_t i = 0; i < BENCH_BATCH_SIZE; i++)
+    {
+        TEST_ASSERT_TRUE(UserManager::DeleteUser(BenchUid(i)));
+    }
+
+    // All writes to the data file fail from now on
+    dbFile.close();
+    dbFile = SPIFFS.open(DB_FILE, "r");
+    TEST_ASSERT_TRUE(UserManager::CommitBatch());
+    TEST_ASSERT_TRUE(SPIFFS.exists(DB_JOURNAL_FILE));
+
+    dbFile.close();
+    UserManager::InitDatabase();
+    TEST_ASSERT_FALSE(SPIFFS.exists(DB_JOURNAL_FILE));
+
+    kUser k_User;
+    TEST_ASSERT_EQUAL_UINT32(BENCH_BATCH_SIZE, UserManager::GetUserCount());
+    for (uint32_t i = 0; i < 2 * BENCH_BATCH_SIZE; i++)
+    {
+        TEST_ASSERT_EQUAL(i >= BENCH_BATCH_SIZE, UserManager::FindUser(BenchUid(i), &k_User));
+    }
+}
+
+// The journal cannot be created (a directory blocks its path): the modification fails and nothing is changed
+void test_write_failure()
+{
+    BenchReset();
+    TEST_ASSERT_TRUE(BenchBatch(0, BENCH_BATCH_SIZE));
+
+    mkdir(NATIVE_FS_ROOT DB_JOURNAL_FILE, 0777);
+    TEST_ASSERT_FALSE(UserManager::SetUserFlags(BenchUid(0), DOOR_BOTH));
+    SPIFFS.remove(DB_JOURNAL_FILE);
+
+    kUser k_User;
+    TEST_ASSERT_TRUE(UserManager::FindUser(BenchUid(0), &k_User));
+    TEST_ASSERT_EQUAL_UINT8(DOOR_ONE, k_User.u8_Flags);
+    dbFile.close();
+    UserManager::InitDatabase();
+    TEST_ASSERT_TRUE(UserManager::FindUser(BenchUid(0), &k_User));
+    TEST_ASSERT_EQUAL_UINT8(DOOR_ONE, k_User.u8_Flags);
+
+    TEST_ASSERT_TRUE(UserManager::SetUserFlags(BenchUid(0), DOOR_BOTH));
+    TEST_ASSERT_TRUE(UserManager::FindUser(BenchUid(0), &k_User));
+    TEST_ASSERT_EQUAL_UINT8(DOOR_BOTH, k_User.u8_Flags);
+}
+
+// Looks up every 37th of u32_Users users by UID and name, and as many unknown UIDs
+void BenchLookups(uint32_t u32_Users)
+{
+    kUser k_User;
+    char s8_Name[NAME_BUF_SIZE];
+    for (uint32_t i = 0; i < u32_Users; i += 37)
+    {
+        TEST_ASSERT_TRUE(UserManager::FindUser(BenchUid(i), &k_User));
+        TEST_ASSERT_FALSE(UserManager::FindUser(BenchUnknownUid(i), &k_User));
+        BenchName(i, s8_Name);
+        TEST_ASSERT_TRUE(UserManager::FindUser(s8_Name, &k_User));
+    }
+}
+
+// The RAM indexes stay within their size limits and leave DB_HEAP_FLOOR free, the lookups fall back to the B+tree
+void test_heap_floor()
+{
+    BenchReset();
+    for (uint32_t i = 0; i < 1000; i += BENCH_BATCH_SIZE)
+    {
+        TEST_ASSERT_TRUE(BenchBatch(i, BENCH_BATCH_SIZE));
+    }
+    TEST_ASSERT_TRUE(uidFilter.IsValid());
+    TEST_ASSERT_EQUAL_UINT32(FILTER_MAX_PRINT_BITS, uidFilter.GetPrintBits());
+    TEST_ASSERT_TRUE(uidFilter.GetMemoryUsage() <= DB_FILTER_MAX_BYTES);
+    TEST_ASSERT_TRUE(uidIndex.GetMemoryUsage() <= DB_UID_INDEX_MAX_BYTES);
+    TEST_ASSERT_TRUE(nameIndex.GetMemoryUsage() <= DB_NAME_INDEX_MAX_BYTES);
+
+    // The filter shrinks its fingerprints to fit, the indexes are disabled
+    uint32_t u32_Heap = nativeFreeHeap;
+    nativeFreeHeap = DB_HEAP_FLOOR + 1024;
+    dbFile.close();
+    UserManager::InitDatabase();
+    TEST_ASSERT_TRUE(uidFilter.IsValid());
+    TEST_ASSERT_TRUE(uidFilter.GetPrintBits() < FILTER_MAX_PRINT_BITS);
+    TEST_ASSERT_TRUE(uidFilter.GetMemoryUsage() <= 1024);
+    TEST_ASSERT_FALSE(uidIndex.IsValid());
+    TEST_ASSERT_FALSE(nameIndex.IsValid());
+    BenchLookups(1000);
+
+    // No heap above the floor at all
+    nativeFreeHeap = DB_HEAP_FLOOR;
+    dbFile.close();
+    UserManager::InitDatabase();
+    TEST_ASSERT_FALSE(uidFilter.IsValid());
+    BenchLookups(1000);
+
+    nativeFreeHeap = u32_Heap;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_10_users);
+    RUN_TEST(test_100_users);
+    RUN_TEST(test_1000_users);
+    RUN_TEST(test_max_users);
+    RUN_TEST(test_batch);
+    RUN_TEST(test_replay);
+    RUN_TEST(test_write_failure);
+    RUN_TEST(test_heap_floor);
+    return UNITY_END();
+}